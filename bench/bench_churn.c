@@ -0,0 +1,70 @@
+// 反复启动和退出大量服务，测量每个服务的开销和退出后内存是否还给系统
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVICES 10000
+#define ROUND 5
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+static double
+_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static size_t
+_rss(void) {
+	FILE * f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	unsigned long size = 0, rss = 0;
+	if (fscanf(f, "%lu %lu", &size, &rss) != 2)
+		rss = 0;
+	fclose(f);
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+int
+main() {
+	test_init();
+	test_module("churn", _init, NULL);
+	static struct skynet_context * ctx[SERVICES];
+	size_t base = malloc_used_memory();
+	int r, i;
+	for (r=0;r<ROUND;r++) {
+		double t = _now();
+		for (i=0;i<SERVICES;i++) {
+			ctx[i] = skynet_context_new("churn", NULL);
+			CHECK(ctx[i]);
+		}
+		double launch = _now() - t;
+		size_t peak = malloc_used_memory() - base;
+		size_t peak_rss = _rss();
+		t = _now();
+		for (i=0;i<SERVICES;i++) {
+			skynet_command(ctx[i], "EXIT", NULL);
+		}
+		test_dispatch(); // 丢弃队列，交还 slab 中队列的部分
+		double exit = _now() - t;
+		printf("round %d : launch %.2f us exit %.2f us, used %zuK -> %zuK, rss %zuK -> %zuK\n",
+			r, launch * 1e6 / SERVICES, exit * 1e6 / SERVICES,
+			peak >> 10, (malloc_used_memory() - base) >> 10, peak_rss >> 10, _rss() >> 10);
+	}
+	return 0;
+}
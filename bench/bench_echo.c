@@ -0,0 +1,210 @@
+// socket 线程的回显吞吐：向一个连接连续发送 64 字节或 1K 的包，对端原样写回。
+// 最多 WINDOW 字节在路上，超过了内核的发送和接收缓冲，写缓冲列表里常有很多个包，由 writev 一次写出。
+// 除了吞吐，还报告 socket 线程每个包花的 CPU 时间，它受机器上其它线程的影响小一些。
+// 之后测 accept 的速度：分批建立连接，socket 线程每接受一个就关掉。
+// epoll 和 io_uring （multishot recv/accept）各测一遍，io_uring 不可用时跳过。
+
+#include "testutil.h"
+#include "socket_server.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT 18911
+#define TOTAL (32 * 1024 * 1024)
+#define WINDOW (16 * 1024 * 1024)
+#define PEER_BUFFER (64 * 1024)
+#define ACCEPT_N 20000
+#define ACCEPT_BATCH 100
+
+static struct socket_server * SS;
+static pthread_t poll_thread;
+static int opened = 0;
+static int accepted = 0;
+static long received = 0;
+
+static double
+_clock(clockid_t id) {
+	struct timespec ti;
+	clock_gettime(id, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static double
+_now(void) {
+	return _clock(CLOCK_MONOTONIC);
+}
+
+static double
+_poll_cpu(void) {
+	clockid_t id;
+	CHECK(pthread_getcpuclockid(poll_thread, &id) == 0);
+	return _clock(id);
+}
+
+static void *
+_poll(void *ud) {
+	struct socket_message r;
+	for (;;) {
+		int type = socket_server_poll(SS, &r, NULL);
+		if (type == SOCKET_EXIT)
+			return NULL;
+		if (type == SOCKET_OPEN)
+			__sync_add_and_fetch(&opened, 1);
+		if (type == SOCKET_ACCEPT) {
+			socket_server_close(SS, 0, r.ud);
+			__sync_add_and_fetch(&accepted, 1);
+		}
+		if (type == SOCKET_DATA) {
+			__sync_add_and_fetch(&received, r.ud);
+			skynet_free(r.data);
+		}
+	}
+}
+
+// 对端：阻塞地读，原样写回
+static void *
+_echo(void *ud) {
+	int listen_fd = (int)(intptr_t)ud;
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+	char buf[64 * 1024];
+	for (;;) {
+		int n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		int off = 0;
+		while (off < n) {
+			int w = write(fd, buf + off, n - off);
+			if (w <= 0)
+				goto _out;
+			off += w;
+		}
+	}
+_out:
+	close(fd);
+	return NULL;
+}
+
+static void
+_wait(int *value, int expect) {
+	while (__sync_add_and_fetch(value, 0) < expect) {
+		usleep(0);
+	}
+}
+
+static void
+_bench(const char *name, int id, int size) {
+	long n = TOTAL / size;
+	long base = __sync_add_and_fetch(&received, 0);
+	double t = _now();
+	double cpu = _poll_cpu();
+	long i;
+	for (i=0;i<n;i++) {
+		while ((i * size) - (__sync_add_and_fetch(&received, 0) - base) > WINDOW) {
+			usleep(0);
+		}
+		char * buf = skynet_malloc(size);
+		memset(buf, (int)i, size);
+		socket_server_send(SS, id, buf, size);
+	}
+	while (__sync_add_and_fetch(&received, 0) - base < n * size) {
+		usleep(0);
+	}
+	t = _now() - t;
+	cpu = _poll_cpu() - cpu;
+	printf("%s echo %4d bytes : %.0f packets/s, %.1f MB/s, socket thread %.0f ns per packet\n",
+		name, size, n / t, n * size / t / (1024 * 1024), cpu * 1e9 / n);
+}
+
+// 客户端一批连上后等它们都被接受，再用 RST 关闭，不留 TIME_WAIT
+static void
+_accept(const char *name) {
+	int listen_id = socket_server_listen(SS, 0, "127.0.0.1", PORT + 1, ACCEPT_BATCH);
+	CHECK(listen_id >= 0);
+	socket_server_start(SS, 0, listen_id);
+	_wait(&opened, 2);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT + 1);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	struct linger rst = { 1, 0 };
+	int fd[ACCEPT_BATCH];
+	double t = _now();
+	double cpu = _poll_cpu();
+	int i, j;
+	for (i=0;i<ACCEPT_N;i+=ACCEPT_BATCH) {
+		for (j=0;j<ACCEPT_BATCH;j++) {
+			fd[j] = socket(AF_INET, SOCK_STREAM, 0);
+			CHECK(connect(fd[j], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+		}
+		_wait(&accepted, i + ACCEPT_BATCH);
+		for (j=0;j<ACCEPT_BATCH;j++) {
+			setsockopt(fd[j], SOL_SOCKET, SO_LINGER, &rst, sizeof(rst));
+			close(fd[j]);
+		}
+	}
+	t = _now() - t;
+	cpu = _poll_cpu() - cpu;
+	printf("%s accept : %.0f connections/s, socket thread %.0f ns per accept\n",
+		name, ACCEPT_N / t, cpu * 1e9 / ACCEPT_N);
+	socket_server_close(SS, 0, listen_id);
+}
+
+static void
+_run(const char *name, int listen_fd, int uring) {
+	SS = socket_server_create(1, 0);
+	if (uring && socket_server_uring(SS, 1)) {
+		socket_server_release(SS);
+		return;
+	}
+	opened = 0;
+	accepted = 0;
+	received = 0;
+	pthread_t echo;
+	CHECK(pthread_create(&echo, NULL, _echo, (void *)(intptr_t)listen_fd) == 0);
+	CHECK(pthread_create(&poll_thread, NULL, _poll, NULL) == 0);
+	int id = socket_server_connect(SS, 0, "127.0.0.1", PORT);
+	_wait(&opened, 1);
+	_bench(name, id, 64);
+	_bench(name, id, 1024);
+	socket_server_close(SS, 0, id);
+	pthread_join(echo, NULL);
+
+	_accept(name);
+
+	socket_server_exit(SS);
+	pthread_join(poll_thread, NULL);
+	socket_server_release(SS);
+}
+
+int
+main() {
+	test_init();
+	// 数据由这里用 skynet_free 释放，发送的缓冲用 skynet_malloc 分配
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CHECK(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	// 接受的连接继承小的接收缓冲
+	int rcvbuf = PEER_BUFFER;
+	setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	CHECK(listen(listen_fd, 1) == 0);
+	_run("epoll", listen_fd, 0);
+	_run("uring", listen_fd, 1);
+	close(listen_fd);
+	return 0;
+}
@@ -0,0 +1,83 @@
+// 堆分析的开销：同样的分配和释放，关闭和以 512K 的平均间隔采样时的耗时
+// 用线程的 CPU 时间，交替测量，取每对测量比值的中位数，减少机器上其它负载的影响
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BATCH 1000
+#define ROUND 2000
+#define PAIRS 51
+#define RATE (512 * 1024)
+#define DENSE (8 * 1024)
+
+static void * slot[BATCH];
+
+static double
+_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static double
+_run(void) {
+	uint32_t seed = 1;
+	int r, i;
+	double t = _now();
+	for (r=0;r<ROUND;r++) {
+		for (i=0;i<BATCH;i++) {
+			seed = seed * 1103515245 + 12345;
+			slot[i] = skynet_malloc(16 + (seed >> 16) % 1009);
+		}
+		for (i=0;i<BATCH;i++) {
+			skynet_free(slot[i]);
+		}
+	}
+	return (_now() - t) * 1e9 / ((double)ROUND * BATCH);
+}
+
+static int
+_compare(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// 返回 rate 和关闭时耗时比值的中位数
+static double
+_ratio(size_t rate, double *off) {
+	double ratio[PAIRS];
+	double t[PAIRS];
+	int i;
+	for (i=0;i<PAIRS;i++) {
+		malloc_profile(0);
+		t[i] = _run();
+		malloc_profile(rate);
+		ratio[i] = _run() / t[i];
+	}
+	malloc_profile(0);
+	qsort(ratio, PAIRS, sizeof(double), _compare);
+	qsort(t, PAIRS, sizeof(double), _compare);
+	*off = t[PAIRS/2];
+	return ratio[PAIRS/2];
+}
+
+int
+main() {
+	test_init();
+	malloc_set_backend("pool");
+	_run();
+	double off;
+	double r = _ratio(RATE, &off);
+	printf("heap profile rate %dK : %.2f ns per malloc+free when off, overhead %.2f%%\n",
+		RATE / 1024, off, (r - 1) * 100);
+	// 密集采样估算一次采样（加上释放时查表）的代价，平均块大小约 520 字节
+	r = _ratio(DENSE, &off);
+	double per_sample = (r - 1) * off * DENSE / 520;
+	printf("heap profile rate %dK : overhead %.2f%%, about %.0f ns per sample\n",
+		DENSE / 1024, (r - 1) * 100, per_sample);
+	return 0;
+}
@@ -0,0 +1,126 @@
+// 比较依次启动和批量启动一组 '_init' 较慢的服务的耗时
+// 工作线程和 skynet_start 一样在条件变量上睡眠，由批量启动唤醒
+
+#include "testutil.h"
+#include "skynet_monitor.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define SERVICES 2000
+#define WORKERS 4
+#define INIT_US 50
+
+struct pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+};
+
+static struct pool P = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+static int HELPED = 0; // 由调用者以外的线程执行的 '_init' 数
+static __thread int WORKER = 0;
+
+static double
+_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	double t = _now() + INIT_US / 1e6;
+	while (_now() < t)
+		;
+	if (WORKER)
+		__sync_add_and_fetch(&HELPED, 1);
+	return 0;
+}
+
+static void
+_wakeup(void *ud) {
+	struct pool * p = ud;
+	pthread_cond_broadcast(&p->cond);
+}
+
+static void *
+_worker(void *ud) {
+	struct pool * p = ud;
+	struct skynet_monitor * sm = skynet_monitor_new();
+	WORKER = 1;
+	for (;;) {
+		if (skynet_context_message_dispatch(sm)) {
+			pthread_mutex_lock(&p->mutex);
+			if (p->quit) {
+				pthread_mutex_unlock(&p->mutex);
+				break;
+			}
+			pthread_cond_wait(&p->cond, &p->mutex);
+			pthread_mutex_unlock(&p->mutex);
+		}
+	}
+	skynet_monitor_delete(sm);
+	return NULL;
+}
+
+static void
+_exit_all(uint32_t handle[], int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		skynet_handle_retire(handle[i]);
+	}
+	test_dispatch();
+}
+
+int
+main() {
+	test_init();
+	test_module("slow", _init, NULL);
+	skynet_context_setwakeup(_wakeup, &P);
+	pthread_t pid[WORKERS];
+	int i;
+	for (i=0;i<WORKERS;i++) {
+		pthread_create(&pid[i], NULL, _worker, &P);
+	}
+	static const char * name[SERVICES];
+	static const char * param[SERVICES];
+	static uint32_t handle[SERVICES];
+	for (i=0;i<SERVICES;i++) {
+		name[i] = "slow";
+		param[i] = NULL;
+	}
+
+	double t = _now();
+	for (i=0;i<SERVICES;i++) {
+		struct skynet_context * ctx = skynet_context_new("slow", NULL);
+		CHECK(ctx);
+		handle[i] = skynet_context_handle(ctx);
+	}
+	double serial = _now() - t;
+	_exit_all(handle, SERVICES);
+
+	t = _now();
+	CHECK(skynet_context_newbatch(SERVICES, name, param, handle) == SERVICES);
+	double batch = _now() - t;
+	_exit_all(handle, SERVICES);
+
+	printf("launch %d services (init %dus) with %d workers : serial %.1f ms, batch %.1f ms (%.2fx), %d inits on workers\n",
+		SERVICES, INIT_US, WORKERS, serial * 1e3, batch * 1e3, serial / batch, HELPED);
+
+	pthread_mutex_lock(&P.mutex);
+	P.quit = 1;
+	pthread_cond_broadcast(&P.cond);
+	pthread_mutex_unlock(&P.mutex);
+	for (i=0;i<WORKERS;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	skynet_context_setwakeup(NULL, NULL);
+	return 0;
+}
@@ -0,0 +1,114 @@
+// 比较分配器后端：每轮分配 BATCH 个 16-1024 字节的块再全部释放
+// local 在分配的线程释放，cross 把块交给下一个线程释放（和服务间发消息一样）
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH 1000
+#define ROUND 2000
+#define THREADS 4
+
+typedef void * (*alloc_func)(size_t);
+typedef void (*free_func)(void *);
+
+struct backend {
+	const char * name;
+	alloc_func alloc;
+	free_func free;
+};
+
+struct worker {
+	struct backend * b;
+	int cross;
+	int index;
+	void ** mine;
+	pthread_barrier_t * barrier;
+};
+
+static void * slot[THREADS][BATCH];
+
+static double
+_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static void *
+_run(void *ud) {
+	struct worker * w = ud;
+	uint32_t seed = w->index * 2654435761u + 1;
+	int r, i;
+	for (r=0;r<ROUND;r++) {
+		void ** mine = slot[w->index];
+		for (i=0;i<BATCH;i++) {
+			seed = seed * 1103515245 + 12345;
+			size_t sz = 16 + (seed >> 16) % 1009;
+			mine[i] = w->b->alloc(sz);
+			*(char *)mine[i] = 0;
+		}
+		int victim = w->index;
+		if (w->cross) {
+			// 所有线程都分配完后，释放上一个线程分配的块
+			pthread_barrier_wait(w->barrier);
+			victim = (w->index + THREADS - 1) % THREADS;
+		}
+		void ** other = slot[victim];
+		for (i=0;i<BATCH;i++) {
+			w->b->free(other[i]);
+		}
+		if (w->cross) {
+			pthread_barrier_wait(w->barrier);
+		}
+	}
+	return NULL;
+}
+
+static double
+_bench(struct backend *b, int nthread, int cross) {
+	pthread_t pid[THREADS];
+	struct worker w[THREADS];
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, nthread);
+	int i;
+	double t = _now();
+	for (i=0;i<nthread;i++) {
+		w[i].b = b;
+		w[i].cross = cross;
+		w[i].index = i;
+		w[i].barrier = &barrier;
+		pthread_create(&pid[i], NULL, _run, &w[i]);
+	}
+	for (i=0;i<nthread;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	t = _now() - t;
+	pthread_barrier_destroy(&barrier);
+	return t * 1e9 / ((double)ROUND * BATCH * nthread);
+}
+
+int
+main() {
+	test_init();
+	struct backend backend[] = {
+		{ "libc", malloc, free },
+		{ "system", skynet_malloc, skynet_free },
+		{ "pool", skynet_malloc, skynet_free },
+		{ "jemalloc", skynet_malloc, skynet_free },
+	};
+	int i;
+	for (i=0;i<4;i++) {
+		struct backend * b = &backend[i];
+		if (i > 0 && malloc_set_backend(b->name) != 0)
+			continue;
+		// 先跑一遍，让各后端的缓存就绪
+		_bench(b, 1, 0);
+		printf("%-8s : 1 thread %6.1f ns, %d threads local %6.1f ns, cross %6.1f ns (per malloc+free)\n",
+			b->name, _bench(b, 1, 0), THREADS, _bench(b, THREADS, 0), _bench(b, THREADS, 1));
+	}
+	return 0;
+}
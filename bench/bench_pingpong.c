@@ -0,0 +1,79 @@
+// 两个服务之间来回发送消息，小于 MESSAGE_INLINE_SIZE 的消息内联存放，64 字节的消息复制到堆上作为对照
+//
+// 在一个线程中调度，只测量 skynet_send 、消息队列和调度的开销。
+
+#include "testutil.h"
+#include "skynet_mq.h"
+
+#include <string.h>
+#include <time.h>
+
+#define ROUND 1000000
+
+static int remain = 0;
+static int size = 0;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	if (remain > 0) {
+		--remain;
+		skynet_send(context, 0, source, PTYPE_TEXT, 0, (void *)msg, size);
+	}
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+static double
+_now(void) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec + ti.tv_nsec / 1e9;
+}
+
+static double
+_round(int sz) {
+	struct skynet_context * a = skynet_context_new("pingpong", NULL);
+	struct skynet_context * b = skynet_context_new("pingpong", NULL);
+	CHECK(a && b);
+	char buf[64];
+	memset(buf, 'x', sizeof(buf));
+	size = sz;
+	remain = ROUND;
+	double t = _now();
+	skynet_send(a, 0, skynet_context_handle(b), PTYPE_TEXT, 0, buf, sz);
+	test_dispatch();
+	t = _now() - t;
+	skynet_command(a, "EXIT", NULL);
+	skynet_command(b, "EXIT", NULL);
+	return t;
+}
+
+// 取三次中最快的一次
+static void
+_run(int sz) {
+	double best = 0;
+	int i;
+	for (i=0;i<3;i++) {
+		double t = _round(sz);
+		if (i == 0 || t < best)
+			best = t;
+	}
+	printf("%2d bytes %s : %6.1f ns/msg\n", sz, sz < MESSAGE_INLINE_SIZE ? "inline" : "copied", best * 1e9 / ROUND);
+}
+
+int
+main() {
+	test_init();
+	test_module("pingpong", _init, NULL);
+	int sz[] = { 8, 16, 64 };
+	int i;
+	for (i=0;i<3;i++) {
+		_run(sz[i]);
+	}
+	return 0;
+}
@@ -1,97 +1,394 @@
+// pthread_getattr_np
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "malloc_hook.h"
 #include "skynet.h"
 
-static size_t _used_memory = 0;
-static size_t _memory_block = 0;
-typedef struct _mem_data {
+#define SHARD_MAX 64
+
+// 内存统计按线程分片，只有所属线程写，读时汇总；超出的线程共用最后一片
+// used 在其它线程释放时会是负数
+struct mem_shard {
+	ssize_t used;
+	ssize_t block;
+	char pad[64 - 2 * sizeof(ssize_t)];
+};
+
+static struct mem_shard mem_shards[SHARD_MAX];
+static int shard_count = 0;
+static __thread struct mem_shard * shard_tls = NULL;
+static __thread struct memory_stat * owner_tls = NULL;
+static __thread int limit_tls = 0;
+
+static int stat_lock = 0;
+static struct memory_stat * stat_list = NULL;
+static struct memory_stat * stat_free = NULL;	// closed stats, reused but never freed
+
+inline static struct mem_shard *
+get_shard(void) {
+	struct mem_shard * s = shard_tls;
+	if (s == NULL) {
+		int id = __sync_fetch_and_add(&shard_count, 1);
+		if (id >= SHARD_MAX - 1) {
+			id = SHARD_MAX - 1;
+		}
+		s = shard_tls = &mem_shards[id];
+	}
+	return s;
+}
+
+inline static void
+update_shard(ssize_t __n, ssize_t block) {
+	struct mem_shard * s = get_shard();
+	if (s == &mem_shards[SHARD_MAX-1]) {
+		__sync_add_and_fetch(&s->used, __n);
+		__sync_add_and_fetch(&s->block, block);
+	} else {
+		s->used += __n;
+		s->block += block;
+	}
+}
+
+inline static void 
+update_xmalloc_stat_alloc(struct memory_stat *stat, size_t __n) {
+	update_shard(__n, 1);
+	if (stat) {
+		ssize_t allocated = __sync_add_and_fetch(&stat->allocated, __n);
+		// 越过软上限只做标记，由服务调度完消息后发出通知
+		if (stat->soft && allocated > stat->soft && stat->warn == MEMORY_WARN_NONE) {
+			stat->warn = MEMORY_WARN_SOFT;
+		}
+	}
+}
+
+// 服务自己的代码中，越过硬上限的分配失败，由服务调度完消息后发出通知。
+// 框架内部的分配（队列、定时器等）关闭了检查，不会失败。
+inline static int
+over_limit(size_t sz) {
+	struct memory_stat * stat = owner_tls;
+	if (limit_tls && stat && stat->hard && stat->allocated + (ssize_t)sz > stat->hard) {
+		++stat->refused;
+		return 1;
+	}
+	return 0;
+}
+
+inline static void
+update_xmalloc_stat_free(uint32_t handle, struct memory_stat *stat, size_t __n) {
+	update_shard(-(ssize_t)__n, -1);
+	// 服务已经退出时句柄对不上，不再计数
+	if (stat && stat->handle == handle) {
+		__sync_sub_and_fetch(&stat->allocated, __n);
+	}
+}
+
+// 采样的堆分析：平均每分配 heap_rate 字节采样一次（间隔服从指数分布，每个线程自己倒数），记录调用栈、大小和所属的服务。
+// 被采样的块在记录 memory_stat 指针的地方把最低位置 1 ，释放时才查表，没有采样的块只多一次减法，不加锁，
+// 也不读全局的开关：关闭时同样倒数，倒数到 0 时才检查开关，所以开启后最多再分配 PROFILE_IDLE 字节才开始采样。
+// 调用栈按帧指针回溯（编译时需要 -fno-omit-frame-pointer），只读本线程的栈，比 backtrace() 快两个数量级。
+// 样本表按地址分成 PROFILE_STRIPES 段，各自加锁，线程之间很少冲突。
+#define PROFILE_TAG 1
+#define PROFILE_DEPTH 16
+#define PROFILE_STRIPES 16
+#define PROFILE_STRIPE_SIZE 512
+#define PROFILE_IDLE (1024 * 1024)
+
+struct heap_sample {
+	void * ptr;
+	size_t size;
 	uint32_t handle;
-	ssize_t allocated;
-} mem_data;
+	int depth;
+	void * stack[PROFILE_DEPTH];
+};
 
-#define SLOT_SIZE 0x10000
-#define PREFIX_SIZE sizeof(uint32_t)
+struct profile_stripe {
+	int lock;
+	int count;
+	struct heap_sample * table;
+	char pad[64 - 2 * sizeof(int) - sizeof(void *)];
+};
 
-static mem_data mem_stats[SLOT_SIZE];
+static size_t heap_rate = 0;
+static int profile_lock = 0;	// 开关和导出时加锁
+static struct profile_stripe profile_stripes[PROFILE_STRIPES];
+static __thread ssize_t sample_tls = 0;
+static __thread uint64_t random_tls = 0;
+static __thread uintptr_t stack_lo = 0;
+static __thread uintptr_t stack_hi = 0;
 
+inline static uintptr_t
+profile_hash(void *ptr) {
+	uintptr_t h = (uintptr_t)ptr >> 4;
+	return h ^ (h >> 13);
+}
 
-#ifndef NOUSE_JEMALLOC
+inline static struct profile_stripe *
+profile_stripe(uintptr_t h) {
+	return &profile_stripes[(h / PROFILE_STRIPE_SIZE) & (PROFILE_STRIPES-1)];
+}
 
-#include "jemalloc.h"
+static ssize_t
+profile_interval(void) {
+	uint64_t x = random_tls;
+	if (x == 0) {
+		x = ((uint64_t)(uintptr_t)&random_tls << 16) ^ (uint64_t)time(NULL) ^ 0x9e3779b97f4a7c15ULL;
+	}
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	random_tls = x;
+	double u = ((x >> 11) + 1) * (1.0 / 9007199254740993.0);
+	return (ssize_t)(-log(u) * heap_rate) + 1;
+}
 
-static ssize_t*
-get_allocated_field(uint32_t handle) {
-	int h = (int)(handle & (SLOT_SIZE - 1));
-	mem_data *data = &mem_stats[h];
-	uint32_t old_handle = data->handle;
-	ssize_t old_alloc = data->allocated;
-	if(old_handle == 0 || old_alloc <= 0) {
-		// data->allocated may less than zero, because it may not count at start.
-		if(!__sync_bool_compare_and_swap(&data->handle, old_handle, handle)) {
+// 沿帧指针回溯，只接受在本线程栈内、向栈底递增的帧，没有帧指针时得到的调用栈较短，但不会越界
+static int
+profile_backtrace(void ** stack, int max) {
+	if (stack_hi == 0) {
+		pthread_attr_t attr;
+		void * addr;
+		size_t size;
+		if (pthread_getattr_np(pthread_self(), &attr) != 0)
 			return 0;
+		pthread_attr_getstack(&attr, &addr, &size);
+		pthread_attr_destroy(&attr);
+		stack_lo = (uintptr_t)addr;
+		stack_hi = (uintptr_t)addr + size;
+	}
+	uintptr_t fp = (uintptr_t)__builtin_frame_address(0);
+	int n = -1;	// 第一帧返回到 profile_sample ，不记录
+	while (n < max && fp >= stack_lo && fp + 2 * sizeof(void *) <= stack_hi && (fp & (sizeof(void *) - 1)) == 0) {
+		void ** frame = (void **)fp;
+		if (frame[1] == NULL)
+			break;
+		if (n >= 0)
+			stack[n] = frame[1];
+		++n;
+		uintptr_t next = (uintptr_t)frame[0];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return n < 0 ? 0 : n;
+}
+
+__attribute__((noinline)) static uintptr_t
+profile_sample(void *ptr, size_t size, uint32_t handle) {
+	if (heap_rate == 0) {
+		// 关闭时也倒数，每 PROFILE_IDLE 字节回到这里看一次是否开启
+		sample_tls = PROFILE_IDLE;
+		return 0;
+	}
+	sample_tls = profile_interval();
+	void * stack[PROFILE_DEPTH];
+	int depth = profile_backtrace(stack, PROFILE_DEPTH);
+	uintptr_t h = profile_hash(ptr);
+	struct profile_stripe * s = profile_stripe(h);
+	uintptr_t tag = 0;
+	while (__sync_lock_test_and_set(&s->lock,1)) {}
+	if (s->table && s->count < PROFILE_STRIPE_SIZE * 3 / 4) {
+		int i = h & (PROFILE_STRIPE_SIZE-1);
+		while (s->table[i].ptr) {
+			i = (i + 1) & (PROFILE_STRIPE_SIZE-1);
 		}
-		if (old_alloc < 0) {
-			__sync_bool_compare_and_swap(&data->allocated, old_alloc, 0);
-		}
+		struct heap_sample * e = &s->table[i];
+		e->ptr = ptr;
+		e->size = size;
+		e->handle = handle;
+		e->depth = depth;
+		memcpy(e->stack, stack, depth * sizeof(void *));
+		++s->count;
+		tag = PROFILE_TAG;
 	}
-	if(data->handle != handle) {
+	__sync_lock_release(&s->lock);
+	return tag;
+}
+
+// 分配后调用，返回的标记和 stat 指针一起记录
+inline static uintptr_t
+profile_alloc(void *ptr, size_t size, uint32_t handle) {
+	sample_tls -= size;
+	if (sample_tls >= 0)
 		return 0;
+	return profile_sample(ptr, size, handle);
+}
+
+static void
+profile_free(void *ptr) {
+	uintptr_t h = profile_hash(ptr);
+	struct profile_stripe * s = profile_stripe(h);
+	while (__sync_lock_test_and_set(&s->lock,1)) {}
+	struct heap_sample * t = s->table;
+	if (t) {
+		int i = h & (PROFILE_STRIPE_SIZE-1);
+		while (t[i].ptr && t[i].ptr != ptr) {
+			i = (i + 1) & (PROFILE_STRIPE_SIZE-1);
+		}
+		if (t[i].ptr) {
+			// 线性探测的删除：把后面应该在前面的项移过来
+			int hole = i;
+			for (;;) {
+				i = (i + 1) & (PROFILE_STRIPE_SIZE-1);
+				if (t[i].ptr == NULL)
+					break;
+				int home = profile_hash(t[i].ptr) & (PROFILE_STRIPE_SIZE-1);
+				if (((i - home) & (PROFILE_STRIPE_SIZE-1)) >= ((i - hole) & (PROFILE_STRIPE_SIZE-1))) {
+					t[hole] = t[i];
+					hole = i;
+				}
+			}
+			t[hole].ptr = NULL;
+			--s->count;
+		}
 	}
-	return &data->allocated;
+	__sync_lock_release(&s->lock);
 }
 
-inline static void 
-update_xmalloc_stat_alloc(uint32_t handle, size_t __n) {
-	__sync_add_and_fetch(&_used_memory, __n);
-	__sync_add_and_fetch(&_memory_block, 1); 
-	ssize_t* allocated = get_allocated_field(handle);
-	if(allocated) {
-		__sync_add_and_fetch(allocated, __n);
+// 样本表在第一次开启时分配，关闭时只清空，不还给系统
+void
+malloc_profile(size_t rate) {
+	while (__sync_lock_test_and_set(&profile_lock,1)) {}
+	int i;
+	for (i=0;i<PROFILE_STRIPES;i++) {
+		struct profile_stripe * s = &profile_stripes[i];
+		struct heap_sample * t = NULL;
+		if (rate && s->table == NULL) {
+			t = calloc(PROFILE_STRIPE_SIZE, sizeof(struct heap_sample));
+		}
+		while (__sync_lock_test_and_set(&s->lock,1)) {}
+		if (t) {
+			s->table = t;
+		} else if (rate == 0 && s->table) {
+			// 已采样的块释放时查不到记录，没有影响
+			memset(s->table, 0, PROFILE_STRIPE_SIZE * sizeof(struct heap_sample));
+			s->count = 0;
+		}
+		__sync_lock_release(&s->lock);
 	}
+	heap_rate = rate;
+	__sync_lock_release(&profile_lock);
 }
 
-inline static void
-update_xmalloc_stat_free(uint32_t handle, size_t __n) {
-	__sync_sub_and_fetch(&_used_memory, __n);
-	__sync_sub_and_fetch(&_memory_block, 1);
-	ssize_t* allocated = get_allocated_field(handle);
-	if(allocated) {
-		__sync_sub_and_fetch(allocated, __n);
+// pprof 的 heap profile 文本格式（heap_v2），样本数和字节数是原始的采样值，由 pprof 按采样间隔还原
+int
+malloc_profile_dump(const char *filename, uint32_t handle) {
+	FILE * f = fopen(filename, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	while (__sync_lock_test_and_set(&profile_lock,1)) {}
+	// 先把样本复制出来，写文件时不占着各段的锁
+	struct heap_sample * samples = malloc(PROFILE_STRIPES * PROFILE_STRIPE_SIZE * sizeof(struct heap_sample));
+	int n = 0;
+	size_t bytes = 0;
+	int i, j;
+	for (i=0; samples && i<PROFILE_STRIPES; i++) {
+		struct profile_stripe * s = &profile_stripes[i];
+		while (__sync_lock_test_and_set(&s->lock,1)) {}
+		for (j=0; s->table && j<PROFILE_STRIPE_SIZE; j++) {
+			struct heap_sample * e = &s->table[j];
+			if (e->ptr && (handle == 0 || e->handle == handle)) {
+				samples[n++] = *e;
+				bytes += e->size;
+			}
+		}
+		__sync_lock_release(&s->lock);
 	}
+	size_t rate = heap_rate;
+	__sync_lock_release(&profile_lock);
+
+	fprintf(f, "heap profile: %d: %zu [%d: %zu] @ heap_v2/%zu\n", n, bytes, n, bytes, rate);
+	for (i=0;i<n;i++) {
+		struct heap_sample * e = &samples[i];
+		fprintf(f, "%d: %zu [%d: %zu] @", 1, e->size, 1, e->size);
+		for (j=0;j<e->depth;j++) {
+			fprintf(f, " %p", e->stack[j]);
+		}
+		fprintf(f, "\n");
+	}
+	// pprof 用映射表把地址对应到可执行文件和动态库
+	fprintf(f, "\nMAPPED_LIBRARIES:\n");
+	FILE * maps = fopen("/proc/self/maps", "r");
+	if (maps) {
+		char line[512];
+		while (fgets(line, sizeof(line), maps)) {
+			fputs(line, f);
+		}
+		fclose(maps);
+	}
+	free(samples);
+	fclose(f);
+	return n;
+}
+
+static void malloc_oom(size_t size) {
+	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
+		size);
+	fflush(stderr);
+	abort();
 }
 
+#ifndef NOUSE_JEMALLOC
+
+#include "jemalloc.h"
+
+#define PREFIX_SIZE (sizeof(uint32_t) + sizeof(uintptr_t))
+
+#define ARENA_MAX 256
+
+// 服务专用或服务组共用的 arena 。服务退出（组内最后一个服务退出）后先 purge ，
+// 已经没有存活的块时 destroy ，把内存和 arena 本身都还给 jemalloc ；
+// 否则（块被发给了别的服务）放进待回收表，之后每次建立或释放 arena 时再检查。
+struct arena_group {
+	int group;
+	int ref;
+	unsigned arena;
+};
+
+static int arena_lock = 0;
+static int arena_group_n = 0;
+static struct arena_group arena_groups[ARENA_MAX];
+static int arena_retired_n = 0;
+static int arena_retired_cap = 0;
+static unsigned * arena_retired = NULL; ///< 按需加倍，不丢下还没 destroy 的 arena
+
 inline static void*
 fill_prefix(char* ptr) {
-	uint32_t handle = skynet_current_handle();
+	struct memory_stat * stat = owner_tls;
+	uint32_t handle = stat ? stat->handle : 0;
 	size_t size = je_malloc_usable_size(ptr);
-	uint32_t *p = (uint32_t *)(ptr + size - sizeof(uint32_t));
+	uintptr_t tag = (uintptr_t)stat | profile_alloc(ptr, size, handle);
+	char *p = ptr + size - PREFIX_SIZE;
 	memcpy(p, &handle, sizeof(handle));
+	memcpy(p + sizeof(handle), &tag, sizeof(tag));
 
-	update_xmalloc_stat_alloc(handle, size);
+	update_xmalloc_stat_alloc(stat, size);
 	return ptr;
 }
 
 inline static void*
 clean_prefix(char* ptr) {
 	size_t size = je_malloc_usable_size(ptr);
-	uint32_t *p = (uint32_t *)(ptr + size - sizeof(uint32_t));
+	char *p = ptr + size - PREFIX_SIZE;
 	uint32_t handle;
+	uintptr_t tag;
 	memcpy(&handle, p, sizeof(handle));
-	update_xmalloc_stat_free(handle, size);
+	memcpy(&tag, p + sizeof(handle), sizeof(tag));
+	if (tag & PROFILE_TAG) {
+		profile_free(ptr);
+	}
+	update_xmalloc_stat_free(handle, (struct memory_stat *)(tag & ~(uintptr_t)PROFILE_TAG), size);
 	return ptr;
 }
 
-static void malloc_oom(size_t size) {
-	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
-		size);
-	fflush(stderr);
-	abort();
-}
-
 void 
 memory_info_dump(void) {
 	je_malloc_stats_print(0,0,0);
@@ -128,11 +425,197 @@ mallctl_opt(const char* name, int* newval) {
 	return v;
 }
 
+// arena 中还有存活的块时返回 1 ，没有统计（jemalloc 没有开启 stats）时也当作有
+static int
+arena_live(unsigned arena) {
+	char name[64];
+	size_t v = 0;
+	size_t len = sizeof(v);
+	size_t live = 0;
+	sprintf(name, "stats.arenas.%u.small.allocated", arena);
+	if (je_mallctl(name, &v, &len, NULL, 0) != 0)
+		return 1;
+	live += v;
+	sprintf(name, "stats.arenas.%u.large.allocated", arena);
+	if (je_mallctl(name, &v, &len, NULL, 0) != 0)
+		return 1;
+	live += v;
+	return live != 0;
+}
+
+static int
+destroy_arena(unsigned arena) {
+	char name[32];
+	sprintf(name, "arena.%u.destroy", arena);
+	return je_mallctl(name, NULL, NULL, NULL, 0) == 0;
+}
+
+// 在 arena_lock 中调用，destroy 待回收表中已经空了的 arena
+static void
+sweep_arena(void) {
+	if (arena_retired_n == 0)
+		return;
+	uint64_t epoch = 1;
+	size_t len = sizeof(epoch);
+	je_mallctl("epoch", &epoch, &len, &epoch, len); // 刷新统计
+	int i = 0;
+	while (i < arena_retired_n) {
+		unsigned arena = arena_retired[i];
+		if (!arena_live(arena) && destroy_arena(arena)) {
+			arena_retired[i] = arena_retired[--arena_retired_n];
+		} else {
+			++i;
+		}
+	}
+}
+
+static unsigned
+new_arena(void) {
+	sweep_arena();
+	unsigned arena = 0;
+	size_t len = sizeof(arena);
+	if (je_mallctl("arenas.create", &arena, &len, NULL, 0) != 0
+		&& je_mallctl("arenas.extend", &arena, &len, NULL, 0) != 0) {
+		return 0;
+	}
+	return arena;
+}
+
+static void
+free_arena(unsigned arena) {
+	char name[32];
+	sprintf(name, "arena.%u.purge", arena);
+	je_mallctl(name, NULL, NULL, NULL, 0);
+	if (arena_retired_n == arena_retired_cap) {
+		int cap = arena_retired_cap ? arena_retired_cap * 2 : ARENA_MAX;
+		unsigned * retired = realloc(arena_retired, cap * sizeof(unsigned));
+		if (retired == NULL) {
+			// 放不进待回收表，只能现在 destroy ，还有存活的块时留着它
+			if (arena_live(arena) || !destroy_arena(arena)) {
+				fprintf(stderr, "malloc: arena %u is not destroyed, out of memory\n", arena);
+			}
+			sweep_arena();
+			return;
+		}
+		arena_retired = retired;
+		arena_retired_cap = cap;
+	}
+	arena_retired[arena_retired_n++] = arena;
+	sweep_arena();
+}
+
+static void
+release_arena(struct memory_stat *stat) {
+	unsigned arena = stat->arena;
+	if (arena == 0)
+		return;
+	stat->arena = 0;
+	while (__sync_lock_test_and_set(&arena_lock,1)) {}
+	if (stat->group == 0) {
+		free_arena(arena);
+	} else {
+		int i;
+		for (i=0;i<arena_group_n;i++) {
+			struct arena_group * g = &arena_groups[i];
+			if (g->group == stat->group) {
+				if (--g->ref == 0) {
+					free_arena(g->arena);
+					arena_groups[i] = arena_groups[--arena_group_n];
+				}
+				break;
+			}
+		}
+	}
+	__sync_lock_release(&arena_lock);
+}
+
+int
+malloc_arena(struct memory_stat *stat, int group) {
+	release_arena(stat);
+	unsigned arena = 0;
+	while (__sync_lock_test_and_set(&arena_lock,1)) {}
+	if (group == 0) {
+		arena = new_arena();
+	} else {
+		int i;
+		for (i=0;i<arena_group_n;i++) {
+			struct arena_group * g = &arena_groups[i];
+			if (g->group == group) {
+				++g->ref;
+				arena = g->arena;
+				break;
+			}
+		}
+		if (arena == 0 && arena_group_n < ARENA_MAX) {
+			arena = new_arena();
+			if (arena) {
+				struct arena_group * g = &arena_groups[arena_group_n++];
+				g->group = group;
+				g->ref = 1;
+				g->arena = arena;
+			}
+		}
+	}
+	__sync_lock_release(&arena_lock);
+	if (arena == 0)
+		return -1;
+	stat->group = group;
+	stat->arena = arena;
+	return arena;
+}
+
+static size_t
+arena_stat(unsigned arena, const char *field) {
+	char name[64];
+	sprintf(name, "stats.arenas.%u.%s", arena, field);
+	return mallctl_int64(name, NULL);
+}
+
+void
+dump_arena_mem(void) {
+	size_t epoch = 1;
+	mallctl_int64("epoch", &epoch); // 刷新统计
+	size_t page = mallctl_int64("arenas.page", NULL);
+	printf("dump service arena mem:\n");
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	struct memory_stat * stat;
+	for (stat = stat_list; stat; stat = stat->next) {
+		unsigned arena = stat->arena;
+		if (arena == 0)
+			continue;
+		size_t allocated = arena_stat(arena, "small.allocated") + arena_stat(arena, "large.allocated");
+		size_t active = arena_stat(arena, "pactive") * page;
+		size_t dirty = arena_stat(arena, "pdirty") * page;
+		printf("0x%x arena %u group %d -> allocated %zdkb active %zdkb dirty %zdkb frag %.1f%%\n",
+			stat->handle, arena, stat->group, allocated >> 10, active >> 10, dirty >> 10,
+			active > allocated ? 100.0 * (active - allocated) / active : 0.0);
+	}
+	__sync_lock_release(&stat_lock);
+}
+
+int
+malloc_set_backend(const char *name) {
+	if (strcmp(name, "jemalloc") == 0)
+		return 0;
+	skynet_error(NULL, "Use jemalloc, ignore malloc backend %s.", name);
+	return -1;
+}
+
 // hook : malloc, realloc, free, calloc
+// 当前服务有自己的 arena 时从中分配，不经过线程缓存，这样服务退出后 purge 能还给系统
 
 void *
 skynet_malloc(size_t size) {
-	void* ptr = je_malloc(size + PREFIX_SIZE);
+	if (size > SIZE_MAX - PREFIX_SIZE) malloc_oom(size);
+	if (over_limit(size))
+		return NULL;
+	struct memory_stat * stat = owner_tls;
+	void* ptr;
+	if (stat && stat->arena) {
+		ptr = je_mallocx(size + PREFIX_SIZE, MALLOCX_ARENA(stat->arena) | MALLOCX_TCACHE_NONE);
+	} else {
+		ptr = je_malloc(size + PREFIX_SIZE);
+	}
 	if(!ptr) malloc_oom(size);
 	return fill_prefix(ptr);
 }
@@ -140,9 +623,19 @@ skynet_malloc(size_t size) {
 void *
 skynet_realloc(void *ptr, size_t size) {
 	if (ptr == NULL) return skynet_malloc(size);
+	if (size > SIZE_MAX - PREFIX_SIZE) malloc_oom(size);
 
+	size_t old = je_malloc_usable_size(ptr) - PREFIX_SIZE;
+	if (size > old && over_limit(size - old))
+		return NULL;
 	void* rawptr = clean_prefix(ptr);
-	void *newptr = je_realloc(rawptr, size+PREFIX_SIZE);
+	struct memory_stat * stat = owner_tls;
+	void *newptr;
+	if (stat && stat->arena) {
+		newptr = je_rallocx(rawptr, size+PREFIX_SIZE, MALLOCX_ARENA(stat->arena) | MALLOCX_TCACHE_NONE);
+	} else {
+		newptr = je_realloc(rawptr, size+PREFIX_SIZE);
+	}
 	if(!newptr) malloc_oom(size);
 	return fill_prefix(newptr);
 }
@@ -156,13 +649,350 @@ skynet_free(void *ptr) {
 
 void *
 skynet_calloc(size_t nmemb,size_t size) {
-	void* ptr = je_calloc(nmemb + ((PREFIX_SIZE+size-1)/size), size );
+	if (size && nmemb > (SIZE_MAX - PREFIX_SIZE) / size)
+		return NULL;
+	if (over_limit(nmemb * size))
+		return NULL;
+	struct memory_stat * stat = owner_tls;
+	if (stat && stat->arena) {
+		void* ptr = je_mallocx(nmemb * size + PREFIX_SIZE, MALLOCX_ARENA(stat->arena) | MALLOCX_TCACHE_NONE | MALLOCX_ZERO);
+		if(!ptr) malloc_oom(size);
+		return fill_prefix(ptr);
+	}
+	void* ptr = je_calloc(1, nmemb * size + PREFIX_SIZE);
 	if(!ptr) malloc_oom(size);
 	return fill_prefix(ptr);
 }
 
 #else
 
+// 没有 jemalloc 时在块前加一个头，记录所属的服务和大小，统计方式和 jemalloc 时一样。
+// 后端可以是系统的 malloc 或内置的按大小分级的池；头中记录了块来自哪个后端，所以运行中切换后端是安全的。
+
+struct mem_header {
+	uintptr_t stat;	// struct memory_stat * ，最低位是 PROFILE_TAG
+	uint32_t handle;
+	uint32_t size;	// 池中的块为 HEADER_POOL | 级别，否则为申请的大小，超过 HEADER_SIZE_MAX 时截断（只影响统计）
+};
+
+#define HEADER_SIZE sizeof(struct mem_header)
+#define HEADER_POOL 0x80000000
+#define HEADER_SIZE_MAX 0x7fffffff
+
+#define BACKEND_SYSTEM 0
+#define BACKEND_POOL 1
+
+static int backend = BACKEND_SYSTEM;
+
+// 池按大小分级（含头，16 字节对齐），每个线程每级缓存一些空闲块，多了还一半给全局，少了从全局取一批。
+// 全局的空闲块按所在的 chunk 记录，chunk 按 POOL_CHUNK 对齐，从块的地址就能找到；
+// 一个 chunk 的块全部还回全局后把它还给系统（每级留一个备用），没有空闲块时才切一块新的 chunk 。
+// skynet 的线程不会退出，所以线程缓存不回收，缓存中的块所在的 chunk 也不会释放。
+#define POOL_CLASSES 16
+#define POOL_MAX 2048
+#define POOL_CACHE_MAX 128
+#define POOL_REFILL 32
+#define POOL_CHUNK (64 * 1024)
+#define POOL_CHUNK_HEADER 64
+
+static const uint32_t pool_size[POOL_CLASSES] = {
+	32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512, 768, 1024, 1536, 2048,
+};
+
+struct pool_block {
+	struct pool_block * next;
+};
+
+struct pool_chunk {
+	struct pool_chunk * prev;	// 有空闲块的 chunk 的链表
+	struct pool_chunk * next;
+	struct pool_block * freelist;	// 在全局中的空闲块
+	int nfree;
+	int n;
+};
+
+struct pool_list {
+	int lock;
+	struct pool_chunk * partial;	// 有空闲块的 chunk
+	struct pool_chunk * spare;	// 全部空闲时留下的一个，避免反复向系统申请
+	int nchunk;	// 向系统申请了还没有释放的 chunk 数
+};
+
+struct pool_cache {
+	struct pool_block * head;
+	int n;
+};
+
+static uint8_t pool_index[POOL_MAX / 16 + 1];
+static struct pool_list pool_global[POOL_CLASSES];
+static __thread struct pool_cache pool_tls[POOL_CLASSES];
+
+static void
+pool_init(void) {
+	int i;
+	int cls = 0;
+	for (i=0;i<=POOL_MAX/16;i++) {
+		while (pool_size[cls] < i * 16) {
+			++cls;
+		}
+		pool_index[i] = cls;
+	}
+}
+
+inline static int
+pool_class(size_t sz) {
+	if (sz > POOL_MAX)
+		return -1;
+	return pool_index[(sz + 15) / 16];
+}
+
+inline static struct pool_chunk *
+pool_chunk_of(void *ptr) {
+	return (struct pool_chunk *)((uintptr_t)ptr & ~(uintptr_t)(POOL_CHUNK - 1));
+}
+
+static void
+pool_link(struct pool_list *g, struct pool_chunk *c) {
+	c->prev = NULL;
+	c->next = g->partial;
+	if (g->partial) {
+		g->partial->prev = c;
+	}
+	g->partial = c;
+}
+
+static void
+pool_unlink(struct pool_list *g, struct pool_chunk *c) {
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		g->partial = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+}
+
+// 在 g->lock 中调用
+static struct pool_chunk *
+pool_chunk_new(struct pool_list *g, int cls) {
+	struct pool_chunk * c = g->spare;
+	if (c) {
+		g->spare = NULL;
+		return c;
+	}
+	c = aligned_alloc(POOL_CHUNK, POOL_CHUNK);
+	if (c == NULL) malloc_oom(POOL_CHUNK);
+	size_t size = pool_size[cls];
+	int n = (POOL_CHUNK - POOL_CHUNK_HEADER) / size;
+	int i;
+	c->freelist = NULL;
+	for (i=n-1;i>=0;i--) {
+		struct pool_block * b = (struct pool_block *)((char *)c + POOL_CHUNK_HEADER + i * size);
+		b->next = c->freelist;
+		c->freelist = b;
+	}
+	c->nfree = n;
+	c->n = n;
+	++g->nchunk;
+	return c;
+}
+
+static void
+pool_refill(int cls) {
+	struct pool_cache * cache = &pool_tls[cls];
+	struct pool_list * g = &pool_global[cls];
+	int n = 0;
+	while (__sync_lock_test_and_set(&g->lock,1)) {}
+	if (g->partial == NULL) {
+		pool_link(g, pool_chunk_new(g, cls));
+	}
+	while (g->partial && n < POOL_REFILL) {
+		struct pool_chunk * c = g->partial;
+		while (c->freelist && n < POOL_REFILL) {
+			struct pool_block * b = c->freelist;
+			c->freelist = b->next;
+			--c->nfree;
+			b->next = cache->head;
+			cache->head = b;
+			++n;
+		}
+		if (c->freelist == NULL) {
+			pool_unlink(g, c);
+		}
+	}
+	__sync_lock_release(&g->lock);
+	cache->n += n;
+}
+
+inline static void *
+pool_alloc(int cls) {
+	struct pool_cache * c = &pool_tls[cls];
+	if (c->head == NULL) {
+		pool_refill(cls);
+	}
+	struct pool_block * b = c->head;
+	c->head = b->next;
+	--c->n;
+	return b;
+}
+
+// 把线程缓存中的 n 个块还给各自的 chunk ，全部空闲的 chunk 还给系统
+static void
+pool_flush(int cls, int n) {
+	struct pool_cache * cache = &pool_tls[cls];
+	struct pool_list * g = &pool_global[cls];
+	while (__sync_lock_test_and_set(&g->lock,1)) {}
+	while (n-- > 0) {
+		struct pool_block * b = cache->head;
+		cache->head = b->next;
+		--cache->n;
+		struct pool_chunk * c = pool_chunk_of(b);
+		b->next = c->freelist;
+		c->freelist = b;
+		if (c->nfree++ == 0) {
+			pool_link(g, c);
+		}
+		if (c->nfree == c->n) {
+			pool_unlink(g, c);
+			if (g->spare == NULL) {
+				g->spare = c;
+			} else {
+				--g->nchunk;
+				free(c);
+			}
+		}
+	}
+	__sync_lock_release(&g->lock);
+}
+
+inline static void
+pool_free(void *ptr, int cls) {
+	struct pool_cache * c = &pool_tls[cls];
+	struct pool_block * b = ptr;
+	b->next = c->head;
+	c->head = b;
+	if (++c->n > POOL_CACHE_MAX) {
+		pool_flush(cls, POOL_CACHE_MAX / 2);
+	}
+}
+
+// 统计用的块大小
+inline static size_t
+header_usable(struct mem_header *h) {
+	if (h->size & HEADER_POOL) {
+		return pool_size[h->size & ~HEADER_POOL];
+	}
+	return h->size + HEADER_SIZE;
+}
+
+inline static void *
+fill_header(struct mem_header *h, uint32_t size) {
+	struct memory_stat * stat = owner_tls;
+	h->handle = stat ? stat->handle : 0;
+	h->size = size;
+	size_t usable = header_usable(h);
+	h->stat = (uintptr_t)stat | profile_alloc(h, usable, h->handle);
+	update_xmalloc_stat_alloc(stat, usable);
+	return h + 1;
+}
+
+inline static struct mem_header *
+clean_header(void *ptr) {
+	struct mem_header * h = (struct mem_header *)ptr - 1;
+	if (h->stat & PROFILE_TAG) {
+		profile_free(h);
+	}
+	update_xmalloc_stat_free(h->handle, (struct memory_stat *)(h->stat & ~(uintptr_t)PROFILE_TAG), header_usable(h));
+	return h;
+}
+
+inline static uint32_t
+system_size(size_t size) {
+	return size > HEADER_SIZE_MAX ? HEADER_SIZE_MAX : (uint32_t)size;
+}
+
+int
+malloc_set_backend(const char *name) {
+	if (strcmp(name, "system") == 0) {
+		backend = BACKEND_SYSTEM;
+	} else if (strcmp(name, "pool") == 0) {
+		pool_init();
+		backend = BACKEND_POOL;
+	} else {
+		skynet_error(NULL, "Unknown malloc backend %s.", name);
+		return -1;
+	}
+	return 0;
+}
+
+void *
+skynet_malloc(size_t size) {
+	if (size > SIZE_MAX - HEADER_SIZE) malloc_oom(size);
+	if (over_limit(size))
+		return NULL;
+	if (backend == BACKEND_POOL) {
+		int cls = pool_class(size + HEADER_SIZE);
+		if (cls >= 0) {
+			return fill_header(pool_alloc(cls), HEADER_POOL | cls);
+		}
+	}
+	struct mem_header * h = malloc(size + HEADER_SIZE);
+	if (!h) malloc_oom(size);
+	return fill_header(h, system_size(size));
+}
+
+void
+skynet_free(void *ptr) {
+	if (ptr == NULL) return;
+	struct mem_header * h = clean_header(ptr);
+	if (h->size & HEADER_POOL) {
+		pool_free(h, h->size & ~HEADER_POOL);
+	} else {
+		free(h);
+	}
+}
+
+void *
+skynet_realloc(void *ptr, size_t size) {
+	if (ptr == NULL) return skynet_malloc(size);
+
+	if (size > SIZE_MAX - HEADER_SIZE) malloc_oom(size);
+	struct mem_header * h = (struct mem_header *)ptr - 1;
+	size_t old = header_usable(h) - HEADER_SIZE;
+	if (size > old && over_limit(size - old))
+		return NULL;
+	int cls = backend == BACKEND_POOL ? pool_class(size + HEADER_SIZE) : -1;
+	if (h->size & HEADER_POOL) {
+		if (cls == (int)(h->size & ~HEADER_POOL)) {
+			return ptr;
+		}
+	} else if (cls < 0) {
+		clean_header(ptr);
+		struct mem_header * nh = realloc(h, size + HEADER_SIZE);
+		if (!nh) malloc_oom(size);
+		return fill_header(nh, system_size(size));
+	}
+	// 在池和系统之间，或者池的不同级别之间移动，已经检查过上限
+	int limit = malloc_limit(0);
+	void * newptr = skynet_malloc(size);
+	malloc_limit(limit);
+	memcpy(newptr, ptr, old < size ? old : size);
+	skynet_free(ptr);
+	return newptr;
+}
+
+void *
+skynet_calloc(size_t nmemb,size_t size) {
+	if (size && nmemb > (SIZE_MAX - HEADER_SIZE) / size)
+		return NULL;
+	void * ptr = skynet_malloc(nmemb * size);
+	if (ptr == NULL)
+		return NULL;
+	memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
 void 
 memory_info_dump(void) {
 	skynet_error(NULL, "No jemalloc");
@@ -180,30 +1010,124 @@ mallctl_opt(const char* name, int* newval) {
 	return 0;
 }
 
+static void
+release_arena(struct memory_stat *stat) {
+}
+
+int
+malloc_arena(struct memory_stat *stat, int group) {
+	skynet_error(NULL, "No jemalloc : malloc_arena %d.", group);
+	return -1;
+}
+
+void
+dump_arena_mem(void) {
+	skynet_error(NULL, "No jemalloc");
+}
+
 #endif
 
 size_t
 malloc_used_memory(void) {
-	return _used_memory;
+	ssize_t used = 0;
+	int i;
+	for (i=0;i<SHARD_MAX;i++) {
+		used += mem_shards[i].used;
+	}
+	return used;
 }
 
 size_t
 malloc_memory_block(void) {
-	return _memory_block;
+	ssize_t block = 0;
+	int i;
+	for (i=0;i<SHARD_MAX;i++) {
+		block += mem_shards[i].block;
+	}
+	return block;
+}
+
+struct memory_stat *
+malloc_stat_open(uint32_t handle) {
+	struct memory_stat * stat;
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	stat = stat_free;
+	if (stat) {
+		stat_free = stat->next;
+	}
+	__sync_lock_release(&stat_lock);
+	if (stat == NULL) {
+		// not charged to anyone, and outlives the service
+		stat = malloc(sizeof(*stat));
+	}
+	stat->handle = handle;
+	stat->allocated = 0;
+	stat->soft = 0;
+	stat->hard = 0;
+	stat->warn = MEMORY_WARN_NONE;
+	stat->refused = 0;
+	stat->refused_time = 0;
+	stat->arena = 0;
+	stat->group = 0;
+	stat->prev = NULL;
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	stat->next = stat_list;
+	if (stat_list) {
+		stat_list->prev = stat;
+	}
+	stat_list = stat;
+	__sync_lock_release(&stat_lock);
+	return stat;
+}
+
+void
+malloc_stat_close(struct memory_stat *stat) {
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	if (stat->prev) {
+		stat->prev->next = stat->next;
+	} else {
+		stat_list = stat->next;
+	}
+	if (stat->next) {
+		stat->next->prev = stat->prev;
+	}
+	stat->handle = 0;
+	__sync_lock_release(&stat_lock);
+	release_arena(stat);
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	stat->prev = NULL;
+	stat->next = stat_free;
+	stat_free = stat;
+	__sync_lock_release(&stat_lock);
+}
+
+struct memory_stat *
+malloc_bind(struct memory_stat *stat) {
+	struct memory_stat * last = owner_tls;
+	owner_tls = stat;
+	return last;
+}
+
+int
+malloc_limit(int enable) {
+	int last = limit_tls;
+	limit_tls = enable;
+	return last;
 }
 
 void
 dump_c_mem() {
-	int i;
 	size_t total = 0;
 	printf("dump all service mem:\n");
-	for(i=0; i<SLOT_SIZE; i++) {
-		mem_data* data = &mem_stats[i];
-		if(data->handle != 0 && data->allocated != 0) {
-			total += data->allocated;
-			printf("0x%x -> %zdkb\n", data->handle, data->allocated >> 10);
+	while (__sync_lock_test_and_set(&stat_lock,1)) {}
+	struct memory_stat * stat;
+	for (stat = stat_list; stat; stat = stat->next) {
+		if (stat->allocated != 0) {
+			total += stat->allocated;
+			printf("0x%x -> %zdkb\n", stat->handle, stat->allocated >> 10);
 		}
 	}
+	__sync_lock_release(&stat_lock);
 	printf("+total: %zdkb\n",total >> 10);
 }
 
@@ -215,18 +1139,147 @@ skynet_strdup(const char *str) {
 	return ret;
 }
 
+// 一个 lua 虚拟机专用的小对象池，虚拟机同一时间只在一个工作线程上运行，所以不加锁。
+// lua 释放和 realloc 时总会给出原来的大小，所以不需要块头：不超过 LPOOL_MAX 的块都来自池。
+// 池向 skynet_malloc 整块申请，按块计入所属的服务，lua_close 之后一次全部释放。
+#define LPOOL_ALIGN 8
+#define LPOOL_MAX 128
+#define LPOOL_CLASSES (LPOOL_MAX / LPOOL_ALIGN)
+#define LPOOL_CHUNK (16 * 1024)
+
+struct lpool_chunk {
+	struct lpool_chunk * next;
+};
+
+struct lpool_block {
+	struct lpool_block * next;
+};
+
+struct skynet_lpool {
+	struct lpool_block * freelist[LPOOL_CLASSES];
+	char * ptr;
+	char * end;
+	struct lpool_chunk * chunk;
+};
+
+struct skynet_lpool *
+skynet_lpool_new(void) {
+	struct skynet_lpool * pool = skynet_malloc(sizeof(*pool));
+	memset(pool, 0, sizeof(*pool));
+	return pool;
+}
+
+void
+skynet_lpool_delete(struct skynet_lpool *pool) {
+	if (pool == NULL)
+		return;
+	struct lpool_chunk * c = pool->chunk;
+	while (c) {
+		struct lpool_chunk * next = c->next;
+		skynet_free(c);
+		c = next;
+	}
+	skynet_free(pool);
+}
+
+inline static int
+lpool_class(size_t sz) {
+	return (int)((sz + LPOOL_ALIGN - 1) / LPOOL_ALIGN) - 1;
+}
+
+// 超过硬上限时让 lua 报内存不足，lua 虚拟机在服务之外（比如 lua_close）分配时也检查
+inline static int
+lalloc_limit(size_t sz) {
+	struct memory_stat * stat = owner_tls;
+	if (stat && stat->hard && stat->allocated + (ssize_t)sz > stat->hard) {
+		++stat->refused;
+		return 1;
+	}
+	return 0;
+}
+
+// grow 为 0 时是收缩，不检查上限，不能失败
+static void *
+lpool_alloc(struct skynet_lpool *pool, size_t sz, int grow) {
+	int cls = lpool_class(sz);
+	struct lpool_block * b = pool->freelist[cls];
+	if (b) {
+		pool->freelist[cls] = b->next;
+		return b;
+	}
+	size_t size = (cls + 1) * LPOOL_ALIGN;
+	if (pool->ptr + size > pool->end) {
+		// 当前块剩下的部分不足，直接丢弃
+		if (grow && lalloc_limit(LPOOL_CHUNK))
+			return NULL;
+		int limit = malloc_limit(0);
+		struct lpool_chunk * c = skynet_malloc(LPOOL_CHUNK);
+		malloc_limit(limit);
+		c->next = pool->chunk;
+		pool->chunk = c;
+		pool->ptr = (char *)c + LPOOL_ALIGN;
+		pool->end = (char *)c + LPOOL_CHUNK;
+	}
+	void * ret = pool->ptr;
+	pool->ptr += size;
+	return ret;
+}
+
+inline static void
+lpool_free(struct skynet_lpool *pool, void *ptr, size_t sz) {
+	int cls = lpool_class(sz);
+	struct lpool_block * b = ptr;
+	b->next = pool->freelist[cls];
+	pool->freelist[cls] = b;
+}
+
+// ud 为 skynet_lpool_new 的返回值时小对象从池中分配，为 NULL 时都用 skynet_realloc
 void * 
 skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct skynet_lpool * pool = ud;
+	if (ptr == NULL) {
+		osize = 0;	// ptr 为空时 osize 是对象的类型
+	}
 	if (nsize == 0) {
-		skynet_free(ptr);
+		if (pool && osize && osize <= LPOOL_MAX) {
+			lpool_free(pool, ptr, osize);
+		} else {
+			skynet_free(ptr);
+		}
 		return NULL;
-	} else {
+	}
+	if (pool == NULL || (osize > LPOOL_MAX && nsize > LPOOL_MAX)) {
+		// 收缩不能失败
+		if (nsize > osize && lalloc_limit(nsize))
+			return NULL;
 		return skynet_realloc(ptr, nsize);
 	}
+	if (osize && osize <= LPOOL_MAX && nsize <= LPOOL_MAX && lpool_class(osize) == lpool_class(nsize)) {
+		return ptr;
+	}
+	void * newptr;
+	if (nsize <= LPOOL_MAX) {
+		newptr = lpool_alloc(pool, nsize, nsize > osize);
+	} else if (lalloc_limit(nsize)) {
+		newptr = NULL;
+	} else {
+		newptr = skynet_malloc(nsize);
+	}
+	if (newptr == NULL)
+		return NULL;
+	if (ptr) {
+		memcpy(newptr, ptr, osize < nsize ? osize : nsize);
+		if (osize <= LPOOL_MAX) {
+			lpool_free(pool, ptr, osize);
+		} else {
+			skynet_free(ptr);
+		}
+	}
+	return newptr;
 }
 
 void
 malloc_inithook(void) {
-	memset(mem_stats, 0, sizeof(mem_stats));
+	memset(mem_shards, 0, sizeof(mem_shards));
 }
 
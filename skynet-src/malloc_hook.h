@@ -2,6 +2,24 @@
 #define __MALLOC_HOOK_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// per service memory counter, it comes from a pool that is never returned to the system,
+// so a block freed after the service exits can still check the handle safely.
+struct memory_stat {
+	uint32_t handle;	// 0 after close
+	ssize_t allocated;
+	ssize_t soft;	// limits in bytes, 0 for none
+	ssize_t hard;	// allocations in service code fail beyond it
+	int warn;	// MEMORY_WARN_*
+	int refused;	// allocations failed on the hard limit since the owner was told
+	uint32_t refused_time;	// when the owner was last told, the server tells it at most once a second
+	unsigned arena;	// private or group jemalloc arena, 0 for the default ones
+	int group;	// arena group, 0 for a private arena
+	struct memory_stat * prev;
+	struct memory_stat * next;
+};
 
 extern size_t malloc_used_memory(void);
 extern size_t malloc_memory_block(void);
@@ -10,5 +28,26 @@ extern size_t mallctl_int64(const char* name, size_t* newval);
 extern int    mallctl_opt(const char* name, int* newval);
 extern void   dump_c_mem(void);
 
+#define MEMORY_WARN_NONE 0
+#define MEMORY_WARN_SOFT 1	// set by the allocator when allocated crosses soft
+#define MEMORY_WARN_SENT 2	// the owner has been told
+
+extern struct memory_stat * malloc_stat_open(uint32_t handle);
+// stop counting for stat and put it back to the pool
+extern void   malloc_stat_close(struct memory_stat *stat);
+// charge the allocations of the current thread to stat (NULL for none), return the last one
+extern struct memory_stat * malloc_bind(struct memory_stat *stat);
+// the hard limit only fails allocations while enabled (the service's own code), return the last state
+extern int    malloc_limit(int enable);
+// give the owner of stat its own arena (group 0) or the arena shared by group, -1 for none
+extern int    malloc_arena(struct memory_stat *stat, int group);
+extern void   dump_arena_mem(void);
+// sample about one allocation every rate bytes for the heap profiler, 0 to stop
+extern void   malloc_profile(size_t rate);
+// write live samples of handle (0 for all) to filename in pprof heap profile format, return the number of samples
+extern int    malloc_profile_dump(const char *filename, uint32_t handle);
+// "system" or "pool" without jemalloc, return -1 when unknown or jemalloc is in use
+extern int    malloc_set_backend(const char *name);
+
 #endif /* __MALLOC_HOOK_H */
 
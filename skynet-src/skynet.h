@@ -22,11 +22,27 @@
 
 #define PTYPE_TAG_DONTCOPY 0x10000
 #define PTYPE_TAG_ALLOCSESSION 0x20000
+// msg is a buffer from skynet_shared_new, one reference is moved to the receiver.
+// Only receivers that enabled the "SHARED" command get the buffer itself, the others get a private copy.
+#define PTYPE_TAG_SHARED 0x40000
 
 struct skynet_context;
 
 void skynet_error(struct skynet_context * context, const char *msg, ...);
 const char * skynet_command(struct skynet_context * context, const char * cmd , const char * parm);
+// typed fast path of the hot commands, no string formatting
+int skynet_command_timeout(struct skynet_context * context, int ti);
+uint32_t skynet_command_now(void);
+int skynet_command_mqlen(struct skynet_context * context);
+uint32_t skynet_command_query(struct skynet_context * context, const char * name);
+// launch n services at once, the '_init' of them run in parallel; failed slots of handle are 0
+int skynet_command_launch(struct skynet_context * context, int n, const char * name[], const char * param[], uint32_t handle[]);
+
+// pending call table, an expired session gets a PTYPE_RESERVED_ERROR response from destination.
+// Only a response from destination completes a call. Deadlines are checked every 0.1s,
+// so a call may expire up to 100ms after ti.
+void skynet_pending_add(struct skynet_context * context, uint32_t destination, int session, int ti);
+int skynet_pending_stat(struct skynet_context * context, uint32_t *oldest);
 uint32_t skynet_queryname(struct skynet_context * context, const char * name);
 int skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * msg, size_t sz);
 int skynet_sendname(struct skynet_context * context, const char * destination , int type, int session, void * msg, size_t sz);
@@ -36,6 +52,25 @@ int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
+struct skynet_batch_item {
+	int type;
+	int session;
+	uint32_t source;
+	const void * msg;
+	size_t sz;
+};
+
+// return the number of messages consumed from the front of msgs (1 to n), the rest stay in the mailbox.
+// msg of consumed items is freed after return. Returning less than 1 is a fatal error:
+// no message is freed, all of them go back to the mailbox and the service is killed.
+typedef int (*skynet_batch_cb)(struct skynet_context * context, void *ud, struct skynet_batch_item * msgs, int n);
+void skynet_callback_batch(struct skynet_context * context, void *ud, skynet_batch_cb cb);
+
 uint32_t skynet_current_handle(void);
 
+// refcounted immutable message buffer, use with PTYPE_TAG_SHARED
+void * skynet_shared_new(size_t sz);
+void * skynet_shared_grab(void * data);
+void skynet_shared_release(void * data);
+
 #endif
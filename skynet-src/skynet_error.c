@@ -6,6 +6,7 @@
 #include "skynet_handle.h"
 #include "skynet_mq.h"
 #include "skynet_server.h"
+#include "malloc_hook.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -31,6 +32,7 @@ skynet_error(struct skynet_context * context, const char *msg, ...) {
 
 	char tmp[LOG_MESSAGE_SIZE];
 	char *data = NULL;
+	int limit = malloc_limit(0); // 日志不受服务的内存硬上限限制
 
 	va_list ap;
 
@@ -65,5 +67,6 @@ skynet_error(struct skynet_context * context, const char *msg, ...) {
 	smsg.data = data;
 	smsg.sz = len | (PTYPE_TEXT << HANDLE_REMOTE_SHIFT);
 	skynet_context_push(logger, &smsg);
+	malloc_limit(limit);
 }
 
@@ -25,8 +25,10 @@ struct handle_storage {
 	uint32_t harbor; ///< 节点
 	uint32_t handle_index; ///< 句柄引索
 	int slot_size; ///< 槽的大小
+	int slot_count; ///< 已用的槽数
 	struct skynet_context ** slot;
 	
+	uint32_t generation; ///< 名字表的版本，名字增删时 +1 ，用于让名字缓存失效
 	int name_cap;
 	int name_count;
 	struct handle_name *name; ///< 句柄的名字
@@ -34,6 +36,27 @@ struct handle_storage {
 
 static struct handle_storage *H = NULL; ///< 全局结构变量的指针
 
+/// 槽的数量翻倍，重新散列已有的 Context，调用前需加写锁
+/// \param[in] *s
+/// \return static void
+static void
+_expand_slot(struct handle_storage *s) {
+	int i;
+	assert((s->slot_size*2 - 1) <= HANDLE_MASK); // 断言
+	struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *)); // 分配内存
+	memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *)); // 清空结构
+	for (i=0;i<s->slot_size;i++) {
+		if (s->slot[i] == NULL)
+			continue;
+		int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
+		assert(new_slot[hash] == NULL); // 断言
+		new_slot[hash] = s->slot[i];
+	}
+	skynet_free(s->slot); // 释放
+	s->slot = new_slot;
+	s->slot_size *= 2;
+}
+
 /// 注册句柄
 /// \param[in] *ctx
 /// \return uint32_t
@@ -50,6 +73,7 @@ skynet_handle_register(struct skynet_context *ctx) {
 			int hash = handle & (s->slot_size-1);
 			if (s->slot[hash] == NULL) {
 				s->slot[hash] = ctx;
+				s->slot_count++;
 				s->handle_index = handle + 1;
 
 				rwlock_wunlock(&s->lock); // 解锁
@@ -59,20 +83,24 @@ skynet_handle_register(struct skynet_context *ctx) {
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK); // 断言
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *)); // 分配内存
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *)); // 清空结构
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL); // 断言
-			new_slot[hash] = s->slot[i];
-		}
-		skynet_free(s->slot); // 释放
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		_expand_slot(s);
 	}
 }
 
+/// 预留槽，批量注册前调用，避免注册中途多次扩容
+/// \param[in] n 将要注册的句柄数
+/// \return void
+void
+skynet_handle_reserve(int n) {
+	struct handle_storage *s = H;
+
+	rwlock_wlock(&s->lock);
+	while (s->slot_size - s->slot_count < n) {
+		_expand_slot(s);
+	}
+	rwlock_wunlock(&s->lock);
+}
+
 /// 收回句柄
 /// \param[in] handle
 /// \return void
@@ -86,8 +114,10 @@ skynet_handle_retire(uint32_t handle) {
 	struct skynet_context * ctx = s->slot[hash];
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
+		skynet_context_retire(ctx); // 消息队列不再调度到这个 Context
 		skynet_context_release(ctx); // 释放 Context 结构
 		s->slot[hash] = NULL;
+		s->slot_count--;
 		int i;
 		int j=0, n=s->name_count;
 		for (i=0; i<n; ++i) {
@@ -99,7 +129,10 @@ skynet_handle_retire(uint32_t handle) {
 			}
 			++j;
 		}
-		s->name_count = j;
+		if (s->name_count != j) {
+			s->name_count = j;
+			__sync_add_and_fetch(&s->generation, 1);
+		}
 	}
 
 	rwlock_wunlock(&s->lock); // 解锁
@@ -182,6 +215,13 @@ skynet_handle_findname(const char * name) {
 	return handle;
 }
 
+/// 获得名字表的版本，版本不变时之前 findname 的结果仍然有效
+/// \return uint32_t
+uint32_t
+skynet_handle_generation() {
+	return ((volatile struct handle_storage *)H)->generation;
+}
+
 /// 在之前插入名字
 /// \param[in] *s
 /// \param[in] *name
@@ -250,6 +290,9 @@ skynet_handle_namehandle(uint32_t handle, const char *name) {
 	rwlock_wlock(&H->lock);
 
 	const char * ret = _insert_name(H, name, handle);
+	if (ret) {
+		__sync_add_and_fetch(&H->generation, 1);
+	}
 
 	rwlock_wunlock(&H->lock);
 
@@ -264,6 +307,7 @@ skynet_handle_init(int harbor) {
 	assert(H==NULL); // 断言
 	struct handle_storage * s = skynet_malloc(sizeof(*H)); // 分配内存
 	s->slot_size = DEFAULT_SLOT_SIZE; // 设置默认槽的大小 =4
+	s->slot_count = 0;
 	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *)); // 分配slot_size份内存
 	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
 
@@ -271,6 +315,7 @@ skynet_handle_init(int harbor) {
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
+	s->generation = 0;
 	s->name_cap = 2;
 	s->name_count = 0;
 	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name)); // 分配内存
@@ -8,12 +8,14 @@
 struct skynet_context;
 
 uint32_t skynet_handle_register(struct skynet_context *);
+void skynet_handle_reserve(int n);	// make room for n more handles before a batch register
 void skynet_handle_retire(uint32_t handle);
 struct skynet_context * skynet_handle_grab(uint32_t handle);
 void skynet_handle_retireall();
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
+uint32_t skynet_handle_generation();	// bumped whenever a name is added or removed
 
 void skynet_handle_init(int harbor);
 
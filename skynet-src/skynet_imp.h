@@ -11,6 +11,14 @@ struct skynet_config {
 	const char * local; // 节点的地址
 	const char * start; // 启动的 LUA服务
 	const char * standalone; // master监听的地址
+	int trace_sample; // 每多少个入口消息采样一个跟踪，0 为关闭
+	const char * malloc; // 内存分配的后端，没有 jemalloc 时可选 system 或 pool
+	int socket_thread; // 网络线程数，每个线程 poll 一个分片
+	int socket_reuseport; // 监听时每个网络线程各开一个 SO_REUSEPORT 的 fd
+	int socket_edge; // 网络线程使用边沿触发
+	int socket_uring; // 网络线程使用 io_uring ，不可用时退回 epoll
+	int dns_thread; // 域名解析的线程数，0 为在网络线程中解析
+	int dns_ttl; // 域名解析结果缓存的秒数，0 为不缓存
 };
 
 void skynet_start(struct skynet_config * config); // 启动 Skynet
@@ -27,7 +27,6 @@ optint(const char *key, int opt) {
 	return strtol(str, NULL, 10);
 }
 
-/*
 static int
 optboolean(const char *key, int opt) {
 	const char * str = skynet_getenv(key);
@@ -37,7 +36,6 @@ optboolean(const char *key, int opt) {
 	}
 	return strcmp(str,"true")==0;
 }
-*/
 static const char *
 optstring(const char *key,const char * opt) {
 	const char * str = skynet_getenv(key);
@@ -129,6 +127,14 @@ main(int argc, char *argv[]) {
 	config.start = optstring("start","main.lua"); // 启动的第一个 LUA 服务
 	config.local = optstring("address","127.0.0.1:2525"); // 节点的地址
 	config.standalone = optstring("standalone",NULL); // master 监听的地址
+	config.trace_sample = optint("trace_sample",0); // 跟踪的采样间隔
+	config.malloc = optstring("malloc",NULL); // 内存分配的后端
+	config.socket_thread = optint("socket_thread",1); // 网络线程数
+	config.socket_reuseport = optboolean("socket_reuseport",0); // 监听是否按网络线程分开
+	config.socket_edge = optboolean("socket_edge",0); // 网络线程是否使用边沿触发
+	config.socket_uring = optboolean("socket_uring",0); // 网络线程是否使用 io_uring
+	config.dns_thread = optint("dns_thread",1); // 域名解析的线程数
+	config.dns_ttl = optint("dns_ttl",0); // 域名解析结果缓存的秒数
 
 	lua_close(L);
 
@@ -3,16 +3,10 @@
 
 #include <stddef.h>
 
-#define NOUSE_JEMALLOC
-#ifdef NOUSE_JEMALLOC
-
-#define skynet_malloc malloc
-#define skynet_calloc calloc
-#define skynet_realloc realloc
-#define skynet_free free
-
-#endif
+// malloc_hook.c uses jemalloc unless NOUSE_JEMALLOC is defined (see JEMALLOC in the Makefile),
+// without it the functions below are served by a system or pool backend
 
+// in a service callback, allocations return NULL beyond the hard limit set by MEMLIMIT
 void * skynet_malloc(size_t sz);
 void * skynet_calloc(size_t nmemb,size_t size);
 void * skynet_realloc(void *ptr, size_t size);
@@ -20,4 +14,9 @@ void skynet_free(void *ptr);
 char * skynet_strdup(const char *str);
 void * skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua
 
+// small object pool for one lua state, pass it as the ud of skynet_lalloc and delete it after lua_close
+struct skynet_lpool;
+struct skynet_lpool * skynet_lpool_new(void);
+void skynet_lpool_delete(struct skynet_lpool *pool);
+
 #endif
@@ -5,6 +5,7 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_server.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,7 @@
 /// 消息队列的结构
 struct message_queue {
 	uint32_t handle; ///< 句柄
+	struct skynet_context * ctx; ///< 所属的 Context，回收或释放后为 NULL
 	int cap; ///< 队列大小
 	int head; ///< 队列头
 	int tail; ///< 队列尾
@@ -34,7 +36,9 @@ struct message_queue {
 	int release; ///< 释放
 	int lock_session; ///< 会话锁
 	int in_global; ///< 全局
+	int slab; ///< 是否和 Context 一起从 slab 中分配，初始的消息数组紧跟在结构后面
 	struct skynet_message *queue; ///< 消息
+	struct skynet_message_ext *ext; ///< 和 queue 平行的附加部分，第一次压入带附加部分的消息时分配
 };
 
 /// 全局队列的结构
@@ -95,13 +99,32 @@ skynet_globalmq_pop() {
 	return mq; // 返回消息队列的指针
 }
 
+/// 消息队列和初始的消息数组一起需要的内存
+/// \return size_t
+size_t
+skynet_mq_memsize(void) {
+	return sizeof(struct message_queue) + sizeof(struct skynet_message) * DEFAULT_QUEUE_SIZE;
+}
+
+/// 初始的消息数组是否在 slab 中
+/// \param[in] *q
+/// \return static inline int
+static inline int
+_embedded_queue(struct message_queue *q) {
+	return q->slab && q->queue == (struct skynet_message *)(q+1);
+}
+
 /// 创建消息队列
 /// \param[in] handle
+/// \param[in] *ctx 拥有这个队列的 Context
+/// \param[in] *mem 大小为 skynet_mq_memsize() 的内存，释放时交还 skynet_context_slab_free ；为 NULL 时自己分配
 /// \return struct message_queue *
 struct message_queue * 
-skynet_mq_create(uint32_t handle) {
-	struct message_queue *q = skynet_malloc(sizeof(*q)); // 分配内存
+skynet_mq_create(uint32_t handle, struct skynet_context *ctx, void *mem) {
+	struct message_queue *q = mem ? mem : skynet_malloc(sizeof(*q)); // 分配内存
+	q->slab = mem != NULL;
 	q->handle = handle; // 句柄
+	q->ctx = ctx; // 所属的 Context
 	q->cap = DEFAULT_QUEUE_SIZE; // 默认队列大小
 	q->head = 0; // 队列头
 	q->tail = 0; // 队列尾
@@ -109,7 +132,12 @@ skynet_mq_create(uint32_t handle) {
 	q->in_global = MQ_IN_GLOBAL; // 在全局队列中
 	q->release = 0; // 释放
 	q->lock_session = 0; // 会话
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap); // 分配cap份内存
+	q->ext = NULL; // 附加部分用到时再分配
+	if (q->slab) {
+		q->queue = (struct skynet_message *)(q+1); // 使用 slab 中的消息数组
+	} else {
+		q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap); // 分配cap份内存
+	}
 
 	return q; // 返回消息队列结构的指针
 }
@@ -119,8 +147,15 @@ skynet_mq_create(uint32_t handle) {
 /// \return static void
 static void 
 _release(struct message_queue *q) {
-	skynet_free(q->queue); // 释放消息队列的队列
-	skynet_free(q); // 释放消息队列
+	skynet_free(q->ext); // 释放附加部分
+	if (!_embedded_queue(q)) {
+		skynet_free(q->queue); // 释放消息队列的队列
+	}
+	if (q->slab) {
+		skynet_context_slab_free(q); // 交还 slab
+	} else {
+		skynet_free(q); // 释放消息队列
+	}
 }
 
 /// 获得消息队列的句柄
@@ -131,6 +166,34 @@ skynet_mq_handle(struct message_queue *q) {
 	return q->handle; // 返回句柄的值
 }
 
+/// 获得消息队列所属的 Context，并增加其引用计数
+///
+/// 调度时用它代替 skynet_handle_grab，不必再加句柄表的读写锁。
+/// Context 释放时会先在队列锁内调用 skynet_mq_mark_release ，之后才释放内存，
+/// 所以持有队列锁时 q->ctx 一定是有效的指针；引用计数已经为 0 说明正在释放，视为不存在。
+/// \param[in] *q
+/// \return struct skynet_context * 失败返回 NULL
+struct skynet_context *
+skynet_mq_grab(struct message_queue *q) {
+	struct skynet_context * ctx = NULL;
+	LOCK(q) // 加锁
+	if (q->ctx && skynet_context_trygrab(q->ctx)) {
+		ctx = q->ctx;
+	}
+	UNLOCK(q) // 解锁
+	return ctx;
+}
+
+/// 断开消息队列和 Context 的关联，句柄回收时调用
+/// \param[in] *q
+/// \return void
+void
+skynet_mq_detach(struct message_queue *q) {
+	LOCK(q) // 加锁
+	q->ctx = NULL;
+	UNLOCK(q) // 解锁
+}
+
 /// 获得消息队列的长度
 /// \param[in] *q
 /// \return int
@@ -150,17 +213,56 @@ skynet_mq_length(struct message_queue *q) {
 	return tail + cap - head; // 否则返回队列尾 + 默认队列大小 - 队列头
 }
 
-/// 弹出消息队列
+/// 把消息写入队列的第 i 项，加锁后调用
+///
+/// 没有附加部分的队列不分配 ext ，写入普通消息时只复制消息本身。
 /// \param[in] *q
+/// \param[in] i
 /// \param[in] *message
+/// \param[in] *ext 可以为 NULL
+/// \return static inline void
+static inline void
+_put(struct message_queue *q, int i, struct skynet_message *message, struct skynet_message_ext *ext) {
+	q->queue[i] = *message;
+	if (ext && ext->flag) {
+		if (q->ext == NULL) {
+			q->ext = skynet_malloc(sizeof(struct skynet_message_ext) * q->cap);
+			memset(q->ext, 0, sizeof(struct skynet_message_ext) * q->cap);
+		}
+		q->ext[i] = *ext;
+	} else if (q->ext) {
+		q->ext[i].flag = 0;
+	}
+}
+
+/// 读出队列的第 i 项，加锁后调用
+/// \param[in] *q
+/// \param[in] i
+/// \param[out] *message
+/// \param[out] *ext
+/// \return static inline void
+static inline void
+_get(struct message_queue *q, int i, struct skynet_message *message, struct skynet_message_ext *ext) {
+	*message = q->queue[i];
+	if (q->ext && q->ext[i].flag) {
+		*ext = q->ext[i];
+	} else {
+		ext->flag = 0;
+	}
+}
+
+/// 弹出消息队列
+/// \param[in] *q
+/// \param[out] *message
+/// \param[out] *ext 消息的附加部分
 /// \return int
 int
-skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext) {
 	int ret = 1; // 失败
 	LOCK(q) // 锁住
 
 	if (q->head != q->tail) { // 如果队列头不等于队列尾
-		*message = q->queue[q->head]; // 取出队列头
+		_get(q, q->head, message, ext); // 取出队列头
 		ret = 0; // 弹出成功返回0
 		if ( ++ q->head >= q->cap) { // 如果队列头 >= 最大队列数
 			q->head = 0; // 队列头 head = 0
@@ -176,6 +278,68 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	return ret;
 }
 
+/// 调度时再弹出最多 max 条消息
+///
+/// 和 skynet_mq_pop 不同，队列为空时不修改 in_global ，队列仍然由当前的工作线程调度。
+/// \param[in] *q
+/// \param[out] *message 消息数组
+/// \param[out] *ext 附加部分的数组
+/// \param[in] max
+/// \return int 弹出的消息数
+int
+skynet_mq_pop_more(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext, int max) {
+	int n = 0;
+	LOCK(q) // 锁住
+	while (n < max && q->head != q->tail) {
+		_get(q, q->head, &message[n], &ext[n]);
+		++n;
+		if ( ++ q->head >= q->cap) {
+			q->head = 0;
+		}
+	}
+	UNLOCK(q) // 解锁
+	return n;
+}
+
+static void expand_queue(struct message_queue *q);
+
+/// 把消息插入队列头，队列满时展开
+/// \param[in] *q
+/// \param[in] *message
+/// \param[in] *ext 可以为 NULL
+/// \return static void
+static void
+_insert_head(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext) {
+	int head = q->head - 1; // head为队列头 -1
+	if (head < 0) { // 如果head小于0
+		head = q->cap - 1; // 队列数 -1
+	}
+	if (head == q->tail) { // 如果 head 等于队列尾
+		expand_queue(q); // 展开队列
+		--q->tail; // 队列尾 -1
+		head = q->cap - 1; // head 等于队列数 -1
+	}
+
+	_put(q, head, message, ext); // 压入消息到队列
+	q->head = head; // 队列头等于 head
+}
+
+/// 把没有处理的消息按顺序放回队列头
+/// \param[in] *q
+/// \param[in] *message 消息数组
+/// \param[in] *ext 附加部分的数组
+/// \param[in] n
+/// \return void
+void
+skynet_mq_pushback(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext, int n) {
+	LOCK(q) // 锁住
+	while (n > 0) {
+		--n;
+		_insert_head(q, &message[n], &ext[n]);
+	}
+	UNLOCK(q) // 解锁
+}
+
 /// 展开队列
 /// \param[in] *q
 /// \return static void
@@ -186,11 +350,23 @@ expand_queue(struct message_queue *q) {
 	for (i=0;i<q->cap;i++) { // 循环所有
 		new_queue[i] = q->queue[(q->head + i) % q->cap]; // 求余数，取出消息
 	}
+	if (q->ext) {
+		// 附加部分按同样的顺序展开
+		struct skynet_message_ext *new_ext = skynet_malloc(sizeof(struct skynet_message_ext) * q->cap * 2);
+		for (i=0;i<q->cap;i++) {
+			new_ext[i] = q->ext[(q->head + i) % q->cap];
+		}
+		memset(new_ext + q->cap, 0, sizeof(struct skynet_message_ext) * q->cap);
+		skynet_free(q->ext);
+		q->ext = new_ext;
+	}
 	q->head = 0; // 队列头
 	q->tail = q->cap; // 队列尾
 	q->cap *= 2; // 队列数
 	
-	skynet_free(q->queue); // 释放
+	if (!_embedded_queue(q)) {
+		skynet_free(q->queue); // 释放
+	}
 	q->queue = new_queue; // 返回新的消息队列
 }
 
@@ -213,39 +389,30 @@ _unlock(struct message_queue *q) {
 /// 压入队列头
 /// \param[in] *q
 /// \param[in] *message
+/// \param[in] *ext
 /// \return static void
 static void 
-_pushhead(struct message_queue *q, struct skynet_message *message) {
-	int head = q->head - 1; // head为队列头 -1
-	if (head < 0) { // 如果head小于0
-		head = q->cap - 1; // 队列数 -1
-	}
-	if (head == q->tail) { // 如果 head 等于队列尾
-		expand_queue(q); // 展开队列
-		--q->tail; // 队列尾 -1
-		head = q->cap - 1; // head 等于队列数 -1
-	}
-
-	q->queue[head] = *message; // 压入消息到队列
-	q->head = head; // 队列头等于 head
+_pushhead(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext) {
+	_insert_head(q, message, ext); // 压入消息到队列头
 
 	_unlock(q); // 解锁
 }
 
-/// 压入消息队列
+/// 压入带附加部分的消息
 /// \param[in] *q
 /// \param[in] *message
+/// \param[in] *ext 附加部分，可以为 NULL
 /// \return void
 void 
-skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+skynet_mq_push_ext(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext) {
 	assert(message); // 断言 消息是否存在
 	LOCK(q) // 锁住消息队列
 	
 	// 如果会话锁不为0,且消息会话等于消息队列的会话锁
 	if (q->lock_session !=0 && message->session == q->lock_session) {
-		_pushhead(q,message); // 将消息压入消息队列的头
+		_pushhead(q,message,ext); // 将消息压入消息队列的头
 	} else {
-		q->queue[q->tail] = *message; // 将消息压入消息队列的尾
+		_put(q, q->tail, message, ext); // 将消息压入消息队列的尾
 		if (++ q->tail >= q->cap) { // 如果队列尾的值大于等于cap
 			q->tail = 0; // 则，队列尾等于0
 		}
@@ -265,6 +432,15 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	UNLOCK(q) // 解锁
 }
 
+/// 压入消息队列
+/// \param[in] *q
+/// \param[in] *message
+/// \return void
+void
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	skynet_mq_push_ext(q, message, NULL);
+}
+
 /// 锁住消息队列
 /// \param[in] *q
 /// \param[in] session
@@ -336,6 +512,7 @@ skynet_mq_mark_release(struct message_queue *q) {
 	LOCK(q) // 锁住
 	assert(q->release == 0); // 断言
 	q->release = 1;
+	q->ctx = NULL; // Context 即将被释放
 	if (q->in_global != MQ_IN_GLOBAL) { // 标志不为在全局
 		skynet_globalmq_push(q); // 压缩全局消息队列
 	}
@@ -349,15 +526,33 @@ static int
 _drop_queue(struct message_queue *q) {
 	// todo: send message back to message source
 	struct skynet_message msg;
+	struct skynet_message_ext ext;
 	int s = 0;
-	while(!skynet_mq_pop(q, &msg)) {
+	while(!skynet_mq_pop(q, &msg, &ext)) {
 		++s;
-		skynet_free(msg.data);
+		skynet_message_free(&msg, &ext);
 	}
 	_release(q);
 	return s;
 }
 
+/// 释放消息的数据，共享缓冲只减少引用计数，内联的数据不需要释放
+/// \param[in] *message
+/// \param[in] *ext 消息的附加部分，可以为 NULL
+/// \return void
+void
+skynet_message_free(struct skynet_message *message, struct skynet_message_ext *ext) {
+	int flag = ext ? ext->flag : 0;
+	if (flag & MESSAGE_FLAG_INLINE) {
+		return;
+	}
+	if (flag & MESSAGE_FLAG_SHARED) {
+		skynet_shared_release(message->data);
+	} else {
+		skynet_free(message->data);
+	}
+}
+
 /// 释放消息队列
 /// \param[in] *q
 /// \return int
@@ -4,6 +4,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#define MESSAGE_FLAG_SHARED 1 // data 是引用计数的共享缓冲
+#define MESSAGE_FLAG_INLINE 2 // 数据直接存放在附加部分的 buffer 中
+#define MESSAGE_FLAG_TRACE 4 // 被跟踪的消息，trace 、span 和 time 有效
+
+// 发给本地服务、小于这个长度的复制消息内联存放（包括结尾的 '\0'）
+#define MESSAGE_INLINE_SIZE 32
+
 struct skynet_message {
 	uint32_t source;        // 来源
 	int session;            // 会话
@@ -11,18 +18,36 @@ struct skynet_message {
 	size_t sz;              // 数据的长度
 };
 
+// 消息的附加部分，不放在消息中，只有压入过内联、共享或跟踪的消息的队列才分配，消息本身的大小不变
+struct skynet_message_ext {
+	int flag;               // 标志 MESSAGE_FLAG_* ，0 表示没有附加部分
+	uint32_t trace;         // 跟踪编号，下面三项只在 MESSAGE_FLAG_TRACE 时有效
+	uint32_t span;          // 父 span
+	uint32_t time;          // 压入队列的时间（微秒）
+	char buffer[MESSAGE_INLINE_SIZE]; // 内联的数据
+};
+
+void skynet_message_free(struct skynet_message *message, struct skynet_message_ext *ext); // 释放消息的数据，ext 可以为 NULL
+
 struct message_queue;
+struct skynet_context;
 
 struct message_queue * skynet_globalmq_pop(void); // 弹出全局消息队列
 
-struct message_queue * skynet_mq_create(uint32_t handle); // 创建消息队列
+size_t skynet_mq_memsize(void); // 消息队列和初始的消息数组需要的内存
+struct message_queue * skynet_mq_create(uint32_t handle, struct skynet_context *ctx, void *mem); // 创建消息队列
+struct skynet_context * skynet_mq_grab(struct message_queue *q); // 获得队列所属的 Context，并增加引用计数
+void skynet_mq_detach(struct message_queue *q); // 断开队列和 Context 的关联
 void skynet_mq_mark_release(struct message_queue *q); // 标记释放消息队列
 int skynet_mq_release(struct message_queue *q); // 释放消息队列
 uint32_t skynet_mq_handle(struct message_queue *); // 消息队列的句柄
 
 // 0 for success
-int skynet_mq_pop(struct message_queue *q, struct skynet_message *message); // 弹出消息队列
+int skynet_mq_pop(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext); // 弹出消息队列，没有附加部分时 ext->flag 为 0
+int skynet_mq_pop_more(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext, int max); // 调度时再弹出最多 max 条消息
+void skynet_mq_pushback(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext, int n); // 把没有处理的消息按顺序放回队列头
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message); // 压入消息队列
+void skynet_mq_push_ext(struct message_queue *q, struct skynet_message *message, struct skynet_message_ext *ext); // 压入带附加部分的消息，ext 可以为 NULL
 void skynet_mq_lock(struct message_queue *q, int session); // 锁住消息队列
 void skynet_mq_unlock(struct message_queue *q); // 解锁消息队列
 
@@ -12,12 +12,17 @@
 #include "skynet_harbor.h"
 #include "skynet_env.h"
 #include "skynet_monitor.h"
+#include "skynet_trace.h"
+#include "malloc_hook.h"
 
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#define MESSAGE_BATCH 32 ///< 批量调度时最多一次处理的消息数
 
 #ifdef CALLING_CHECK
 
@@ -44,10 +49,17 @@ struct skynet_context {
 	char result[32]; ///<
 	void * cb_ud; ///<
 	skynet_cb cb; ///< 模块的返回函数
+	void * batch_ud; ///<
+	skynet_batch_cb batch_cb; ///< 批量处理消息的返回函数，设置后代替 cb
 	int session_id; ///< 会话编号
 	struct message_queue *queue; ///< 消息队列
 	bool init; ///< 是否成功实例化
 	bool endless; ///<
+	bool shared_msg; ///< 是否直接接收共享缓冲，否则收到复制的数据
+	struct pending_table * pending; ///< 等待回应的调用表，第一次使用时创建
+	struct name_cache * names; ///< 名字解析缓存，第一次使用时创建
+	struct memory_stat * mem; ///< 服务分配的内存，由 malloc_hook 统计
+	char * spare; ///< 交给返回函数的内联消息的缓冲，返回函数没有保留它时下次接着用
 
 	CHECKCALLING_DECL
 };
@@ -61,6 +73,178 @@ struct skynet_node {
 static struct skynet_node G_NODE = { 0,0 };
 static __thread uint32_t handle_tls = 0xffffffff;
 
+#define SLAB_CHUNK 64 ///< 每次向系统申请的块数
+
+struct context_chunk;
+
+/// slab 中的一块：Context 、消息队列和初始的消息数组一起分配
+///
+/// Context 和消息队列的生命期不同（队列在 Context 释放后才由工作线程丢弃），
+/// 所以各持有一个引用，都释放后放回所在 chunk 的空闲链表。
+/// 服务的内存统计不在这里（见 malloc_stat_open ），所以 chunk 可以还给系统。
+struct context_slot {
+	struct context_chunk * chunk; ///< 所在的 chunk
+	struct context_slot * next; ///< 空闲链表
+	int ref; ///< 引用计数
+	struct skynet_context ctx; ///< Context
+	// 后面是消息队列，大小为 skynet_mq_memsize()
+};
+
+/// 一次向系统申请的连续内存，头部之后是 n 块
+struct context_chunk {
+	struct context_chunk * prev; ///< 有空闲块的 chunk 组成的双向链表
+	struct context_chunk * next;
+	struct context_slot * freelist; ///< chunk 内的空闲块
+	int nfree; ///< 空闲块数
+	int n; ///< 总块数
+};
+
+#define SLAB_HEADER ((sizeof(struct context_chunk) + 63) & ~(size_t)63) ///< chunk 头部的大小，按 64 字节对齐
+
+/// Context 的 slab
+///
+/// 完全空闲的 chunk 只保留一个，避免服务反复启动退出时来回申请；更多的还给系统。
+struct context_slab {
+	int lock; ///< 锁
+	size_t size; ///< 每块的大小，按 64 字节对齐
+	int nfree; ///< 所有 chunk 中的空闲块数
+	int nempty; ///< 完全空闲的 chunk 数
+	struct context_chunk * partial; ///< 有空闲块的 chunk
+};
+
+static struct context_slab SLAB = { 0, 0, 0, 0, NULL };
+
+/// 把 chunk 加入有空闲块的链表，调用前需加锁
+/// \param[in] *s
+/// \param[in] *c
+/// \return static void
+static void
+_slab_link(struct context_slab *s, struct context_chunk *c) {
+	c->prev = NULL;
+	c->next = s->partial;
+	if (s->partial) {
+		s->partial->prev = c;
+	}
+	s->partial = c;
+}
+
+/// 把 chunk 移出有空闲块的链表，调用前需加锁
+/// \param[in] *s
+/// \param[in] *c
+/// \return static void
+static void
+_slab_unlink(struct context_slab *s, struct context_chunk *c) {
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		s->partial = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+}
+
+/// 向系统申请一个 n 块的 chunk ，调用前需加锁
+/// \param[in] *s
+/// \param[in] n
+/// \return static void
+static void
+_slab_grow(struct context_slab *s, int n) {
+	if (s->size == 0) {
+		s->size = (sizeof(struct context_slot) + skynet_mq_memsize() + 63) & ~(size_t)63;
+	}
+	char * mem = skynet_malloc(SLAB_HEADER + s->size * n);
+	struct context_chunk * c = (struct context_chunk *)mem;
+	c->freelist = NULL;
+	c->nfree = n;
+	c->n = n;
+	int i;
+	for (i=n-1;i>=0;i--) {
+		struct context_slot * slot = (struct context_slot *)(mem + SLAB_HEADER + s->size * i);
+		slot->chunk = c;
+		slot->next = c->freelist;
+		c->freelist = slot;
+	}
+	_slab_link(s, c);
+	s->nfree += n;
+	s->nempty++;
+}
+
+/// 保证空闲块至少有 n 块，批量创建 Context 前调用
+/// \param[in] n
+/// \return static void
+static void
+_slab_reserve(int n) {
+	struct context_slab * s = &SLAB;
+	while (__sync_lock_test_and_set(&s->lock,1)) {}
+	if (s->nfree < n) {
+		_slab_grow(s, n - s->nfree);
+	}
+	__sync_lock_release(&s->lock);
+}
+
+/// 从 slab 中分配一块
+/// \return static struct context_slot *
+static struct context_slot *
+_slab_alloc() {
+	struct context_slab * s = &SLAB;
+	while (__sync_lock_test_and_set(&s->lock,1)) {}
+	if (s->partial == NULL) {
+		_slab_grow(s, SLAB_CHUNK);
+	}
+	struct context_chunk * c = s->partial;
+	struct context_slot * slot = c->freelist;
+	c->freelist = slot->next;
+	if (c->nfree-- == c->n) {
+		s->nempty--;
+	}
+	if (c->nfree == 0) {
+		_slab_unlink(s, c);
+	}
+	s->nfree--;
+	__sync_lock_release(&s->lock);
+
+	slot->next = NULL;
+	slot->ref = 2;
+	return slot;
+}
+
+/// 释放 slab 中一块的一个引用，都释放后放回所在的 chunk ，多余的空 chunk 还给系统
+/// \param[in] *slot
+/// \return static void
+static void
+_slab_free(struct context_slot *slot) {
+	if (__sync_sub_and_fetch(&slot->ref,1) != 0) {
+		return;
+	}
+	struct context_slab * s = &SLAB;
+	struct context_chunk * c = slot->chunk;
+	struct context_chunk * empty = NULL;
+	while (__sync_lock_test_and_set(&s->lock,1)) {}
+	slot->next = c->freelist;
+	c->freelist = slot;
+	if (c->nfree++ == 0) {
+		_slab_link(s, c);
+	}
+	s->nfree++;
+	if (c->nfree == c->n && ++s->nempty > 1) {
+		_slab_unlink(s, c);
+		s->nfree -= c->n;
+		s->nempty--;
+		empty = c;
+	}
+	__sync_lock_release(&s->lock);
+	skynet_free(empty);
+}
+
+/// 消息队列丢弃时交还它在 slab 中的部分
+/// \param[in] *q
+/// \return void
+void
+skynet_context_slab_free(struct message_queue *q) {
+	_slab_free((struct context_slot *)((char *)q - sizeof(struct context_slot)));
+}
+
 /// 获得 Context 总数
 /// \return int
 int 
@@ -105,12 +289,11 @@ _id_to_hex(char * str, uint32_t id) {
 	str[9] = '\0';
 }
 
-/// 新建 Context，加载服务模块
+/// 创建 Context 并注册句柄，还没有调用模块的 '_init'
 /// \param[in] *name 模块的名称
-/// \param[in] *param 传递给模块的参数
-/// \return struct skynet_context *
-struct skynet_context * 
-skynet_context_new(const char * name, const char *param) {
+/// \return static struct skynet_context * 失败返回 NULL
+static struct skynet_context *
+_context_create(const char * name) {
         // 查询模块数组，找到则直接返回模块结构的指针
 	struct skynet_module * mod = skynet_module_query(name);
 
@@ -120,7 +303,8 @@ skynet_context_new(const char * name, const char *param) {
 	void *inst = skynet_module_instance_create(mod); // 实例化 '_create' 函数
 	if (inst == NULL) // 实例化失败，则直接返回
 		return NULL;
-	struct skynet_context * ctx = skynet_malloc(sizeof(*ctx)); // 分配内存
+	struct context_slot * slot = _slab_alloc(); // 从 slab 中分配 Context 和消息队列
+	struct skynet_context * ctx = &slot->ctx;
 	CHECKCALLING_INIT(ctx)
 
 	ctx->mod = mod; // 模块结构的指针
@@ -128,19 +312,41 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->ref = 2;
 	ctx->cb = NULL; // 返回函数
 	ctx->cb_ud = NULL;
+	ctx->batch_cb = NULL;
+	ctx->batch_ud = NULL;
 	ctx->session_id = 0; // 会话编号
 
 	ctx->init = false;
 	ctx->endless = false;
+	ctx->shared_msg = false;
+	ctx->pending = NULL;
+	ctx->names = NULL;
+	ctx->spare = NULL;
+	ctx->queue = NULL;
 	ctx->handle = skynet_handle_register(ctx);
+	ctx->mem = malloc_stat_open(ctx->handle);
 
 	// 创建 Context 结构中的消息队列
-	struct message_queue * queue = ctx->queue = skynet_mq_create(ctx->handle);
+	ctx->queue = skynet_mq_create(ctx->handle, ctx, slot+1);
 	// init function maybe use ctx->handle, so it must init at last
 	_context_inc(); // Context数 +1
 
+	return ctx;
+}
+
+/// 调用模块的 '_init'，成功后把消息队列压入全局队列
+/// \param[in] *ctx _context_create 的返回值
+/// \param[in] *name 模块的名称
+/// \param[in] *param 传递给模块的参数
+/// \return static struct skynet_context * 失败返回 NULL
+static struct skynet_context *
+_context_start(struct skynet_context * ctx, const char * name, const char *param) {
+	struct message_queue * queue = ctx->queue;
+
 	CHECKCALLING_BEGIN(ctx)
-	int r = skynet_module_instance_init(mod, inst, ctx, param); // 实例化 '_init' 函数
+	struct memory_stat * last = malloc_bind(ctx->mem); // '_init' 中分配的内存算在新服务上
+	int r = skynet_module_instance_init(ctx->mod, ctx->instance, ctx, param); // 实例化 '_init' 函数
+	malloc_bind(last);
 	CHECKCALLING_END(ctx)
 	if (r == 0) {
 		struct skynet_context * ret = skynet_context_release(ctx); // 实例化 '_release' 函数
@@ -161,6 +367,153 @@ skynet_context_new(const char * name, const char *param) {
 	}
 }
 
+/// 新建 Context，加载服务模块
+/// \param[in] *name 模块的名称
+/// \param[in] *param 传递给模块的参数
+/// \return struct skynet_context *
+struct skynet_context * 
+skynet_context_new(const char * name, const char *param) {
+	struct skynet_context * ctx = _context_create(name);
+	if (ctx == NULL)
+		return NULL;
+	return _context_start(ctx, name, param);
+}
+
+/// 批量启动服务，各服务的 '_init' 由调用者和工作线程一起执行
+struct launch_batch {
+	int n; ///< 服务数
+	int next; ///< 下一个要执行 '_init' 的服务
+	int done; ///< 已完成的服务数
+	const char ** name; ///< 模块的名称
+	const char ** param; ///< 传递给模块的参数
+	struct skynet_context ** ctx; ///< _context_create 的结果
+	uint32_t * handle; ///< 启动成功的句柄，失败为 0
+};
+
+/// 正在进行的批量启动
+struct launch_state {
+	int busy; ///< 同一时间只有一批
+	pthread_mutex_t lock; ///< 保护 helpers 和 batch
+	pthread_cond_t cond; ///< 一批执行完或帮忙的工作线程退出时通知发起者
+	int helpers; ///< 正在执行 batch 的工作线程数
+	struct launch_batch * batch;
+	void (*wakeup)(void *ud); ///< 唤醒睡眠的工作线程，由 skynet_start 设置
+	void * wakeup_ud;
+};
+
+static struct launch_state LAUNCH = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, NULL, NULL };
+
+/// 领取并执行批量启动中的 '_init'，直到领完
+/// \param[in] *b
+/// \return static void
+static void
+_launch_work(struct launch_batch *b) {
+	for (;;) {
+		int i = __sync_fetch_and_add(&b->next, 1);
+		if (i >= b->n)
+			return;
+		struct skynet_context * ctx = b->ctx[i];
+		if (ctx) {
+			ctx = _context_start(ctx, b->name[i], b->param[i]);
+		}
+		b->handle[i] = ctx ? ctx->handle : 0;
+		if (__sync_add_and_fetch(&b->done, 1) == b->n) {
+			pthread_mutex_lock(&LAUNCH.lock);
+			pthread_cond_broadcast(&LAUNCH.cond);
+			pthread_mutex_unlock(&LAUNCH.lock);
+		}
+	}
+}
+
+/// 工作线程调度消息前调用，有批量启动时帮忙执行 '_init'
+/// \return static void
+static void
+_launch_help() {
+	if (LAUNCH.batch == NULL)
+		return;
+	// 在锁内登记，发起者清空 batch 后等待 helpers 归零，之后 batch 就可以释放
+	pthread_mutex_lock(&LAUNCH.lock);
+	struct launch_batch * b = LAUNCH.batch;
+	if (b) {
+		++LAUNCH.helpers;
+	}
+	pthread_mutex_unlock(&LAUNCH.lock);
+	if (b == NULL)
+		return;
+	_launch_work(b);
+	pthread_mutex_lock(&LAUNCH.lock);
+	if (--LAUNCH.helpers == 0) {
+		pthread_cond_broadcast(&LAUNCH.cond);
+	}
+	pthread_mutex_unlock(&LAUNCH.lock);
+}
+
+/// 设置批量启动时唤醒工作线程的函数
+/// \param[in] wakeup 为 NULL 时不唤醒，只有正在调度的工作线程会帮忙
+/// \param[in] *ud
+/// \return void
+void
+skynet_context_setwakeup(void (*wakeup)(void *ud), void *ud) {
+	LAUNCH.wakeup_ud = ud;
+	LAUNCH.wakeup = wakeup;
+}
+
+/// 批量新建服务
+///
+/// 先预留句柄槽和 slab ，在调用者线程中依次创建 Context 并注册句柄，
+/// 再把各服务的 '_init' 交给工作线程并行执行，并唤醒睡眠的工作线程。
+/// 调用者也参与执行，所以没有空闲工作线程时也不会死锁；执行完自己领到的部分后在条件变量上等待。
+/// \param[in] n 服务数
+/// \param[in] *name[] 模块的名称
+/// \param[in] *param[] 传递给模块的参数
+/// \param[out] handle[] 启动成功的句柄，失败为 0
+/// \return int 启动成功的服务数
+int
+skynet_context_newbatch(int n, const char * name[], const char * param[], uint32_t handle[]) {
+	if (n <= 0)
+		return 0;
+	skynet_handle_reserve(n);
+	_slab_reserve(n);
+
+	struct skynet_context ** ctx = skynet_malloc(n * sizeof(*ctx));
+	int i;
+	for (i=0;i<n;i++) {
+		ctx[i] = _context_create(name[i]);
+	}
+
+	struct launch_batch b = { n, 0, 0, name, param, ctx, handle };
+	if (__sync_lock_test_and_set(&LAUNCH.busy,1) == 0) {
+		pthread_mutex_lock(&LAUNCH.lock);
+		LAUNCH.batch = &b;
+		pthread_mutex_unlock(&LAUNCH.lock);
+		if (LAUNCH.wakeup) {
+			LAUNCH.wakeup(LAUNCH.wakeup_ud);
+		}
+		_launch_work(&b);
+		pthread_mutex_lock(&LAUNCH.lock);
+		while (b.done < n) {
+			pthread_cond_wait(&LAUNCH.cond, &LAUNCH.lock);
+		}
+		LAUNCH.batch = NULL;
+		while (LAUNCH.helpers > 0) {
+			pthread_cond_wait(&LAUNCH.cond, &LAUNCH.lock);
+		}
+		pthread_mutex_unlock(&LAUNCH.lock);
+		__sync_lock_release(&LAUNCH.busy);
+	} else {
+		// 已有一批在进行（比如在 '_init' 中嵌套调用），在本线程中依次执行
+		_launch_work(&b);
+	}
+	skynet_free(ctx);
+
+	int ok = 0;
+	for (i=0;i<n;i++) {
+		if (handle[i])
+			++ok;
+	}
+	return ok;
+}
+
 /// 新会话
 /// \param[in] *ctx
 /// \return int 新的会话编号
@@ -179,6 +532,371 @@ skynet_context_grab(struct skynet_context *ctx) {
 	__sync_add_and_fetch(&ctx->ref,1); // 先加再返回
 }
 
+/// 引用计数不为 0 时才增加引用
+/// \param[in] *ctx
+/// \return int 成功返回 1，Context 正在释放返回 0
+int
+skynet_context_trygrab(struct skynet_context *ctx) {
+	for (;;) {
+		int ref = ctx->ref;
+		if (ref <= 0) {
+			return 0;
+		}
+		if (__sync_bool_compare_and_swap(&ctx->ref, ref, ref+1)) {
+			return 1;
+		}
+	}
+}
+
+/// 句柄回收时调用，之后消息队列不再调度到这个 Context
+/// \param[in] *ctx
+/// \return void
+void
+skynet_context_retire(struct skynet_context *ctx) {
+	if (ctx->queue) {
+		skynet_mq_detach(ctx->queue);
+	}
+}
+
+#define PENDING_TICK 10 ///< 检查超时调用的间隔，单位是 1/100 秒，超时最多晚这么久才发现
+
+/// 等待回应的调用
+struct pending_call {
+	int session; ///< 会话，0 表示空槽
+	uint32_t destination; ///< 被调用的服务
+	uint32_t start; ///< 发起的时间
+	uint32_t deadline; ///< 到期的时间
+};
+
+/// 到期时间
+struct pending_expire {
+	uint32_t deadline; ///< 到期的时间
+	int session; ///< 会话
+};
+
+/// 等待回应的调用表
+///
+/// 只在 Context 的调度线程中访问，不需要加锁。
+/// 调用按会话保存在哈希表中；到期时间放在最小堆中，收到回应时不从堆中删除，检查时再跳过。
+/// 表不为空时只有一个定时器，每隔 PENDING_TICK 检查一次，不必为每个调用添加定时器。
+struct pending_table {
+	int count; ///< 等待中的调用数
+	int cap; ///< 哈希表的大小，2 的幂
+	struct pending_call * slot; ///< 按会话索引的哈希表（线性探测）
+	int heap_n; ///< 堆的大小
+	int heap_cap; ///< 堆的容量
+	struct pending_expire * heap; ///< 按到期时间排序的最小堆
+	int timer_session; ///< 检查定时器的会话，0 表示没有定时器
+};
+
+/// 会话的哈希值
+/// \param[in] *p
+/// \param[in] session
+/// \return static inline int
+static inline int
+_pending_hash(struct pending_table *p, int session) {
+	return ((uint32_t)session * 2654435761u) & (p->cap - 1);
+}
+
+/// 查找调用
+/// \param[in] *p
+/// \param[in] session
+/// \return static struct pending_call * 没找到返回 NULL
+static struct pending_call *
+_pending_find(struct pending_table *p, int session) {
+	int i = _pending_hash(p, session);
+	for (;;) {
+		struct pending_call * c = &p->slot[i];
+		if (c->session == session) {
+			return c;
+		}
+		if (c->session == 0) {
+			return NULL;
+		}
+		i = (i+1) & (p->cap - 1);
+	}
+}
+
+/// 插入调用，不检查是否已经存在
+/// \param[in] *p
+/// \param[in] *call
+/// \return static void
+static void
+_pending_insert(struct pending_table *p, struct pending_call *call) {
+	if ((p->count + 1) * 2 > p->cap) {
+		// 扩展哈希表，负载不超过一半
+		struct pending_call * old = p->slot;
+		int old_cap = p->cap;
+		p->cap *= 2;
+		p->slot = skynet_malloc(p->cap * sizeof(struct pending_call));
+		memset(p->slot, 0, p->cap * sizeof(struct pending_call));
+		p->count = 0;
+		int i;
+		for (i=0;i<old_cap;i++) {
+			if (old[i].session) {
+				_pending_insert(p, &old[i]);
+			}
+		}
+		skynet_free(old);
+	}
+	int i = _pending_hash(p, call->session);
+	while (p->slot[i].session) {
+		i = (i+1) & (p->cap - 1);
+	}
+	p->slot[i] = *call;
+	++p->count;
+}
+
+/// 删除调用，把后面的元素向前移动，不留下墓碑
+/// \param[in] *p
+/// \param[in] *c 哈希表中的调用
+/// \return static void
+static void
+_pending_erase(struct pending_table *p, struct pending_call *c) {
+	int mask = p->cap - 1;
+	int i = c - p->slot;
+	int j = i;
+	--p->count;
+	for (;;) {
+		p->slot[i].session = 0;
+		for (;;) {
+			j = (j+1) & mask;
+			if (p->slot[j].session == 0) {
+				return;
+			}
+			int k = _pending_hash(p, p->slot[j].session);
+			// k 在 (i, j] 之间时，元素不能移动到 i
+			if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+				continue;
+			}
+			p->slot[i] = p->slot[j];
+			i = j;
+			break;
+		}
+	}
+}
+
+/// 到期时间 a 是否早于 b
+/// \return static inline int
+static inline int
+_pending_before(struct pending_expire *a, struct pending_expire *b) {
+	return (int)(a->deadline - b->deadline) < 0;
+}
+
+/// 压入最小堆
+/// \param[in] *p
+/// \param[in] deadline
+/// \param[in] session
+/// \return static void
+static void
+_pending_heap_push(struct pending_table *p, uint32_t deadline, int session) {
+	if (p->heap_n >= p->heap_cap) {
+		p->heap_cap *= 2;
+		p->heap = skynet_realloc(p->heap, p->heap_cap * sizeof(struct pending_expire));
+	}
+	struct pending_expire e = { deadline, session };
+	int i = p->heap_n++;
+	while (i > 0) {
+		int parent = (i-1)/2;
+		if (!_pending_before(&e, &p->heap[parent])) {
+			break;
+		}
+		p->heap[i] = p->heap[parent];
+		i = parent;
+	}
+	p->heap[i] = e;
+}
+
+/// 弹出最小堆的堆顶
+/// \param[in] *p
+/// \return static void
+static void
+_pending_heap_pop(struct pending_table *p) {
+	struct pending_expire e = p->heap[--p->heap_n];
+	int n = p->heap_n;
+	int i = 0;
+	for (;;) {
+		int child = i*2+1;
+		if (child >= n) {
+			break;
+		}
+		if (child+1 < n && _pending_before(&p->heap[child+1], &p->heap[child])) {
+			++child;
+		}
+		if (!_pending_before(&p->heap[child], &e)) {
+			break;
+		}
+		p->heap[i] = p->heap[child];
+		i = child;
+	}
+	if (n > 0) {
+		p->heap[i] = e;
+	}
+}
+
+/// 堆中过期的元素太多时，从哈希表重建堆
+/// \param[in] *p
+/// \return static void
+static void
+_pending_heap_compact(struct pending_table *p) {
+	if (p->heap_n <= p->count * 2 + 64) {
+		return;
+	}
+	p->heap_n = 0;
+	int i;
+	for (i=0;i<p->cap;i++) {
+		struct pending_call * c = &p->slot[i];
+		if (c->session) {
+			_pending_heap_push(p, c->deadline, c->session);
+		}
+	}
+}
+
+/// 没有检查定时器时添加一个
+/// \param[in] *ctx
+/// \return static void
+static void
+_pending_arm(struct skynet_context *ctx) {
+	struct pending_table * p = ctx->pending;
+	if (p->timer_session == 0 && p->count > 0) {
+		p->timer_session = skynet_context_newsession(ctx);
+		skynet_timeout(ctx->handle, PENDING_TICK, p->timer_session);
+	}
+}
+
+/// 检查定时器到期，给超时的调用发送 PTYPE_RESERVED_ERROR 回应
+/// \param[in] *ctx
+/// \return static void
+static void
+_pending_tick(struct skynet_context *ctx) {
+	struct pending_table * p = ctx->pending;
+	uint32_t now = skynet_gettime();
+	p->timer_session = 0;
+	while (p->heap_n > 0 && (int)(p->heap[0].deadline - now) <= 0) {
+		struct pending_expire e = p->heap[0];
+		_pending_heap_pop(p);
+		struct pending_call * c = _pending_find(p, e.session);
+		if (c == NULL || c->deadline != e.deadline) {
+			// 已经收到回应，或者重新设置了到期时间
+			continue;
+		}
+		struct skynet_message smsg;
+		smsg.source = c->destination;
+		smsg.session = c->session;
+		smsg.data = NULL;
+		smsg.sz = (size_t)PTYPE_RESERVED_ERROR << HANDLE_REMOTE_SHIFT;
+		_pending_erase(p, c);
+		skynet_mq_push(ctx->queue, &smsg);
+	}
+	_pending_heap_compact(p);
+	_pending_arm(ctx);
+}
+
+/// 调度前检查回应
+/// \param[in] *ctx
+/// \param[in] type
+/// \param[in] *msg
+/// \return static int 是检查定时器的消息返回 1，不再交给服务
+static int
+_pending_response(struct skynet_context *ctx, int type, struct skynet_message *msg) {
+	struct pending_table * p = ctx->pending;
+	if (type == PTYPE_RESPONSE && msg->source == 0 && msg->session == p->timer_session) {
+		_pending_tick(ctx);
+		return 1;
+	}
+	if (type == PTYPE_RESPONSE || type == PTYPE_RESERVED_ERROR) {
+		struct pending_call * c = _pending_find(p, msg->session);
+		// 只有被调用的服务的回应才算完成，其他来源用同一个会话发来的消息不影响调用
+		if (c && c->destination == msg->source) {
+			_pending_erase(p, c);
+		}
+	}
+	return 0;
+}
+
+/// 释放等待回应的调用表
+/// \param[in] *p
+/// \return static void
+static void
+_pending_release(struct pending_table *p) {
+	if (p == NULL)
+		return;
+	skynet_free(p->slot);
+	skynet_free(p->heap);
+	skynet_free(p);
+}
+
+/// 记录一个等待回应的调用
+///
+/// 到期前没有收到 destination 发来的 PTYPE_RESPONSE 或 PTYPE_RESERVED_ERROR 时，框架会以 destination 为来源
+/// 发送一个 PTYPE_RESERVED_ERROR 回应。超时以后才到的回应照常分发，服务按未知的会话处理。
+/// 到期时间每 PENDING_TICK (0.1 秒) 检查一次，所以超时回应最多比 ti 晚 100 毫秒。
+/// 只能在服务自己的调度线程中调用。
+/// \param[in] *context
+/// \param[in] destination 被调用的服务
+/// \param[in] session 会话
+/// \param[in] ti 超时时间，单位是 1/100 秒
+/// \return void
+void
+skynet_pending_add(struct skynet_context * context, uint32_t destination, int session, int ti) {
+	if (session <= 0) {
+		return;
+	}
+	int limit = malloc_limit(0);
+	struct pending_table * p = context->pending;
+	if (p == NULL) {
+		p = skynet_malloc(sizeof(*p));
+		p->count = 0;
+		p->cap = 16;
+		p->slot = skynet_malloc(p->cap * sizeof(struct pending_call));
+		memset(p->slot, 0, p->cap * sizeof(struct pending_call));
+		p->heap_n = 0;
+		p->heap_cap = 16;
+		p->heap = skynet_malloc(p->heap_cap * sizeof(struct pending_expire));
+		p->timer_session = 0;
+		context->pending = p;
+	}
+	uint32_t now = skynet_gettime();
+	uint32_t deadline = now + (ti > 0 ? ti : 0);
+	struct pending_call * c = _pending_find(p, session);
+	if (c) {
+		c->destination = destination;
+		c->deadline = deadline;
+	} else {
+		struct pending_call call = { session, destination, now, deadline };
+		_pending_insert(p, &call);
+	}
+	_pending_heap_push(p, deadline, session);
+	_pending_arm(context);
+	malloc_limit(limit);
+}
+
+/// 获得等待回应的调用数
+/// \param[in] *context
+/// \param[out] *oldest 最早的调用已经等待的时间，单位是 1/100 秒，可以为 NULL
+/// \return int
+int
+skynet_pending_stat(struct skynet_context * context, uint32_t *oldest) {
+	struct pending_table * p = context->pending;
+	uint32_t age = 0;
+	int count = 0;
+	if (p) {
+		uint32_t now = skynet_gettime();
+		int i;
+		for (i=0;i<p->cap;i++) {
+			struct pending_call * c = &p->slot[i];
+			if (c->session && now - c->start > age) {
+				age = now - c->start;
+			}
+		}
+		count = p->count;
+	}
+	if (oldest) {
+		*oldest = age;
+	}
+	return count;
+}
+
 /// 删除 Context 结构
 /// \param[in] *ctx
 /// \return static void
@@ -186,7 +904,11 @@ static void
 _delete_context(struct skynet_context *ctx) {
 	skynet_module_instance_release(ctx->mod, ctx->instance); // 执行模块中的 '_release' 函数
 	skynet_mq_mark_release(ctx->queue); // 标记消息队列为释放状态
-	skynet_free(ctx); // 释放 Context 结构
+	_pending_release(ctx->pending); // 释放等待回应的调用表
+	skynet_free(ctx->names); // 释放名字解析缓存
+	skynet_free(ctx->spare); // 释放内联消息的缓冲
+	malloc_stat_close(ctx->mem); // 之后释放的内存不再计入这个服务
+	_slab_free((struct context_slot *)((char *)ctx - offsetof(struct context_slot, ctx))); // 交还 Context 在 slab 中的部分
 	_context_dec(); // Context 数 -1
 }
 
@@ -208,11 +930,21 @@ skynet_context_release(struct skynet_context *ctx) {
 /// \return int
 int
 skynet_context_push(uint32_t handle, struct skynet_message *message) {
+	return skynet_context_push_ext(handle, message, NULL);
+}
+
+/// 压入带附加部分的消息
+/// \param[in] handle 句柄
+/// \param[in] *message 消息结构
+/// \param[in] *ext 附加部分，可以为 NULL
+/// \return int
+int
+skynet_context_push_ext(uint32_t handle, struct skynet_message *message, struct skynet_message_ext *ext) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL) {
 		return -1;
 	}
-	skynet_mq_push(ctx->queue, message); // 压入消息队列
+	skynet_mq_push_ext(ctx->queue, message, ext); // 压入消息队列
 	skynet_context_release(ctx); // 释放 Context 结构
 
 	return 0;
@@ -245,23 +977,188 @@ skynet_isremote(struct skynet_context * ctx, uint32_t handle, int * harbor) {
 	return ret;
 }
 
-/// 消息调度
+/// 服务越过内存软上限，或者有分配因为硬上限失败时，通知服务自己和监视服务
+///
+/// 分配器中只做标记，因为在分配内存时不能再发消息。软上限的通知是 "MEMLIMIT allocated soft" ，
+/// 内存降回软上限以下后可以再次通知；硬上限的是 "MEMLIMIT allocated hard refused" ，每秒最多一次，
+/// refused 是这段时间内失败的分配数。
 /// \param[in] *ctx
-/// \param[in] *msg
 /// \return static void
 static void
-_dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
-	assert(ctx->init); // 断言
-	CHECKCALLING_BEGIN(ctx)
-	handle_tls = ctx->handle;
-	int type = msg->sz >> HANDLE_REMOTE_SHIFT;
-	size_t sz = msg->sz & HANDLE_MASK;
-
-	// 执行服务模块中的返回函数
-	if (!ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz)) {
-		skynet_free(msg->data); // 释放数据
-	}
+_memory_check(struct skynet_context *ctx) {
+	struct memory_stat * mem = ctx->mem;
+	char tmp[64];
+	int n;
+	if (mem->refused) {
+		uint32_t now = skynet_gettime();
+		if (mem->refused_time == 0 || now - mem->refused_time >= 100) {
+			int refused = mem->refused;
+			mem->refused = 0;
+			mem->refused_time = now ? now : 1;
+			n = sprintf(tmp, "MEMLIMIT %zd %zd %d", mem->allocated, mem->hard, refused);
+			skynet_error(ctx, "Memory limit %zdK, %d allocations failed (hard limit %zdK)", mem->allocated >> 10, refused, mem->hard >> 10);
+			skynet_send(ctx, ctx->handle, ctx->handle, PTYPE_SYSTEM, 0, tmp, n);
+			if (G_NODE.monitor_exit) {
+				skynet_send(ctx, ctx->handle, G_NODE.monitor_exit, PTYPE_SYSTEM, 0, tmp, n);
+			}
+		}
+	}
+	if (mem->warn == MEMORY_WARN_SENT) {
+		if (mem->allocated <= mem->soft) {
+			mem->warn = MEMORY_WARN_NONE;
+		}
+		return;
+	}
+	if (mem->warn != MEMORY_WARN_SOFT || !__sync_bool_compare_and_swap(&mem->warn, MEMORY_WARN_SOFT, MEMORY_WARN_SENT)) {
+		return;
+	}
+	n = sprintf(tmp, "MEMLIMIT %zd %zd", mem->allocated, mem->soft);
+	skynet_error(ctx, "Memory warning %zdK (soft limit %zdK)", mem->allocated >> 10, mem->soft >> 10);
+	skynet_send(ctx, ctx->handle, ctx->handle, PTYPE_SYSTEM, 0, tmp, n);
+	if (G_NODE.monitor_exit) {
+		skynet_send(ctx, ctx->handle, G_NODE.monitor_exit, PTYPE_SYSTEM, 0, tmp, n);
+	}
+}
+
+/// 消息调度
+/// \param[in] *ctx
+/// \param[in] *msg
+/// \param[in] *ext 消息的附加部分
+/// \return static void
+static void
+_dispatch_message(struct skynet_context *ctx, struct skynet_message *msg, struct skynet_message_ext *ext) {
+	assert(ctx->init); // 断言
+	CHECKCALLING_BEGIN(ctx)
+	handle_tls = ctx->handle;
+	malloc_bind(ctx->mem);
+	int type = msg->sz >> HANDLE_REMOTE_SHIFT;
+	size_t sz = msg->sz & HANDLE_MASK;
+	const void * data = msg->data;
+	int inlined = ext->flag & MESSAGE_FLAG_INLINE;
+	if (inlined) {
+		// 返回函数可以保留 data （返回 1），所以内联的数据复制到服务自己的缓冲中，没有保留时重复使用
+		if (ctx->spare == NULL) {
+			ctx->spare = skynet_malloc(MESSAGE_INLINE_SIZE);
+		}
+		memcpy(ctx->spare, ext->buffer, sz+1);
+		data = ctx->spare;
+	}
+	int traced = ext->flag & MESSAGE_FLAG_TRACE;
+	uint32_t trace_start = traced ? skynet_trace_enter(ext) : 0;
+
+	if (ctx->pending && _pending_response(ctx, type, msg)) {
+		// 调用表的检查定时器，不交给服务
+		skynet_message_free(msg, ext);
+	} else {
+		malloc_limit(1); // 服务自己的代码中，越过硬上限的分配失败
+		int reserve = ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, data, sz);
+		malloc_limit(0);
+		if (!reserve) {
+			// 执行服务模块中的返回函数，共享缓冲只减少引用计数
+			skynet_message_free(msg, ext); // 释放数据
+		} else if (inlined) {
+			ctx->spare = NULL; // 缓冲交给了服务，由服务 skynet_free
+		}
+	}
+	if (traced) {
+		skynet_trace_leave(ctx->handle, type, ext, trace_start);
+	}
+	handle_tls = 0xffffffff;
+	malloc_bind(NULL);
+	_memory_check(ctx);
+	CHECKCALLING_END(ctx)
+}
+
+static void handle_exit(struct skynet_context * context, uint32_t handle);
+
+/// 批量调度消息
+///
+/// 从队列中再取出最多 MESSAGE_BATCH - 1 条消息，一起交给 batch_cb ，没有处理的消息放回队列头。
+/// 被跟踪的消息单独调度，这样每个 span 只对应一条消息。
+/// \param[in] *ctx
+/// \param[in] *q
+/// \param[in] *first 已经弹出的第一条消息
+/// \param[in] *first_ext 第一条消息的附加部分
+/// \return static void
+static void
+_dispatch_batch(struct skynet_context *ctx, struct message_queue *q, struct skynet_message *first, struct skynet_message_ext *first_ext) {
+	struct skynet_message msg[MESSAGE_BATCH];
+	struct skynet_message_ext ext[MESSAGE_BATCH];
+	struct skynet_batch_item item[MESSAGE_BATCH];
+	int n = 1;
+	msg[0] = *first;
+	ext[0] = *first_ext;
+	int traced = first_ext->flag & MESSAGE_FLAG_TRACE;
+	if (!traced) {
+		n += skynet_mq_pop_more(q, msg+1, ext+1, MESSAGE_BATCH-1);
+		int i;
+		for (i=1;i<n;i++) {
+			if (ext[i].flag & MESSAGE_FLAG_TRACE) {
+				// 被跟踪的消息留到下一次调度
+				skynet_mq_pushback(q, msg+i, ext+i, n-i);
+				n = i;
+				break;
+			}
+		}
+	}
+
+	assert(ctx->init); // 断言
+	CHECKCALLING_BEGIN(ctx)
+	handle_tls = ctx->handle;
+	malloc_bind(ctx->mem);
+	uint32_t trace_start = traced ? skynet_trace_enter(first_ext) : 0;
+
+	int i;
+	int m = 0;
+	for (i=0;i<n;i++) {
+		int type = msg[i].sz >> HANDLE_REMOTE_SHIFT;
+		if (ctx->pending && _pending_response(ctx, type, &msg[i])) {
+			// 调用表的检查定时器，不交给服务
+			skynet_message_free(&msg[i], &ext[i]);
+			continue;
+		}
+		if (m != i) {
+			msg[m] = msg[i];
+			ext[m] = ext[i];
+		}
+		++m;
+	}
+	for (i=0;i<m;i++) {
+		item[i].type = msg[i].sz >> HANDLE_REMOTE_SHIFT;
+		item[i].session = msg[i].session;
+		item[i].source = msg[i].source;
+		item[i].msg = (ext[i].flag & MESSAGE_FLAG_INLINE) ? ext[i].buffer : msg[i].data;
+		item[i].sz = msg[i].sz & HANDLE_MASK;
+	}
+	if (m > 0) {
+		malloc_limit(1);
+		int consumed = ctx->batch_cb(ctx, ctx->batch_ud, item, m);
+		malloc_limit(0);
+		if (consumed < 1) {
+			// 违反约定，队列不会前进。不释放任何消息（服务可能还在使用），全部放回队列，
+			// 杀掉服务后由工作线程丢弃队列时释放
+			skynet_error(ctx, "Batch callback consumed %d of %d messages", consumed, m);
+			skynet_mq_pushback(q, msg, ext, m);
+			handle_exit(ctx, 0);
+		} else {
+			if (consumed > m) {
+				consumed = m;
+			}
+			for (i=0;i<consumed;i++) {
+				skynet_message_free(&msg[i], &ext[i]); // 释放数据
+			}
+			if (consumed < m) {
+				skynet_mq_pushback(q, msg+consumed, ext+consumed, m-consumed);
+			}
+		}
+	}
+
+	if (traced) {
+		skynet_trace_leave(ctx->handle, first->sz >> HANDLE_REMOTE_SHIFT, first_ext, trace_start);
+	}
 	handle_tls = 0xffffffff;
+	malloc_bind(NULL);
+	_memory_check(ctx);
 	CHECKCALLING_END(ctx)
 }
 
@@ -270,13 +1167,16 @@ _dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 /// \return int
 int
 skynet_context_message_dispatch(struct skynet_monitor *sm) {
+	_launch_help(); // 帮忙执行批量启动中的 '_init'
+
 	struct message_queue * q = skynet_globalmq_pop(); // 从全局队列中弹出消息队列
 	if (q==NULL) // 如果为空
 		return 1; // 返回 1
 
 	uint32_t handle = skynet_mq_handle(q); // 获得消息队列的句柄
 
-	struct skynet_context * ctx = skynet_handle_grab(handle);
+	// 队列保存了所属的 Context，不必再查询句柄表
+	struct skynet_context * ctx = skynet_mq_grab(q);
 	if (ctx == NULL) {
 		int s = skynet_mq_release(q); // 释放消息队列
 		if (s>0) {
@@ -286,18 +1186,21 @@ skynet_context_message_dispatch(struct skynet_monitor *sm) {
 	}
 
 	struct skynet_message msg;
-	if (skynet_mq_pop(q,&msg)) { // 弹出消息队列
+	struct skynet_message_ext ext;
+	if (skynet_mq_pop(q,&msg,&ext)) { // 弹出消息队列
 		skynet_context_release(ctx); // 释放 Context 结构
 		return 0;
 	}
 
 	skynet_monitor_trigger(sm, msg.source , handle); // 触发监视
 
-	if (ctx->cb == NULL) { // 模块的返回函数为空
-		skynet_free(msg.data); // 释放数据
+	if (ctx->batch_cb) { // 批量处理消息
+		_dispatch_batch(ctx, q, &msg, &ext);
+	} else if (ctx->cb == NULL) { // 模块的返回函数为空
+		skynet_message_free(&msg, &ext); // 释放数据
 		skynet_error(NULL, "Drop message from %x to %x without callback , size = %d",msg.source, handle, (int)msg.sz);
 	} else {
-		_dispatch_message(ctx, &msg); // 调度消息
+		_dispatch_message(ctx, &msg, &ext); // 调度消息
 	}
 
 	assert(q == ctx->queue);
@@ -358,217 +1261,484 @@ handle_exit(struct skynet_context * context, uint32_t handle) {
 	skynet_handle_retire(handle);
 }
 
-/// Skynet 命令
+/// 超时，返回会话编号
 /// \param[in] *context
-/// \param[in] *cmd
-/// \param[in] *param
-/// \return const char *
-const char * 
-skynet_command(struct skynet_context * context, const char * cmd , const char * param) {
-        // 超时
-        if (strcmp(cmd,"TIMEOUT") == 0) {
-		char * session_ptr = NULL;
-		int ti = strtol(param, &session_ptr, 10);
-		int session = skynet_context_newsession(context);
-		skynet_timeout(context->handle, ti, session);
-		sprintf(context->result, "%d", session);
-		return context->result;
+/// \param[in] ti 超时时间，单位是 1/100 秒
+/// \return int 会话编号
+int
+skynet_command_timeout(struct skynet_context * context, int ti) {
+	int session = skynet_context_newsession(context);
+	int limit = malloc_limit(0);
+	skynet_timeout(context->handle, ti, session);
+	malloc_limit(limit);
+	return session;
+}
+
+/// 获得当前时间
+/// \return uint32_t 单位是 1/100 秒
+uint32_t
+skynet_command_now(void) {
+	return skynet_gettime();
+}
+
+/// 获得消息队列的长度
+/// \param[in] *context
+/// \return int
+int
+skynet_command_mqlen(struct skynet_context * context) {
+	return skynet_mq_length(context->queue);
+}
+
+/// 根据名字查找服务
+/// \param[in] *context
+/// \param[in] *name 以 '.' 开头的本地名字
+/// \return uint32_t 没找到返回 0
+uint32_t
+skynet_command_query(struct skynet_context * context, const char * name) {
+	if (name[0] == '.') {
+		return skynet_handle_findname(name+1);
 	}
+	return 0;
+}
 
-        // 锁住服务模块的消息队列
-	if (strcmp(cmd,"LOCK") == 0) {
-		if (context->init == false) {
-			return NULL;
-		}
-		skynet_mq_lock(context->queue, context->session_id+1);
+/// 批量启动服务
+/// \param[in] *context
+/// \param[in] n 服务数
+/// \param[in] *name[] 模块的名称
+/// \param[in] *param[] 传递给模块的参数
+/// \param[out] handle[] 启动成功的句柄，失败为 0
+/// \return int 启动成功的服务数
+int
+skynet_command_launch(struct skynet_context * context, int n, const char * name[], const char * param[], uint32_t handle[]) {
+	int limit = malloc_limit(0);
+	int ret = skynet_context_newbatch(n, name, param, handle);
+	malloc_limit(limit);
+	return ret;
+}
+
+// 超时
+static const char *
+cmd_timeout(struct skynet_context * context, const char * param) {
+	int ti = strtol(param, NULL, 10);
+	int session = skynet_command_timeout(context, ti);
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
+// 锁住服务模块的消息队列
+static const char *
+cmd_lock(struct skynet_context * context, const char * param) {
+	if (context->init == false) {
 		return NULL;
 	}
+	skynet_mq_lock(context->queue, context->session_id+1);
+	return NULL;
+}
 
-	// 解锁服务模块的消息队列
-	if (strcmp(cmd,"UNLOCK") == 0) {
-		if (context->init == false) {
-			return NULL;
-		}
-		skynet_mq_unlock(context->queue);
+// 解锁服务模块的消息队列
+static const char *
+cmd_unlock(struct skynet_context * context, const char * param) {
+	if (context->init == false) {
 		return NULL;
 	}
+	skynet_mq_unlock(context->queue);
+	return NULL;
+}
 
-	// 给服务注册一个名字
-	if (strcmp(cmd,"REG") == 0) {
-		if (param == NULL || param[0] == '\0') {
-			sprintf(context->result, ":%x", context->handle);
-			return context->result;
-		} else if (param[0] == '.') {
-			return skynet_handle_namehandle(context->handle, param + 1);
-		} else {
-			assert(context->handle!=0);
-			struct remote_name *rname = skynet_malloc(sizeof(*rname));
-			_copy_name(rname->name, param);
-			rname->handle = context->handle;
-			skynet_harbor_register(rname);
-			return NULL;
-		}
+// 给服务注册一个名字
+static const char *
+cmd_reg(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		sprintf(context->result, ":%x", context->handle);
+		return context->result;
+	} else if (param[0] == '.') {
+		return skynet_handle_namehandle(context->handle, param + 1);
+	} else {
+		assert(context->handle!=0);
+		struct remote_name *rname = skynet_malloc(sizeof(*rname));
+		_copy_name(rname->name, param);
+		rname->handle = context->handle;
+		skynet_harbor_register(rname);
+		return NULL;
 	}
+}
 
-	// 根据名字查找服务
-	if (strcmp(cmd,"QUERY") == 0) {
-		if (param[0] == '.') {
-			uint32_t handle = skynet_handle_findname(param+1);
-			sprintf(context->result, ":%x", handle);
-			return context->result;
-		}
-		return NULL;
+// 根据名字查找服务
+static const char *
+cmd_query(struct skynet_context * context, const char * param) {
+	if (param[0] == '.') {
+		uint32_t handle = skynet_command_query(context, param);
+		sprintf(context->result, ":%x", handle);
+		return context->result;
 	}
+	return NULL;
+}
 
-	// 获得名字
-	if (strcmp(cmd,"NAME") == 0) {
-		int size = strlen(param);
-		char name[size+1];
-		char handle[size+1];
-		sscanf(param,"%s %s",name,handle);
-		if (handle[0] != ':') {
-			return NULL;
-		}
-		uint32_t handle_id = strtoul(handle+1, NULL, 16);
-		if (handle_id == 0) {
-			return NULL;
-		}
-		if (name[0] == '.') {
-			return skynet_handle_namehandle(handle_id, name + 1);
-		} else {
-			struct remote_name *rname = skynet_malloc(sizeof(*rname));
-			_copy_name(rname->name, name);
-			rname->handle = handle_id;
-			skynet_harbor_register(rname);
-		}
+// 获得名字
+static const char *
+cmd_name(struct skynet_context * context, const char * param) {
+	int size = strlen(param);
+	char name[size+1];
+	char handle[size+1];
+	sscanf(param,"%s %s",name,handle);
+	if (handle[0] != ':') {
+		return NULL;
+	}
+	uint32_t handle_id = strtoul(handle+1, NULL, 16);
+	if (handle_id == 0) {
 		return NULL;
 	}
+	if (name[0] == '.') {
+		return skynet_handle_namehandle(handle_id, name + 1);
+	} else {
+		struct remote_name *rname = skynet_malloc(sizeof(*rname));
+		_copy_name(rname->name, name);
+		rname->handle = handle_id;
+		skynet_harbor_register(rname);
+	}
+	return NULL;
+}
 
-	// 获得当前时间
-	if (strcmp(cmd,"NOW") == 0) {
-		uint32_t ti = skynet_gettime();
-		sprintf(context->result,"%u",ti);
+// 获得当前时间
+static const char *
+cmd_now(struct skynet_context * context, const char * param) {
+	uint32_t ti = skynet_command_now();
+	sprintf(context->result,"%u",ti);
+	return context->result;
+}
+
+// 退出服务
+static const char *
+cmd_exit(struct skynet_context * context, const char * param) {
+	handle_exit(context, 0);
+	return NULL;
+}
+
+// 杀死服务
+static const char *
+cmd_kill(struct skynet_context * context, const char * param) {
+	uint32_t handle = 0;
+	if (param[0] == ':') {
+		handle = strtoul(param+1, NULL, 16);
+	} else if (param[0] == '.') {
+		handle = skynet_handle_findname(param+1);
+	} else {
+		skynet_error(context, "Can't kill %s",param);
+		// todo : kill global service
+	}
+	if (handle) {
+		handle_exit(context, handle);
+	}
+	return NULL;
+}
+
+// 加载服务
+static const char *
+cmd_launch(struct skynet_context * context, const char * param) {
+	size_t sz = strlen(param);
+	char tmp[sz+1];
+	strcpy(tmp,param);
+	char * args = tmp;
+	char * mod = strsep(&args, " \t\r\n");
+	args = strsep(&args, "\r\n");
+	struct skynet_context * inst = skynet_context_new(mod,args);
+	if (inst == NULL) {
+		return NULL;
+	} else {
+		_id_to_hex(context->result, inst->handle);
 		return context->result;
 	}
+}
+
+// 获得 LUA 环境变量
+static const char *
+cmd_getenv(struct skynet_context * context, const char * param) {
+	return skynet_getenv(param);
+}
 
-	// 退出服务
-	if (strcmp(cmd,"EXIT") == 0) {
-		handle_exit(context, 0);
+// 设置 LUA 环境变量
+static const char *
+cmd_setenv(struct skynet_context * context, const char * param) {
+	size_t sz = strlen(param);
+	char key[sz+1];
+	int i;
+	for (i=0;param[i] != ' ' && param[i];i++) {
+		key[i] = param[i];
+	}
+	if (param[i] == '\0')
 		return NULL;
+
+	key[i] = '\0';
+	param += i+1;
+	
+	skynet_setenv(key,param);
+	return NULL;
+}
+
+// 获得启动时间
+static const char *
+cmd_starttime(struct skynet_context * context, const char * param) {
+	uint32_t sec = skynet_gettime_fixsec();
+	sprintf(context->result,"%u",sec);
+	return context->result;
+}
+
+// 获得是否已经释放的标志
+static const char *
+cmd_endless(struct skynet_context * context, const char * param) {
+	if (context->endless) {
+		strcpy(context->result, "1");
+		context->endless = false;
+		return context->result;
 	}
+	return NULL;
+}
 
-	// 杀死服务
-	if (strcmp(cmd,"KILL") == 0) {
-		uint32_t handle = 0;
+// 终端所有服务
+static const char *
+cmd_abort(struct skynet_context * context, const char * param) {
+	skynet_handle_retireall();
+	return NULL;
+}
+
+// 监视
+static const char *
+cmd_monitor(struct skynet_context * context, const char * param) {
+	uint32_t handle=0;
+	if (param == NULL || param[0] == '\0') {
+		if (G_NODE.monitor_exit) {
+			// return current monitor serivce
+			sprintf(context->result, ":%x", G_NODE.monitor_exit);
+			return context->result;
+		}
+		return NULL;
+	} else {
 		if (param[0] == ':') {
 			handle = strtoul(param+1, NULL, 16);
 		} else if (param[0] == '.') {
 			handle = skynet_handle_findname(param+1);
 		} else {
-			skynet_error(context, "Can't kill %s",param);
-			// todo : kill global service
+			skynet_error(context, "Can't monitor %s",param);
+			// todo : monitor global service
 		}
-		if (handle) {
-			handle_exit(context, handle);
-		}
-		return NULL;
 	}
+	G_NODE.monitor_exit = handle;
+	return NULL;
+}
 
-	// 加载服务
-	if (strcmp(cmd,"LAUNCH") == 0) {
-		size_t sz = strlen(param);
-		char tmp[sz+1];
-		strcpy(tmp,param);
-		char * args = tmp;
-		char * mod = strsep(&args, " \t\r\n");
-		args = strsep(&args, "\r\n");
-		struct skynet_context * inst = skynet_context_new(mod,args);
-		if (inst == NULL) {
+// 设置服务的内存上限，参数是 [:handle] soft hard ，单位是字节，0 表示不限制，省略时只查询
+// 越过硬上限后，服务自己代码中的 skynet_malloc 、 skynet_realloc 和复制数据的 skynet_send 失败，
+// 内联的小消息不分配内存，照常发送
+// 返回服务当前分配的内存
+static const char *
+cmd_memlimit(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		sprintf(context->result, "%zd", context->mem->allocated);
+		return context->result;
+	}
+	struct skynet_context * ctx = context;
+	char * next = (char *)param;
+	if (param[0] == ':') {
+		uint32_t handle = strtoul(param+1, &next, 16);
+		ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
 			return NULL;
-		} else {
-			_id_to_hex(context->result, inst->handle);
-			return context->result;
 		}
 	}
-
-	// 获得 LUA 环境变量
-	if (strcmp(cmd,"GETENV") == 0) {
-		return skynet_getenv(param);
+	while (*next == ' ') {
+		++next;
+	}
+	if (*next) {
+		ssize_t soft = strtoll(next, &next, 10);
+		ssize_t hard = strtoll(next, &next, 10);
+		ctx->mem->soft = soft;
+		ctx->mem->hard = hard;
+		ctx->mem->warn = MEMORY_WARN_NONE;
 	}
+	sprintf(context->result, "%zd", ctx->mem->allocated);
+	if (ctx != context) {
+		skynet_context_release(ctx);
+	}
+	return context->result;
+}
 
-	// 设置 LUA 环境变量
-	if (strcmp(cmd,"SETENV") == 0) {
-		size_t sz = strlen(param);
-		char key[sz+1];
-		int i;
-		for (i=0;param[i] != ' ' && param[i];i++) {
-			key[i] = param[i];
-		}
-		if (param[i] == '\0')
+// 让服务使用自己的 jemalloc arena ，参数是 [:handle] [group] ，group 省略或为 0 时独占一个，
+// 同一 group 的服务共用一个；服务退出时 arena 被 purge ，没有存活的块后 destroy 。返回 arena 的编号
+static const char *
+cmd_arena(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		param = "0";
+	}
+	struct skynet_context * ctx = context;
+	char * next = (char *)param;
+	if (param[0] == ':') {
+		uint32_t handle = strtoul(param+1, &next, 16);
+		ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
 			return NULL;
-
-		key[i] = '\0';
-		param += i+1;
-		
-		skynet_setenv(key,param);
+		}
+	}
+	int group = strtol(next, NULL, 10);
+	int arena = malloc_arena(ctx->mem, group);
+	if (ctx != context) {
+		skynet_context_release(ctx);
+	}
+	if (arena < 0) {
 		return NULL;
 	}
+	sprintf(context->result, "%d", arena);
+	return context->result;
+}
 
-	// 获得启动时间
-	if (strcmp(cmd,"STARTTIME") == 0) {
-		uint32_t sec = skynet_gettime_fixsec();
-		sprintf(context->result,"%u",sec);
-		return context->result;
-	}
+// 获得消息队列的长度
+static const char *
+cmd_mqlen(struct skynet_context * context, const char * param) {
+	int len = skynet_command_mqlen(context);
+	sprintf(context->result, "%d", len);
+	return context->result;
+}
 
-	// 获得是否已经释放的标志
-	if (strcmp(cmd,"ENDLESS") == 0) {
-		if (context->endless) {
-			strcpy(context->result, "1");
-			context->endless = false;
-			return context->result;
-		}
+// 直接接收共享缓冲（PTYPE_TAG_SHARED），回调函数不能 skynet_free 这类消息，返回 1 时要用 skynet_shared_release 释放
+static const char *
+cmd_shared(struct skynet_context * context, const char * param) {
+	context->shared_msg = (param == NULL || param[0] != '0');
+	return NULL;
+}
+
+// 等待回应的调用数和最早的调用已经等待的时间
+static const char *
+cmd_pending(struct skynet_context * context, const char * param) {
+	uint32_t oldest = 0;
+	int count = skynet_pending_stat(context, &oldest);
+	sprintf(context->result, "%d %u", count, oldest);
+	return context->result;
+}
+
+// 把跟踪记录写入文件，返回写入的 span 数
+static const char *
+cmd_trace(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
 		return NULL;
 	}
+	int n = skynet_trace_dump(param);
+	sprintf(context->result, "%d", n);
+	return context->result;
+}
 
-	// 终端所有服务
-	if (strcmp(cmd,"ABORT") == 0) {
-		skynet_handle_retireall();
+// 堆分析，参数是数字时设置采样间隔（字节，0 为关闭），否则是 file [:handle] ，
+// 把所有（或这个服务的）存活样本以 pprof 的 heap profile 格式写入文件，返回写入的样本数
+static const char *
+cmd_heapprof(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
 		return NULL;
 	}
-
-	// 监视
-	if (strcmp(cmd,"MONITOR") == 0) {
-		uint32_t handle=0;
-		if (param == NULL || param[0] == '\0') {
-			if (G_NODE.monitor_exit) {
-				// return current monitor serivce
-				sprintf(context->result, ":%x", G_NODE.monitor_exit);
-				return context->result;
-			}
-			return NULL;
-		} else {
-			if (param[0] == ':') {
-				handle = strtoul(param+1, NULL, 16);
-			} else if (param[0] == '.') {
-				handle = skynet_handle_findname(param+1);
-			} else {
-				skynet_error(context, "Can't monitor %s",param);
-				// todo : monitor global service
-			}
-		}
-		G_NODE.monitor_exit = handle;
+	if (param[0] >= '0' && param[0] <= '9') {
+		malloc_profile(strtoul(param, NULL, 10));
 		return NULL;
 	}
+	char filename[256];
+	uint32_t handle = 0;
+	const char * space = strchr(param, ' ');
+	size_t sz = space ? (size_t)(space - param) : strlen(param);
+	if (sz >= sizeof(filename)) {
+		return NULL;
+	}
+	memcpy(filename, param, sz);
+	filename[sz] = '\0';
+	if (space && space[1] == ':') {
+		handle = strtoul(space+2, NULL, 16);
+	}
+	int n = malloc_profile_dump(filename, handle);
+	sprintf(context->result, "%d", n);
+	return context->result;
+}
 
-	// 获得消息队列的长度
-	if (strcmp(cmd, "MQLEN") == 0) {
-		int len = skynet_mq_length(context->queue);
-		sprintf(context->result, "%d", len);
-		return context->result;
+/// 命令和处理函数
+struct command_func {
+	const char *name; ///< 命令名
+	const char * (*func)(struct skynet_context * context, const char * param); ///< 处理函数
+};
+
+static struct command_func cmd_funcs[] = {
+	{ "TIMEOUT", cmd_timeout },
+	{ "LOCK", cmd_lock },
+	{ "UNLOCK", cmd_unlock },
+	{ "REG", cmd_reg },
+	{ "QUERY", cmd_query },
+	{ "NAME", cmd_name },
+	{ "NOW", cmd_now },
+	{ "EXIT", cmd_exit },
+	{ "KILL", cmd_kill },
+	{ "LAUNCH", cmd_launch },
+	{ "GETENV", cmd_getenv },
+	{ "SETENV", cmd_setenv },
+	{ "STARTTIME", cmd_starttime },
+	{ "ENDLESS", cmd_endless },
+	{ "ABORT", cmd_abort },
+	{ "MONITOR", cmd_monitor },
+	{ "MQLEN", cmd_mqlen },
+	{ "SHARED", cmd_shared },
+	{ "PENDING", cmd_pending },
+	{ "TRACE", cmd_trace },
+	{ "MEMLIMIT", cmd_memlimit },
+	{ "ARENA", cmd_arena },
+	{ "HEAPPROF", cmd_heapprof },
+	{ NULL, NULL },
+};
+
+// 命令的完美哈希表，添加命令后如果冲突（_command_init 里的断言），换一个 COMMAND_HASH_SEED
+#define COMMAND_HASH_SIZE 64
+#define COMMAND_HASH_SEED 303
+
+static struct command_func * cmd_slot[COMMAND_HASH_SIZE];
+static int cmd_init = 0;
+
+/// 命令名的哈希值 (FNV-1a)
+/// \param[in] *name
+/// \return static inline int
+static inline int
+_command_hash(const char * name) {
+	uint32_t h = 2166136261u ^ COMMAND_HASH_SEED;
+	for (;*name;name++) {
+		h = (h ^ (uint8_t)*name) * 16777619u;
 	}
+	return (h ^ (h >> 16)) & (COMMAND_HASH_SIZE-1);
+}
 
-	return NULL;
+/// 建立命令的哈希表
+///
+/// 每个命令有固定的槽，多个线程同时初始化只会写入相同的值。
+/// \return static void
+static void
+_command_init() {
+	struct command_func * f;
+	for (f=cmd_funcs;f->name;f++) {
+		int h = _command_hash(f->name);
+		assert(cmd_slot[h] == NULL || cmd_slot[h] == f);
+		cmd_slot[h] = f;
+	}
+	__sync_synchronize();
+	cmd_init = 1;
+}
+
+/// Skynet 命令
+/// \param[in] *context
+/// \param[in] *cmd
+/// \param[in] *param
+/// \return const char *
+const char * 
+skynet_command(struct skynet_context * context, const char * cmd , const char * param) {
+	if (!cmd_init) {
+		_command_init();
+	}
+	struct command_func * f = cmd_slot[_command_hash(cmd)];
+	if (f == NULL || strcmp(f->name, cmd) != 0) {
+		return NULL;
+	}
+	int limit = malloc_limit(0); // 框架内部的分配不受硬上限限制
+	const char * ret = f->func(context, param);
+	malloc_limit(limit);
+	return ret;
 }
 
 ///
@@ -577,10 +1747,10 @@ skynet_command(struct skynet_context * context, const char * cmd , const char *
 /// \param[in] *session
 /// \param[in] **data
 /// \param[in] *sz
-/// \return static void
-static void
+/// \return static int 复制数据时越过内存硬上限返回 -1
+static int
 _filter_args(struct skynet_context * context, int type, int *session, void ** data, size_t * sz) {
-	int needcopy = !(type & PTYPE_TAG_DONTCOPY);
+	int needcopy = !(type & (PTYPE_TAG_DONTCOPY | PTYPE_TAG_SHARED));
 	int allocsession = type & PTYPE_TAG_ALLOCSESSION;
 	type &= 0xff;
 
@@ -591,6 +1761,9 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 
 	if (needcopy && *data) {
 		char * msg = skynet_malloc(*sz+1);
+		if (msg == NULL) {
+			return -1;
+		}
 		memcpy(msg, *data, *sz);
 		msg[*sz] = '\0';
 		*data = msg;
@@ -598,29 +1771,151 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 
 	assert((*sz & HANDLE_MASK) == *sz);
 	*sz |= type << HANDLE_REMOTE_SHIFT;
+	return 0;
 }
 
-/// 发送消息给服务
+/// 共享缓冲的头部，放在数据之前
+struct shared_buffer {
+	int ref; ///< 引用计数
+	size_t sz; ///< 数据的长度
+};
+
+/// 分配一块引用计数的共享缓冲，初始引用为 1
+///
+/// 缓冲内容在发送后不能再修改。用 PTYPE_TAG_SHARED 发送时，一个引用随消息转移给接收方，
+/// 调度结束后由框架调用 skynet_shared_release ；发给多个服务或转发时，每次发送前先 skynet_shared_grab 。
+/// 只有设置了 SHARED 的接收方直接收到缓冲，其他接收方收到复制的数据，这个引用在发送时就释放。
+/// \param[in] sz 数据的长度
+/// \return void * 数据的指针，越过内存硬上限时为 NULL
+void *
+skynet_shared_new(size_t sz) {
+	struct shared_buffer * sb = skynet_malloc(sizeof(*sb) + sz + 1);
+	if (sb == NULL) {
+		return NULL;
+	}
+	sb->ref = 1;
+	sb->sz = sz;
+	char * data = (char *)(sb+1);
+	data[sz] = '\0'; // 和复制的消息一样以 '\0' 结尾
+	return data;
+}
+
+/// 增加共享缓冲的引用
+/// \param[in] *data
+/// \return void *
+void *
+skynet_shared_grab(void * data) {
+	struct shared_buffer * sb = (struct shared_buffer *)data - 1;
+	__sync_add_and_fetch(&sb->ref, 1);
+	return data;
+}
+
+/// 减少共享缓冲的引用，为 0 时释放
+/// \param[in] *data
+/// \return void
+void
+skynet_shared_release(void * data) {
+	if (data == NULL)
+		return;
+	struct shared_buffer * sb = (struct shared_buffer *)data - 1;
+	if (__sync_sub_and_fetch(&sb->ref, 1) == 0) {
+		skynet_free(sb);
+	}
+}
+
+/// 把共享缓冲换成普通的数据，harbor 服务发送后会直接 skynet_free 消息
+/// \param[in] *data
+/// \param[in] sz
+/// \return static void *
+static void *
+_unshare(void * data, size_t sz) {
+	if (data == NULL)
+		return NULL;
+	char * msg = skynet_malloc(sz+1);
+	memcpy(msg, data, sz);
+	msg[sz] = '\0';
+	skynet_shared_release(data);
+	return msg;
+}
+
+/// 压入一条还没有复制数据的小消息
+///
+/// 数据直接存放在队列的附加部分中，省掉发送方的 skynet_malloc 和接收方的 skynet_free ，
+/// 调度时再复制到接收方的缓冲中。
+/// \param[in] handle 句柄
+/// \param[in] *message 消息结构，data 指向发送方的数据
+/// \param[in] *ext 附加部分，可能带有跟踪信息
+/// \return int
+static int
+_push_inline(uint32_t handle, struct skynet_message *message, struct skynet_message_ext *ext) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	const void * data = message->data;
+	size_t sz = message->sz & HANDLE_MASK;
+	assert(sz < MESSAGE_INLINE_SIZE);
+	memcpy(ext->buffer, data, sz);
+	ext->buffer[sz] = '\0';
+	ext->flag |= MESSAGE_FLAG_INLINE;
+	message->data = NULL;
+	skynet_mq_push_ext(ctx->queue, message, ext); // 压入消息队列
+	skynet_context_release(ctx); // 释放 Context 结构
+
+	return 0;
+}
+
+/// 压入一条共享缓冲的消息
+///
+/// 接收方没有设置 SHARED 时换成复制的数据，普通的回调函数可以照常 skynet_free 或保留它。
+/// \param[in] handle 句柄
+/// \param[in] *message 消息结构，data 是共享缓冲，失败时仍持有它的引用
+/// \param[in] *ext 附加部分，可能带有跟踪信息
+/// \return int
+static int
+_push_shared(uint32_t handle, struct skynet_message *message, struct skynet_message_ext *ext) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (ctx->shared_msg) {
+		ext->flag |= MESSAGE_FLAG_SHARED;
+	} else {
+		message->data = _unshare(message->data, message->sz & HANDLE_MASK);
+	}
+	skynet_mq_push_ext(ctx->queue, message, ext); // 压入消息队列
+	skynet_context_release(ctx); // 释放 Context 结构
+
+	return 0;
+}
+
+/// 发送已经复制过数据的消息
 /// \param[in] *context
 /// \param[in] source
 /// \param[in] destination
 /// \param[in] type
 /// \param[in] session
 /// \param[in] *data
-/// \param[in] sz
-/// \return int
-int
-skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz) {
-	_filter_args(context, type, &session, (void **)&data, &sz);
-
+/// \param[in] sz 带有类型
+/// \param[in] tryinline 数据还没有复制，压入队列时内联存放
+/// \return static int
+static int
+_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz, int tryinline) {
+	int shared = type & PTYPE_TAG_SHARED;
 	if (source == 0) {
 		source = context->handle;
 	}
 
 	if (destination == 0) {
+		if (shared) {
+			skynet_shared_release(data);
+		}
 		return session;
 	}
 	if (skynet_harbor_message_isremote(destination)) {
+		if (shared) {
+			data = _unshare(data, sz & HANDLE_MASK);
+		}
 		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
 		rmsg->destination.handle = destination;
 		rmsg->message = data;
@@ -632,9 +1927,23 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.session = session;
 		smsg.data = data;
 		smsg.sz = sz;
-
-		if (skynet_context_push(destination, &smsg)) {
-			skynet_free(data);
+		struct skynet_message_ext ext;
+		ext.flag = 0;
+		skynet_trace_inherit(&ext); // 调度被跟踪的消息时发出的消息继承跟踪
+
+		if (tryinline) {
+			if (_push_inline(destination, &smsg, &ext)) {
+				skynet_error(NULL, "Drop message from %x to %x (type=%d)(size=%d)", source, destination, type&0xff, (int)(sz & HANDLE_MASK));
+				return -1;
+			}
+		} else if (shared) {
+			if (_push_shared(destination, &smsg, &ext)) {
+				skynet_shared_release(data);
+				skynet_error(NULL, "Drop message from %x to %x (type=%d)(size=%d)", source, destination, type&0xff, (int)(sz & HANDLE_MASK));
+				return -1;
+			}
+		} else if (skynet_context_push_ext(destination, &smsg, &ext)) {
+			skynet_message_free(&smsg, &ext);
 			skynet_error(NULL, "Drop message from %x to %x (type=%d)(size=%d)", source, destination, type&0xff, (int)(sz & HANDLE_MASK));
 			return -1;
 		}
@@ -642,6 +1951,83 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 	return session;
 }
 
+/// 发送消息给服务
+/// \param[in] *context
+/// \param[in] source
+/// \param[in] destination
+/// \param[in] type
+/// \param[in] session
+/// \param[in] *data
+/// \param[in] sz
+/// \return int 复制数据时越过内存硬上限返回 -1
+int
+skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz) {
+	// 发给本地服务的小消息不复制，压入队列时内联存放
+	int tryinline = !(type & (PTYPE_TAG_DONTCOPY | PTYPE_TAG_SHARED))
+		&& data && sz < MESSAGE_INLINE_SIZE
+		&& destination != 0 && !skynet_harbor_message_isremote(destination);
+	if (tryinline) {
+		type |= PTYPE_TAG_DONTCOPY;
+	}
+	if (_filter_args(context, type, &session, (void **)&data, &sz)) {
+		return -1;
+	}
+	int limit = malloc_limit(0); // 只有复制数据受硬上限限制，队列等框架内部的分配不能失败
+	int ret = _send(context, source, destination, type, session, data, sz, tryinline);
+	malloc_limit(limit);
+	return ret;
+}
+
+#define NAME_CACHE_SIZE 16 ///< 名字缓存的项数，必须是 2 的幂
+#define NAME_CACHE_LENGTH 32 ///< 能缓存的名字的最大长度（含结尾的 0）
+
+/// 名字缓存的一项
+struct name_entry {
+	uint32_t generation; ///< 解析时名字表的版本
+	uint32_t handle; ///< 句柄，0 表示空项
+	char name[NAME_CACHE_LENGTH]; ///< 名字
+};
+
+/// 名字解析缓存，只在服务自己处理消息时访问，不用加锁
+struct name_cache {
+	struct name_entry e[NAME_CACHE_SIZE];
+};
+
+/// 解析本地名字，名字表的版本没变时直接用缓存的结果，不必加锁查找
+/// \param[in] *ctx
+/// \param[in] *name 去掉 '.' 的名字
+/// \return static uint32_t 没找到返回 0
+static uint32_t
+_resolve_name(struct skynet_context * ctx, const char * name) {
+	size_t sz = strlen(name);
+	if (sz >= NAME_CACHE_LENGTH) {
+		return skynet_handle_findname(name);
+	}
+	// 先取版本再查找，查找后名字表有变化时版本也会变，缓存项自然失效
+	uint32_t generation = skynet_handle_generation();
+	struct name_cache * c = ctx->names;
+	if (c == NULL) {
+		c = ctx->names = skynet_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+	}
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	}
+	struct name_entry * e = &c->e[h & (NAME_CACHE_SIZE-1)];
+	if (e->handle && e->generation == generation && memcmp(e->name, name, sz+1) == 0) {
+		return e->handle;
+	}
+	uint32_t handle = skynet_handle_findname(name);
+	if (handle) {
+		e->generation = generation;
+		e->handle = handle;
+		memcpy(e->name, name, sz+1);
+	}
+	return handle;
+}
+
 /// 根据名称发生消息给服务
 /// \param[in] *context
 /// \param[in] *addr
@@ -657,16 +2043,26 @@ skynet_sendname(struct skynet_context * context, const char * addr , int type, i
 	if (addr[0] == ':') {
 		des = strtoul(addr+1, NULL, 16);
 	} else if (addr[0] == '.') {
-		des = skynet_handle_findname(addr + 1);
+		int limit = malloc_limit(0);
+		des = _resolve_name(context, addr + 1);
+		malloc_limit(limit);
 		if (des == 0) {
 			if (type & PTYPE_TAG_DONTCOPY) {
   			skynet_free(data);
-  		}
+  		} else if (type & PTYPE_TAG_SHARED) {
+				skynet_shared_release(data);
+			}
 			skynet_error(context, "Drop message to %s", addr);
 			return session;
 		}
 	} else {
-		_filter_args(context, type, &session, (void **)&data, &sz);
+		if (_filter_args(context, type, &session, (void **)&data, &sz)) {
+			return -1;
+		}
+		int limit = malloc_limit(0);
+		if (type & PTYPE_TAG_SHARED) {
+			data = _unshare(data, sz & HANDLE_MASK);
+		}
 
 		struct remote_message * rmsg = skynet_malloc(sizeof(*rmsg));
 		_copy_name(rmsg->destination.name, addr);
@@ -675,6 +2071,7 @@ skynet_sendname(struct skynet_context * context, const char * addr , int type, i
 		rmsg->sz = sz;
 
 		skynet_harbor_send(rmsg, source, session);
+		malloc_limit(limit);
 		return session;
 	}
 
@@ -709,6 +2106,17 @@ skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb) {
 	context->cb_ud = ud;
 }
 
+/// 设置服务模块批量处理消息的返回函数，设置后代替 skynet_callback 设置的函数，设为 NULL 恢复
+/// \param[in] *context
+/// \param[in] *ud
+/// \param[in] cb
+/// \return void
+void
+skynet_callback_batch(struct skynet_context * context, void *ud, skynet_batch_cb cb) {
+	context->batch_cb = cb;
+	context->batch_ud = ud;
+}
+
 ///
 /// \param[in] *ctx
 /// \param[in] *msg
@@ -6,14 +6,22 @@
 
 struct skynet_context;
 struct skynet_message;
+struct skynet_message_ext;
 struct skynet_monitor;
+struct message_queue;
 
 struct skynet_context * skynet_context_new(const char * name, const char * parm);
+int skynet_context_newbatch(int n, const char * name[], const char * param[], uint32_t handle[]);	// return the number of services launched
+void skynet_context_setwakeup(void (*wakeup)(void *ud), void *ud);	// wake sleeping workers to help a bulk launch
 void skynet_context_grab(struct skynet_context *);
+int skynet_context_trygrab(struct skynet_context *);	// return 0 when the context is releasing
+void skynet_context_retire(struct skynet_context *);
+void skynet_context_slab_free(struct message_queue *);	// release the queue part of a context slab block
 struct skynet_context * skynet_context_release(struct skynet_context *);
 uint32_t skynet_context_handle(struct skynet_context *);
 void skynet_context_init(struct skynet_context *, uint32_t handle);
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
+int skynet_context_push_ext(uint32_t handle, struct skynet_message *message, struct skynet_message_ext *ext);	// ext can be NULL
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 int skynet_context_newsession(struct skynet_context *);
 int skynet_context_message_dispatch(struct skynet_monitor *);	// return 1 when block
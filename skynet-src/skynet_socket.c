@@ -9,6 +9,8 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "skynet_trace.h"
+#include "malloc_hook.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -18,10 +20,33 @@
 static struct socket_server * SOCKET_SERVER = NULL; ///< 全局变量
 
 /// 初始化 Socket
+/// \param[in] thread 网络线程数，每个线程 poll 一个分片
+/// \param[in] reuseport 监听时是否每个分片各开一个 SO_REUSEPORT 的 fd
+/// \param[in] edge 是否使用边沿触发
+/// \param[in] uring 是否使用 io_uring ，同时开启边沿触发，不可用时保持 epoll
+/// \return int 分片数，向上取 2 的幂
+int 
+skynet_socket_init(int thread, int reuseport, int edge, int uring) {
+	// 读缓冲交给服务用 skynet_free 释放，服务用 skynet_malloc 分配发送的缓冲
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	SOCKET_SERVER = socket_server_create(thread, reuseport); // 创建 Socket Server
+	if (SOCKET_SERVER == NULL) {
+		return 0;
+	}
+	socket_server_edge(SOCKET_SERVER, edge);
+	socket_server_uring(SOCKET_SERVER, uring);
+	return socket_server_nshard(SOCKET_SERVER);
+}
+
+/// 开启域名解析线程池
+///
+/// 连接域名时在线程池中解析，不阻塞网络线程；数值地址不经过线程池。
+/// \param[in] thread 解析线程数，0 为在网络线程中解析
+/// \param[in] ttl 解析结果缓存的秒数，0 为不缓存
 /// \return void
-void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create(); // 创建 Socket Server
+void
+skynet_socket_resolver(int thread, int ttl) {
+	socket_server_resolver(SOCKET_SERVER, thread, ttl);
 }
 
 /// 退出 Socket
@@ -73,9 +98,14 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.session = 0; // 会话为 0
 	message.data = sm; // 数据为 Socket 消息
 	message.sz = sz | PTYPE_SOCKET << HANDLE_REMOTE_SHIFT; // 数据的长度
+	struct skynet_message_ext ext;
+	ext.flag = 0;
+	if (type == SKYNET_SOCKET_TYPE_DATA) {
+		skynet_trace_sample(&ext); // 网络数据是入口，在这里决定是否采样
+	}
 	
-	// 将 Skynet 消息压入消息队列
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	// 将 Skynet 消息压入消息队列，被采样的消息带有附加部分
+	if (skynet_context_push_ext((uint32_t)result->opaque, &message, &ext)) {
 		// todo: report somewhere to close socket，报告某处关闭了 Socket
 	        // 这里不要调用 skynet_socket_close （它将阻塞主循环）
 		// don't call skynet_socket_close here (It will block mainloop)
@@ -84,11 +114,12 @@ forward_message(int type, bool padding, struct socket_message * result) {
 }
 
 /// 检查 Socket
+/// \param[in] shard 分片编号，每个网络线程一个
 /// \return int
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER; // 设为全局变量
-	assert(ss); // 断言
+skynet_socket_poll(int shard) {
+	assert(SOCKET_SERVER); // 断言
+	struct socket_server *ss = socket_server_shard(SOCKET_SERVER, shard);
 	struct socket_message result; // Socket 消息
 	int more = 1;
 	int type = socket_server_poll(ss, &result, &more); // 查看 Socket 消息
@@ -128,7 +159,9 @@ skynet_socket_poll() {
 /// \return int
 int
 skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
+	int limit = malloc_limit(0); // 请求队列的分配不受服务的内存硬上限限制
 	int64_t wsz = socket_server_send(SOCKET_SERVER, id, buffer, sz); // 发送数据
+	malloc_limit(limit);
 	if (wsz < 0) {
 		skynet_free(buffer);
 		return -1;
@@ -149,7 +182,9 @@ skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
 /// \return void
 void
 skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz) {
+	int limit = malloc_limit(0);
 	socket_server_send_lowpriority(SOCKET_SERVER, id, buffer, sz);
+	malloc_limit(limit);
 }
 
 /// 监听 Socket
@@ -161,7 +196,10 @@ skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer,
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	int limit = malloc_limit(0);
+	int ret = socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	malloc_limit(limit);
+	return ret;
 }
 
 /// Socket 连接
@@ -172,7 +210,10 @@ skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	int limit = malloc_limit(0);
+	int ret = socket_server_connect(SOCKET_SERVER, source, host, port);
+	malloc_limit(limit);
+	return ret;
 }
 
 /// 阻塞式 Socket 连接
@@ -183,7 +224,10 @@ skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 int 
 skynet_socket_block_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_block_connect(SOCKET_SERVER, source, host, port);
+	int limit = malloc_limit(0);
+	int ret = socket_server_block_connect(SOCKET_SERVER, source, host, port);
+	malloc_limit(limit);
+	return ret;
 }
 
 /// 绑定事件
@@ -193,7 +237,10 @@ skynet_socket_block_connect(struct skynet_context *ctx, const char *host, int po
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	int limit = malloc_limit(0);
+	int ret = socket_server_bind(SOCKET_SERVER, source, fd);
+	malloc_limit(limit);
+	return ret;
 }
 
 /// 关闭 Socket
@@ -203,7 +250,23 @@ skynet_socket_bind(struct skynet_context *ctx, int fd) {
 void 
 skynet_socket_close(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
+	int limit = malloc_limit(0);
 	socket_server_close(SOCKET_SERVER, source, id);
+	malloc_limit(limit);
+}
+
+/// 合并发送小包
+///
+/// 开启后 Socket 线程把一轮中发往这个 Socket 的小包拷在一起，在下次等待事件前一次写出。
+/// \param[in] *ctx
+/// \param[in] id
+/// \param[in] enable
+/// \return void
+void
+skynet_socket_coalesce(struct skynet_context *ctx, int id, int enable) {
+	int limit = malloc_limit(0);
+	socket_server_coalesce(SOCKET_SERVER, id, enable);
+	malloc_limit(limit);
 }
 
 /// 启动 Socket
@@ -213,5 +276,23 @@ skynet_socket_close(struct skynet_context *ctx, int id) {
 void 
 skynet_socket_start(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
+	int limit = malloc_limit(0);
 	socket_server_start(SOCKET_SERVER, source, id);
+	malloc_limit(limit);
+}
+
+/// 启动 Socket 并按长度头分包
+///
+/// Socket 线程按大端的 2 或 4 字节长度头分包，每个完整的包是一个 SKYNET_SOCKET_TYPE_DATA 消息。
+/// \param[in] *ctx
+/// \param[in] id
+/// \param[in] header 长度头的字节数，2 或 4
+/// \param[in] max 一个包最大的长度，超过时关闭连接，0 为默认的 16M
+/// \return void
+void
+skynet_socket_start_frame(struct skynet_context *ctx, int id, int header, int max) {
+	uint32_t source = skynet_context_handle(ctx);
+	int limit = malloc_limit(0);
+	socket_server_start_frame(SOCKET_SERVER, source, id, header, max);
+	malloc_limit(limit);
 }
@@ -16,10 +16,11 @@ struct skynet_socket_message {
 	char * buffer; // 缓冲区
 };
 
-void skynet_socket_init(); // 初始化 Socket
+int skynet_socket_init(int thread, int reuseport, int edge, int uring); // 初始化 Socket ，返回分片数
+void skynet_socket_resolver(int thread, int ttl); // 开启域名解析线程池
 void skynet_socket_exit(); // 退出 Socket
 void skynet_socket_free(); // 释放 Socket
-int skynet_socket_poll();  // 查看 Socket 消息
+int skynet_socket_poll(int shard);  // 查看 Socket 消息
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz); // 发送数据
 void skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz); // 低优先级发送数据
@@ -28,6 +29,8 @@ int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port
 int skynet_socket_block_connect(struct skynet_context *ctx, const char *host, int port); // 阻塞式 Socket 连接
 int skynet_socket_bind(struct skynet_context *ctx, int fd); // 绑定事件
 void skynet_socket_close(struct skynet_context *ctx, int id); // 关闭 Socket
+void skynet_socket_coalesce(struct skynet_context *ctx, int id, int enable); // 合并发送小包
+void skynet_socket_start_frame(struct skynet_context *ctx, int id, int header, int max); // 启动 Socket 并按长度头分包
 void skynet_socket_start(struct skynet_context *ctx, int id); // 启动 Socket
 
 #endif
@@ -12,6 +12,8 @@
 #include "skynet_harbor.h"
 #include "skynet_monitor.h"
 #include "skynet_socket.h"
+#include "skynet_trace.h"
+#include "malloc_hook.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -67,14 +69,24 @@ wakeup(struct monitor *m, int busy) {
 	}
 }
 
+/// 唤醒所有睡眠的工作线程，批量启动服务时让它们帮忙执行 '_init'
+/// \param[in] *ud 监视结构
+/// \return static void
+static void
+wakeup_all(void *ud) {
+	struct monitor *m = ud;
+	pthread_cond_broadcast(&m->cond);
+}
+
 /// Socket 线程
 /// \param[in] *p
 /// \return static void
 static void *
 _socket(void *p) {
-	struct monitor * m = p;
+	struct worker_parm *sp = p;
+	struct monitor * m = sp->m;
 	for (;;) {
-		int r = skynet_socket_poll(); // 查看 Socket 消息
+		int r = skynet_socket_poll(sp->id); // 查看本线程分片的 Socket 消息
 		if (r==0)
 			break;
 		if (r<0) {
@@ -173,10 +185,11 @@ _worker(void *p) {
 
 /// 启动线程
 /// \param[in] thread 线程数
+/// \param[in] socket_thread 网络线程数
 /// \return static void
 static void
-_start(int thread) {
-	pthread_t pid[thread+3]; // 线程编号的数组
+_start(int thread, int socket_thread) {
+	pthread_t pid[thread+socket_thread+2]; // 线程编号的数组
 
 	struct monitor *m = skynet_malloc(sizeof(*m)); // 分配 监视 结构的内存
 	memset(m, 0, sizeof(*m)); // 清空结构
@@ -197,21 +210,30 @@ _start(int thread) {
 		exit(1);
 	}
 
+	skynet_context_setwakeup(wakeup_all, m); // 批量启动服务时唤醒工作线程
+
 	create_thread(&pid[0], _monitor, m);    // 创建 监视 线程
 	create_thread(&pid[1], _timer, m);      // 创建 定时器 线程
-	create_thread(&pid[2], _socket, m);     // 创建 网络 线程
+
+	struct worker_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].id = i;
+		create_thread(&pid[i+2], _socket, &sp[i]); // 每个分片创建一个网络线程
+	}
 
 	struct worker_parm wp[thread];
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
-		create_thread(&pid[i+3], _worker, &wp[i]); // 创建多个工作线程
+		create_thread(&pid[i+socket_thread+2], _worker, &wp[i]); // 创建多个工作线程
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+socket_thread+2;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
+	skynet_context_setwakeup(NULL, NULL);
 	free_monitor(m); // 释放 监视
 }
 
@@ -234,12 +256,21 @@ _start_master(const char * master) {
 /// \return void
 void 
 skynet_start(struct skynet_config * config) {
+	if (config->malloc) {
+		malloc_set_backend(config->malloc); // 选择内存分配的后端
+	}
 	skynet_harbor_init(config->harbor); // 初始化节点
 	skynet_handle_init(config->harbor); // 初始化句柄
 	skynet_mq_init(); // 初始化消息队列
 	skynet_module_init(config->module_path); // 初始化模块
 	skynet_timer_init(); // 初始化定时器
-	skynet_socket_init(); // 初始化网络
+	int socket_thread = skynet_socket_init(config->socket_thread, config->socket_reuseport, config->socket_edge, config->socket_uring); // 初始化网络
+	if (socket_thread == 0) {
+		fprintf(stderr, "Init fail : socket");
+		exit(1);
+	}
+	skynet_socket_resolver(config->dns_thread, config->dns_ttl); // 域名解析线程池
+	skynet_trace_init(config->trace_sample); // 初始化跟踪
 
 	struct skynet_context *ctx;
 	ctx = skynet_context_new("logger", config->logger); // 加载日志服务
@@ -269,7 +300,7 @@ skynet_start(struct skynet_config * config) {
 		ctx = skynet_context_new("snlua", config->start); // 启动第一个 LUA服务
 	}
 
-	_start(config->thread); // 开始
+	_start(config->thread, socket_thread); // 开始
 	skynet_socket_free(); // 释放网络
 }
 
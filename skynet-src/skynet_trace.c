@@ -0,0 +1,191 @@
+///
+/// \file skynet_trace.c
+/// \brief 消息跟踪
+///
+/// 被采样的消息带有跟踪编号和父 span 。调度被跟踪的消息时，
+/// 服务发出的消息自动继承跟踪编号，父 span 为当前的 span 。
+/// 每次调度记录一个 span 到无锁的环形缓冲中，可以写入文件离线分析。
+///
+#include "skynet.h"
+
+#include "skynet_trace.h"
+#include "skynet_mq.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__APPLE__) // 苹果平台
+#include <sys/time.h>
+#endif
+
+#define TRACE_RING_SIZE 0x10000 ///< 环形缓冲的大小 (64K 个 span)
+
+/// 一次调度的记录
+struct trace_span {
+	uint32_t seq; ///< 写入的序号 +1，0 表示正在写入或为空
+	uint32_t trace; ///< 跟踪编号
+	uint32_t span; ///< span 编号
+	uint32_t parent; ///< 父 span 编号，0 表示入口
+	uint32_t handle; ///< 服务的句柄
+	int type; ///< 消息的类型
+	uint32_t wait; ///< 在消息队列中等待的时间（微秒）
+	uint32_t cost; ///< 回调函数的执行时间（微秒）
+};
+
+/// 跟踪的全局结构
+struct trace_ring {
+	int sample; ///< 采样间隔
+	uint32_t count; ///< 入口消息计数
+	uint32_t trace_id; ///< 最后分配的跟踪编号
+	uint32_t span_id; ///< 最后分配的 span 编号
+	uint32_t head; ///< 下一个写入的位置
+	struct trace_span span[TRACE_RING_SIZE];
+};
+
+static struct trace_ring * T = NULL; ///< 未开启时为空
+
+static __thread uint32_t trace_tls = 0; ///< 当前调度的跟踪编号
+static __thread uint32_t span_tls = 0; ///< 当前调度的 span 编号
+
+/// 获得时间，单位是微秒，只用来计算时间差
+/// \return static uint32_t
+static uint32_t
+_gettime_us(void) {
+#if !defined(__APPLE__) // 非苹果平台
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint32_t)ti.tv_sec * 1000000 + ti.tv_nsec / 1000;
+#else // 苹果平台
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint32_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/// 初始化跟踪
+/// \param[in] sample
+/// \return void
+void
+skynet_trace_init(int sample) {
+	if (sample <= 0) {
+		return;
+	}
+	struct trace_ring * t = skynet_malloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	t->sample = sample;
+	T = t;
+}
+
+/// 入口消息采样
+/// \param[in,out] *ext 消息的附加部分
+/// \return void
+void
+skynet_trace_sample(struct skynet_message_ext *ext) {
+	struct trace_ring * t = T;
+	if (t == NULL) {
+		return;
+	}
+	if (__sync_fetch_and_add(&t->count, 1) % t->sample != 0) {
+		return;
+	}
+	uint32_t id = __sync_add_and_fetch(&t->trace_id, 1);
+	if (id == 0) {
+		id = __sync_add_and_fetch(&t->trace_id, 1);
+	}
+	ext->flag |= MESSAGE_FLAG_TRACE;
+	ext->trace = id;
+	ext->span = 0;
+	ext->time = _gettime_us();
+}
+
+/// 发送消息时继承当前调度的跟踪
+/// \param[in,out] *ext 消息的附加部分
+/// \return void
+void
+skynet_trace_inherit(struct skynet_message_ext *ext) {
+	if (trace_tls) {
+		ext->flag |= MESSAGE_FLAG_TRACE;
+		ext->trace = trace_tls;
+		ext->span = span_tls;
+		ext->time = _gettime_us();
+	}
+}
+
+/// 开始调度被跟踪的消息
+/// \param[in] *ext 消息的附加部分
+/// \return uint32_t 开始的时间
+uint32_t
+skynet_trace_enter(struct skynet_message_ext *ext) {
+	trace_tls = ext->trace;
+	span_tls = T ? __sync_add_and_fetch(&T->span_id, 1) : 0;
+	return _gettime_us();
+}
+
+/// 调度结束，记录 span
+/// \param[in] handle
+/// \param[in] type
+/// \param[in] *ext 消息的附加部分
+/// \param[in] start
+/// \return void
+void
+skynet_trace_leave(uint32_t handle, int type, struct skynet_message_ext *ext, uint32_t start) {
+	struct trace_ring * t = T;
+	uint32_t span = span_tls;
+	trace_tls = 0;
+	span_tls = 0;
+	if (t == NULL) {
+		return;
+	}
+	uint32_t now = _gettime_us();
+	uint32_t idx = __sync_fetch_and_add(&t->head, 1);
+	struct trace_span * s = &t->span[idx % TRACE_RING_SIZE];
+	s->seq = 0;
+	__sync_synchronize();
+	s->trace = ext->trace;
+	s->span = span;
+	s->parent = ext->span;
+	s->handle = handle;
+	s->type = type;
+	s->wait = start - ext->time;
+	s->cost = now - start;
+	__sync_synchronize();
+	s->seq = idx + 1;
+}
+
+/// 把环形缓冲中的 span 写入文件
+///
+/// 每行一个 span : trace span parent handle type wait(us) cost(us)
+/// 正在写入的 span 会被跳过。
+/// \param[in] *filename
+/// \return int
+int
+skynet_trace_dump(const char *filename) {
+	struct trace_ring * t = T;
+	if (t == NULL) {
+		return 0;
+	}
+	FILE * f = fopen(filename, "a");
+	if (f == NULL) {
+		return -1;
+	}
+	int n = 0;
+	int i;
+	for (i=0;i<TRACE_RING_SIZE;i++) {
+		struct trace_span * s = &t->span[i];
+		uint32_t seq = s->seq;
+		if (seq == 0) {
+			continue;
+		}
+		__sync_synchronize();
+		struct trace_span tmp = *s;
+		__sync_synchronize();
+		if (s->seq != seq) {
+			continue;
+		}
+		fprintf(f, "%08x %u %u :%08x %d %u %u\n", tmp.trace, tmp.span, tmp.parent, tmp.handle, tmp.type, tmp.wait, tmp.cost);
+		++n;
+	}
+	fclose(f);
+	return n;
+}
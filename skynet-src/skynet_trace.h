@@ -0,0 +1,16 @@
+#ifndef SKYNET_TRACE_H
+#define SKYNET_TRACE_H
+
+#include <stdint.h>
+
+struct skynet_message_ext;
+
+// 跟踪信息在消息的附加部分中，被跟踪时设置 MESSAGE_FLAG_TRACE
+void skynet_trace_init(int sample); // 初始化跟踪，每 sample 个入口消息采样一个，0 为关闭
+void skynet_trace_sample(struct skynet_message_ext *ext); // 入口消息：决定是否开始一个新的跟踪
+void skynet_trace_inherit(struct skynet_message_ext *ext); // 发送消息：继承当前调度的跟踪
+uint32_t skynet_trace_enter(struct skynet_message_ext *ext); // 开始调度一条被跟踪的消息，返回开始的时间
+void skynet_trace_leave(uint32_t handle, int type, struct skynet_message_ext *ext, uint32_t start); // 调度结束，记录 span
+int skynet_trace_dump(const char *filename); // 把记录的 span 写入文件，返回 span 数，失败返回 -1
+
+#endif
@@ -36,6 +36,18 @@ sp_add(int efd, int sock, void *ud) {
 	return 0;
 }
 
+static int 
+sp_add_et(int efd, int sock, void *ud) {
+	struct epoll_event ev;
+	// EPOLLRDHUP marks the edge that carries FIN together with data
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ud;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		return 1;
+	}
+	return 0;
+}
+
 static void 
 sp_del(int efd, int sock) {
 	epoll_ctl(efd, EPOLL_CTL_DEL, sock , NULL);
@@ -50,15 +62,17 @@ sp_write(int efd, int sock, void *ud, bool enable) {
 }
 
 static int 
-sp_wait(int efd, struct event *e, int max) {
+sp_wait(int efd, struct event *e, int max, int timeout) {
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);
+	int n = epoll_wait(efd , ev, max, timeout);
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].s = ev[i].data.ptr;
 		unsigned flag = ev[i].events;
 		e[i].write = (flag & EPOLLOUT) != 0;
 		e[i].read = (flag & EPOLLIN) != 0;
+		e[i].error = (flag & EPOLLERR) != 0;
+		e[i].eof = (flag & (EPOLLHUP | EPOLLRDHUP)) != 0;
 	}
 
 	return n;
@@ -55,6 +55,22 @@ sp_add(int kfd, int sock, void *ud) {
 	return 0;
 }
 
+static int 
+sp_add_et(int kfd, int sock, void *ud) {
+	struct kevent ke;
+	EV_SET(&ke, sock, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, ud);
+	if (kevent(kfd, &ke, 1, NULL, 0, NULL) == -1) {
+		return 1;
+	}
+	EV_SET(&ke, sock, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, ud);
+	if (kevent(kfd, &ke, 1, NULL, 0, NULL) == -1) {
+		EV_SET(&ke, sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(kfd, &ke, 1, NULL, 0, NULL);
+		return 1;
+	}
+	return 0;
+}
+
 static void 
 sp_write(int kfd, int sock, void *ud, bool enable) {
 	struct kevent ke;
@@ -65,9 +81,12 @@ sp_write(int kfd, int sock, void *ud, bool enable) {
 }
 
 static int 
-sp_wait(int kfd, struct event *e, int max) {
+sp_wait(int kfd, struct event *e, int max, int timeout) {
 	struct kevent ev[max];
-	int n = kevent(kfd, NULL, 0, ev, max, NULL);
+	struct timespec ti;
+	ti.tv_sec = timeout / 1000;
+	ti.tv_nsec = (timeout % 1000) * 1000000;
+	int n = kevent(kfd, NULL, 0, ev, max, timeout < 0 ? NULL : &ti);
 
 	int i;
 	for (i=0;i<n;i++) {
@@ -75,6 +94,8 @@ sp_wait(int kfd, struct event *e, int max) {
 		unsigned filter = ev[i].filter;
 		e[i].write = (filter == EVFILT_WRITE);
 		e[i].read = (filter == EVFILT_READ);
+		e[i].error = (ev[i].flags & EV_ERROR) != 0;
+		e[i].eof = (ev[i].flags & EV_EOF) != 0;
 	}
 
 	return n;
@@ -9,19 +9,32 @@ struct event {
 	void * s;
 	bool read;
 	bool write;
+	bool error;
+	bool eof;
+	// io_uring only, the completion carries an accepted fd or received bytes in res
+	bool accept;
+	bool recv;
+	int res;
+	int bid;
+	char * data;
 };
 
 static bool sp_invalid(poll_fd fd);
 static poll_fd sp_create();
 static void sp_release(poll_fd fd);
 static int sp_add(poll_fd fd, int sock, void *ud);
+// edge triggered, read and write are both registered permanently
+static int sp_add_et(poll_fd fd, int sock, void *ud);
 static void sp_del(poll_fd fd, int sock);
 static void sp_write(poll_fd, int sock, void *ud, bool enable);
-static int sp_wait(poll_fd, struct event *e, int max);
+// timeout in milliseconds, -1 for infinite
+static int sp_wait(poll_fd, struct event *e, int max, int timeout);
 static void sp_nonblocking(int sock);
 
 #ifdef __linux__
 #include "socket_epoll.h"
+// su_* functions, chosen at runtime in place of sp_add/sp_del/sp_write/sp_wait
+#include "socket_uring.h"
 #endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
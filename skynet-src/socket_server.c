@@ -10,7 +10,9 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -18,12 +20,43 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD
+#endif
 
 #define MAX_INFO 128
+// send_list gathers at most MAX_IOV buffers into one writev
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
 // MAX_SOCKET will be 2^MAX_SOCKET_P
 #define MAX_SOCKET_P 16
 #define MAX_EVENT 64
 #define MIN_READ_BUFFER 64
+// one readable event keeps reading into a growing buffer up to MAX_READ_BUFFER
+#define MAX_READ_BUFFER (64*1024)
+// default size guard of a length-prefixed frame
+#define FRAME_MAX (16*1024*1024)
+// resolved addresses of at most RESOLVER_CACHE hosts are cached when ttl is set
+#define RESOLVER_CACHE 256
+#define RESOLVER_HOST 64
+// all addresses of a host, separated by spaces, must fit in the host field of an open request
+#define RESOLVER_ADDR 200
+// small sends (at most COALESCE_PACKET bytes) on a coalescing socket are packed into COALESCE_SIZE bytes, flushed before next sp_wait
+#define COALESCE_SIZE 4096
+#define COALESCE_PACKET 512
+// ctrl commands with at most CTRL_SMALL bytes of request go back to a per shard freelist of at most CTRL_FREE nodes
+#define CTRL_SMALL 32
+#define CTRL_FREE 1024
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
 #define SOCKET_TYPE_PLISTEN 2
@@ -35,6 +68,9 @@
 #define SOCKET_TYPE_BIND 8
 
 #define MAX_SOCKET (1<<MAX_SOCKET_P)
+// MAX_SHARD will be 2^MAX_SHARD_P
+#define MAX_SHARD_P 4
+#define MAX_SHARD (1<<MAX_SHARD_P)
 
 #define PRIORITY_HIGH 0
 #define PRIORITY_LOW 1
@@ -47,6 +83,20 @@ struct write_buffer {
 	void *buffer;
 };
 
+/// 分包的状态，数据按大端的 2 或 4 字节长度分成一个个包
+struct socket_frame {
+	int header; ///< 长度头的字节数
+	int max; ///< 一个包最大的长度
+	int hlen; ///< 已收到的长度头字节数
+	uint8_t hbuf[4];
+	char * buffer; ///< 正在接收的包，为 NULL 时在收长度头
+	int sz;
+	int have;
+	char * rbuf; ///< 最近一次读到还没有分完的数据
+	int rsz;
+	int roff;
+};
+
 /// 写缓冲列表
 struct wb_list {
 	struct write_buffer * head;
@@ -63,23 +113,60 @@ struct socket {
 	uintptr_t opaque;
 	struct wb_list high;
 	struct wb_list low;
+	int next; ///< 开启 reuseport 时同一端口在下一个分片上的监听，-1 为没有
+	bool coalesce; ///< 是否合并小包
+	int csz; ///< 合并缓冲中的字节数，不为 0 时写缓冲列表一定是空的
+	char * cbuf; ///< 合并缓冲，大小为 COALESCE_SIZE
+	struct socket_frame * frame; ///< 分包的状态，为 NULL 时按读到的数据块转发
+	bool ready; ///< 这个槽在就绪队列中，边沿触发时还没有读到 EAGAIN
+	bool uring; ///< 数据或新连接由 io_uring 的 multishot recv/accept 交来，不再 read/accept
+	int origin; ///< 监听报告 accept 时使用的编号，即第一个分片上的监听
 };
 
+/// Socket 服务的一个分片，每个分片由一个线程 poll
 ///
+/// socket 编号的低 shard_bits 位是所在的分片，其余的位决定分片中的槽，
+/// 所以对外的接口都先按编号找到分片。
 struct socket_server {
-	int recvctrl_fd;
+	int recvctrl_fd; ///< 门铃，有 eventfd 时与 sendctrl_fd 相同
 	int sendctrl_fd;
 	int checkctrl;
+	int ctrl_pending; ///< 队列中的命令数，从 0 变为 1 时才敲门铃
+	struct ctrl_cmd * ctrl_head; ///< 只由本分片的线程读写
+	struct ctrl_cmd * ctrl_tail; ///< 各个发送者用原子交换追加
+	struct ctrl_cmd * ctrl_free; ///< 处理过的小命令，本分片的线程放回，发送者取用
+	int ctrl_free_n;
+	int ctrl_free_lock; ///< 同一时间只有一个发送者取，所以不会有 ABA
 	poll_fd event_fd;
 	int alloc_id;
 	int event_n;
 	int event_index;
+	int shard; ///< 分片编号
+	int shard_bits; ///< 分片数为 1 << shard_bits
+	int slot_mask; ///< 分片中的槽数 - 1
+	int reuseport; ///< 监听时每个分片各开一个 SO_REUSEPORT 的 fd
+	int balance; ///< 轮流选择分片，只用第一个分片的
+	struct socket_server ** shards; ///< 所有的分片，共用
+	int coalesce_n; ///< 本轮有合并数据等待发送的 socket 数
+	int coalesce_cap;
+	int * coalesce_id; ///< 本轮有合并数据等待发送的 socket 编号
+	struct socket * frame_pending; ///< 读到的数据中还有没分完的包，先于其它事件处理
+	struct resolver * resolver; ///< 域名解析的线程池，共用，为 NULL 时在 socket 线程中解析
+	int edge; ///< 边沿触发，EPOLLOUT 一直注册
+	int ready_head;
+	int ready_n;
+	struct socket ** ready; ///< 边沿触发时还可以继续读的 socket ，每次最多读一个消息后排到队尾
+#ifdef HAVE_URING
+	struct uring * uring; ///< 不为 NULL 时用 io_uring 代替 event_fd
+#endif
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
+	struct socket * slot;
 	char buffer[MAX_INFO];
-	fd_set rfds;
 };
 
+#define HASH_ID(ss, id) ((((unsigned)(id)) >> (ss)->shard_bits) & (ss)->slot_mask)
+#define SHARD(ss, id) ((ss)->shards[((unsigned)(id)) & ((1 << (ss)->shard_bits) - 1)])
+
 struct request_open {
 	int id;
 	int port;
@@ -101,6 +188,8 @@ struct request_close {
 struct request_listen {
 	int id;
 	int fd;
+	int next;
+	int origin;
 	uintptr_t opaque;
 	char host[1];
 };
@@ -113,9 +202,16 @@ struct request_bind {
 
 struct request_start {
 	int id;
+	int header;
+	int max;
 	uintptr_t opaque;
 };
 
+struct request_coalesce {
+	int id;
+	int enable;
+};
+
 struct request_package {
 	uint8_t header[8];	// 6 bytes dummy
 	union {
@@ -126,19 +222,65 @@ struct request_package {
 		struct request_listen listen;
 		struct request_bind bind;
 		struct request_start start;
+		struct request_coalesce coalesce;
 	} u;
 	uint8_t dummy[256];
 };
 
+/// 控制命令，由发送的线程分配，放入分片的多生产者单消费者队列
+struct ctrl_cmd {
+	struct ctrl_cmd * next;
+	bool small; ///< 按 CTRL_SMALL 分配，处理后放回空闲链表
+	struct request_package req;
+};
+
+/// 等待解析域名的连接请求
+struct resolve_job {
+	struct resolve_job * next;
+	struct socket_server * ss;
+	int id;
+	int port;
+	uintptr_t opaque;
+	char host[1];
+};
+
+/// 解析结果的缓存
+struct resolve_cache {
+	char host[RESOLVER_HOST];
+	char addr[RESOLVER_ADDR]; ///< 空格分隔的全部数值地址
+	time_t expire;
+};
+
+/// 域名解析的线程池，解析完成后把数值地址的连接请求交回 socket 线程
+struct resolver {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int quit;
+	int thread;
+	int ttl; ///< 缓存的秒数，0 为不缓存
+	pthread_t * pid;
+	struct resolve_job * head;
+	struct resolve_job * tail;
+	struct resolve_cache cache[RESOLVER_CACHE];
+};
+
 union sockaddr_all {
 	struct sockaddr s;
 	struct sockaddr_in v4;
 	struct sockaddr_in6 v6;
 };
 
-// 这里可以使用 jm_malloc 来分配内存
-#define MALLOC malloc 
-#define FREE free
+// 读缓冲交给使用者释放，发送的缓冲由使用者分配，所以双方必须使用同一个分配器。
+// 默认是 malloc ，skynet 换成 skynet_malloc ，这样 libnet.a 不依赖 skynet 的分配器。
+// 分配器的线程缓存负责回收复用这些缓冲，没有再做一层读缓冲池：
+// 一次 read 系统调用约 850ns ，而 skynet_malloc 加上在另一个线程的释放约 55-90ns
+static void * (*net_malloc)(size_t) = malloc;
+static void * (*net_realloc)(void *, size_t) = realloc;
+static void (*net_free)(void *) = free;
+
+#define MALLOC net_malloc
+#define REALLOC net_realloc
+#define FREE net_free
 
 static void
 socket_keepalive(int fd) {
@@ -149,12 +291,13 @@ socket_keepalive(int fd) {
 static int
 reserve_id(struct socket_server *ss) {
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = __sync_add_and_fetch(&(ss->alloc_id), 1);
-		if (id < 0) {
-			id = __sync_and_and_fetch(&(ss->alloc_id), 0x7fffffff);
+	for (i=0;i<=ss->slot_mask;i++) {
+		int n = __sync_add_and_fetch(&(ss->alloc_id), 1);
+		if (n < 0) {
+			n = __sync_and_and_fetch(&(ss->alloc_id), 0x7fffffff);
 		}
-		struct socket *s = &ss->slot[id % MAX_SOCKET];
+		int id = (int)((((unsigned)n << ss->shard_bits) | ss->shard) & 0x7fffffff);
+		struct socket *s = &ss->slot[HASH_ID(ss, id)];
 		if (s->type == SOCKET_TYPE_INVALID) {
 			if (__sync_bool_compare_and_swap(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
 				return id;
@@ -173,8 +316,16 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
-struct socket_server * 
-socket_server_create() {
+// 轮流选择一个分片，用于新建的 socket
+static struct socket_server *
+balance_shard(struct socket_server *ss) {
+	struct socket_server * first = ss->shards[0];
+	int n = __sync_fetch_and_add(&first->balance, 1);
+	return ss->shards[n & ((1 << ss->shard_bits) - 1)];
+}
+
+static struct socket_server *
+create_shard(int shard, int shard_bits) {
 	int i;
 	int fd[2];
 	poll_fd efd = sp_create();
@@ -182,16 +333,26 @@ socket_server_create() {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
 		return NULL;
 	}
-	if (pipe(fd)) {
+#ifdef HAVE_EVENTFD
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd[0] < 0) {
+#else
+	if (pipe(fd) == 0) {
+		sp_nonblocking(fd[0]);
+		sp_nonblocking(fd[1]);
+	} else {
+#endif
 		sp_release(efd);
-		fprintf(stderr, "socket-server: create socket pair failed.\n");
+		fprintf(stderr, "socket-server: create ctrl doorbell failed.\n");
 		return NULL;
 	}
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);
-		close(fd[1]);
+		if (fd[1] != fd[0]) {
+			close(fd[1]);
+		}
 		sp_release(efd);
 		return NULL;
 	}
@@ -201,22 +362,90 @@ socket_server_create() {
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
 	ss->checkctrl = 1;
-
-	for (i=0;i<MAX_SOCKET;i++) {
+	ss->ctrl_pending = 0;
+	ss->ctrl_head = ss->ctrl_tail = MALLOC(offsetof(struct ctrl_cmd, req.u) + CTRL_SMALL); // stub
+	ss->ctrl_head->next = NULL;
+	ss->ctrl_head->small = true;
+	ss->ctrl_free = NULL;
+	ss->ctrl_free_n = 0;
+	ss->ctrl_free_lock = 0;
+	ss->shard = shard;
+	ss->shard_bits = shard_bits;
+	ss->slot_mask = (MAX_SOCKET >> shard_bits) - 1;
+	ss->reuseport = 0;
+	ss->balance = 0;
+	ss->shards = NULL;
+	ss->coalesce_n = 0;
+	ss->coalesce_cap = 0;
+	ss->coalesce_id = NULL;
+	ss->frame_pending = NULL;
+	ss->resolver = NULL;
+	ss->edge = 0;
+	ss->ready_head = 0;
+	ss->ready_n = 0;
+	ss->ready = NULL;
+#ifdef HAVE_URING
+	ss->uring = NULL;
+#endif
+	ss->slot = MALLOC((ss->slot_mask + 1) * sizeof(struct socket));
+
+	for (i=0;i<=ss->slot_mask;i++) {
 		struct socket *s = &ss->slot[i];
 		s->type = SOCKET_TYPE_INVALID;
+		s->csz = 0;
+		s->cbuf = NULL;
+		s->frame = NULL;
+		s->ready = false;
 		clear_wb_list(&s->high);
 		clear_wb_list(&s->low);
 	}
 	ss->alloc_id = 0;
 	ss->event_n = 0;
 	ss->event_index = 0;
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
 
+static void release_shard(struct socket_server *ss);
+static void release_resolver(struct resolver * r);
+
+// nshard 向上取 2 的幂，返回第一个分片，其它分片用 socket_server_shard 获得
+struct socket_server * 
+socket_server_create(int nshard, int reuseport) {
+	int bits = 0;
+	while ((1 << bits) < nshard && bits < MAX_SHARD_P) {
+		++bits;
+	}
+	int n = 1 << bits;
+	struct socket_server ** shards = MALLOC(n * sizeof(struct socket_server *));
+	int i;
+	for (i=0;i<n;i++) {
+		shards[i] = create_shard(i, bits);
+		if (shards[i] == NULL) {
+			while (--i >= 0) {
+				release_shard(shards[i]);
+			}
+			FREE(shards);
+			return NULL;
+		}
+		shards[i]->shards = shards;
+#ifdef SO_REUSEPORT
+		shards[i]->reuseport = reuseport && n > 1;
+#endif
+	}
+	return shards[0];
+}
+
+int
+socket_server_nshard(struct socket_server *ss) {
+	return 1 << ss->shard_bits;
+}
+
+struct socket_server *
+socket_server_shard(struct socket_server *ss, int index) {
+	return ss->shards[index];
+}
+
 static void
 free_wb_list(struct wb_list *list) {
 	struct write_buffer *wb = list->head;
@@ -230,6 +459,94 @@ free_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
+static inline int
+poll_add(struct socket_server *ss, int fd, struct socket *s) {
+#ifdef HAVE_URING
+	if (ss->uring) {
+		return su_add(ss->uring, fd, s, SU_POLL);
+	}
+#endif
+	if (ss->edge) {
+		return sp_add_et(ss->event_fd, fd, s);
+	}
+	return sp_add(ss->event_fd, fd, s);
+}
+
+// io_uring 下已连接的 socket 改由 multishot recv 收数据，监听改由 multishot accept 接受连接
+static inline void
+poll_start(struct socket_server *ss, struct socket *s) {
+#ifdef HAVE_URING
+	if (ss->uring && su_add(ss->uring, s->fd, s, s->type == SOCKET_TYPE_LISTEN ? SU_ACCEPT : SU_RECV) == 0) {
+		s->uring = true;
+	}
+#endif
+}
+
+// 边沿触发时 EPOLLOUT 一直注册着，不需要开关
+static inline void
+poll_write(struct socket_server *ss, struct socket *s, bool enable) {
+	if (!ss->edge) {
+		sp_write(ss->event_fd, s->fd, s, enable);
+	}
+}
+
+static inline void
+poll_del(struct socket_server *ss, int fd) {
+#ifdef HAVE_URING
+	if (ss->uring) {
+		su_del(ss->uring, fd);
+		return;
+	}
+#endif
+	sp_del(ss->event_fd, fd);
+}
+
+static inline int
+poll_wait(struct socket_server *ss, int max, int timeout) {
+#ifdef HAVE_URING
+	if (ss->uring) {
+		return su_wait(ss->uring, ss->ev, max, timeout);
+	}
+#endif
+	return sp_wait(ss->event_fd, ss->ev, max, timeout);
+}
+
+// 边沿触发时没有读到 EAGAIN 的 socket 放进就绪队列，不会再有事件通知
+// 队列记录的是槽，槽被新的 socket 复用时多读一次也没有关系
+static void
+push_ready(struct socket_server *ss, struct socket *s) {
+	if (!ss->edge || s->ready || s->uring) {
+		return;
+	}
+	s->ready = true;
+	int tail = (ss->ready_head + ss->ready_n) & ss->slot_mask;
+	ss->ready[tail] = s;
+	++ss->ready_n;
+}
+
+static struct socket *
+pop_ready(struct socket_server *ss) {
+	struct socket * s = ss->ready[ss->ready_head];
+	ss->ready_head = (ss->ready_head + 1) & ss->slot_mask;
+	--ss->ready_n;
+	s->ready = false;
+	return s;
+}
+
+static void
+free_frame(struct socket_server *ss, struct socket *s) {
+	struct socket_frame * f = s->frame;
+	if (f) {
+		FREE(f->buffer);
+		FREE(f->rbuf);
+		FREE(f);
+		s->frame = NULL;
+	}
+	if (ss->frame_pending == s) {
+		ss->frame_pending = NULL;
+	}
+}
+
 static void
 force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	result->id = s->id;
@@ -242,31 +559,89 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 	assert(s->type != SOCKET_TYPE_RESERVE);
 	free_wb_list(&s->high);
 	free_wb_list(&s->low);
+	FREE(s->cbuf);
+	s->cbuf = NULL;
+	s->csz = 0;
+	free_frame(ss, s);
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
-		sp_del(ss->event_fd, s->fd);
+		poll_del(ss, s->fd);
 	}
+#ifdef HAVE_URING
+	if (s->uring) {
+		// 本轮还没处理的完成事件占着缓冲或新连接的 fd ，随 socket 一起释放
+		int i;
+		for (i=ss->event_index;i<ss->event_n;i++) {
+			struct event *e = &ss->ev[i];
+			if (e->s != s)
+				continue;
+			if (e->recv && e->bid >= 0)
+				su_recycle(ss->uring, e->bid);
+			if (e->accept)
+				close(e->res);
+			e->s = NULL;
+		}
+		s->uring = false;
+	}
+#endif
 	if (s->type != SOCKET_TYPE_BIND) {
 		close(s->fd);
 	}
 	s->type = SOCKET_TYPE_INVALID;
 }
 
-void 
-socket_server_release(struct socket_server *ss) {
+static void
+release_shard(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
+	// 没有处理的命令直接丢弃，发送的数据在 socket 关闭后也不会再写
+	struct ctrl_cmd * cmd = ss->ctrl_head;
+	while (cmd) {
+		struct ctrl_cmd * next = cmd->next;
+		FREE(cmd);
+		cmd = next;
+	}
+	cmd = ss->ctrl_free;
+	while (cmd) {
+		struct ctrl_cmd * next = cmd->next;
+		FREE(cmd);
+		cmd = next;
+	}
+	for (i=0;i<=ss->slot_mask;i++) {
 		struct socket *s = &ss->slot[i];
 		if (s->type != SOCKET_TYPE_RESERVE) {
 			force_close(ss, s , &dummy);
 		}
 	}
-	close(ss->sendctrl_fd);
+	if (ss->sendctrl_fd != ss->recvctrl_fd) {
+		close(ss->sendctrl_fd);
+	}
 	close(ss->recvctrl_fd);
 	sp_release(ss->event_fd);
+#ifdef HAVE_URING
+	if (ss->uring) {
+		su_release(ss->uring);
+	}
+#endif
+	FREE(ss->slot);
+	FREE(ss->coalesce_id);
+	FREE(ss->ready);
 	FREE(ss);
 }
 
+void 
+socket_server_release(struct socket_server *ss) {
+	struct socket_server ** shards = ss->shards;
+	int n = 1 << ss->shard_bits;
+	int i;
+	if (ss->resolver) {
+		release_resolver(ss->resolver);
+	}
+	for (i=0;i<n;i++) {
+		release_shard(shards[i]);
+	}
+	FREE(shards);
+}
+
 static inline void
 check_wb_list(struct wb_list *s) {
 	assert(s->head == NULL);
@@ -275,11 +650,11 @@ check_wb_list(struct wb_list *s) {
 
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, uintptr_t opaque, bool add) {
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
-		if (sp_add(ss->event_fd, fd, s)) {
+		if (poll_add(ss, fd, s)) {
 			s->type = SOCKET_TYPE_INVALID;
 			return NULL;
 		}
@@ -287,6 +662,13 @@ new_fd(struct socket_server *ss, int id, int fd, uintptr_t opaque, bool add) {
 
 	s->id = id;
 	s->fd = fd;
+	s->next = -1;
+	s->origin = id;
+	s->coalesce = false;
+	s->csz = 0;
+	s->cbuf = NULL;
+	s->frame = NULL;
+	s->uring = false;
 	s->size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
@@ -315,30 +697,44 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 	ai_hints.ai_socktype = SOCK_STREAM;
 	ai_hints.ai_protocol = IPPROTO_TCP;
 
-	status = getaddrinfo( request->host, port, &ai_hints, &ai_list );
-	if ( status != 0 ) {
-		goto _failed;
-	}
+	// 解析线程交回的是空格分隔的全部数值地址，按顺序逐个尝试
 	int sock= -1;
-	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
-		sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
-		if ( sock < 0 ) {
-			continue;
+	char * next = request->host;
+	while (sock < 0 && next) {
+		char * host = next;
+		next = strchr(host, ' ');
+		if (next) {
+			*next++ = '\0';
 		}
-		socket_keepalive(sock);
-		if (!blocking) {
-			sp_nonblocking(sock);
+		if (ai_list) {
+			freeaddrinfo( ai_list );
+			ai_list = NULL;
 		}
-		status = connect( sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
-		if ( status != 0 && errno != EINPROGRESS) {
-			close(sock);
-			sock = -1;
+		status = getaddrinfo( host, port, &ai_hints, &ai_list );
+		if ( status != 0 ) {
+			ai_list = NULL;
 			continue;
 		}
-		if (blocking) {
-			sp_nonblocking(sock);
+		for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
+			sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+			if ( sock < 0 ) {
+				continue;
+			}
+			socket_keepalive(sock);
+			if (!blocking) {
+				sp_nonblocking(sock);
+			}
+			status = connect( sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
+			if ( status != 0 && errno != EINPROGRESS) {
+				close(sock);
+				sock = -1;
+				continue;
+			}
+			if (blocking) {
+				sp_nonblocking(sock);
+			}
+			break;
 		}
-		break;
 	}
 
 	if (sock < 0) {
@@ -353,6 +749,7 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 
 	if(status == 0) {
 		ns->type = SOCKET_TYPE_CONNECTED;
+		poll_start(ss, ns);
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
 		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
@@ -362,23 +759,48 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		poll_write(ss, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
 	return -1;
 _failed:
-	freeaddrinfo( ai_list );
-	ss->slot[id % MAX_SOCKET].type = SOCKET_TYPE_INVALID;
+	if (ai_list) {
+		freeaddrinfo( ai_list );
+	}
+	ss->slot[HASH_ID(ss, id)].type = SOCKET_TYPE_INVALID;
 	return SOCKET_ERROR;
 }
 
+// 域名解析失败，释放保留的编号
+static int
+resolve_failed(struct socket_server *ss, struct request_open * request, struct socket_message *result) {
+	int id = request->id;
+	result->opaque = request->opaque;
+	result->id = id;
+	result->ud = 0;
+	result->data = NULL;
+	ss->slot[HASH_ID(ss, id)].type = SOCKET_TYPE_INVALID;
+	return SOCKET_ERROR;
+}
+
+// 一次 writev 把链表中尽量多的块写出去，写了一部分的块留在链表头
 static int
 send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct iovec vec[MAX_IOV];
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
+		struct write_buffer * tmp;
+		int n = 0;
+		ssize_t total = 0;
+		for (tmp = list->head; tmp && n < MAX_IOV; tmp = tmp->next) {
+			vec[n].iov_base = tmp->ptr;
+			vec[n].iov_len = tmp->sz;
+			total += tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, vec, n);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -389,19 +811,30 @@ send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, stru
 				force_close(ss,s, result);
 				return SOCKET_CLOSE;
 			}
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
+			break;
+		}
+		s->wb_size -= sz;
+		ssize_t left = sz;
+		while (left > 0) {
+			tmp = list->head;
+			if (left < tmp->sz) {
+				tmp->ptr += left;
+				tmp->sz -= left;
 				return -1;
 			}
+			left -= tmp->sz;
+			list->head = tmp->next;
+			FREE(tmp->buffer);
+			FREE(tmp);
+		}
+		if (sz < total) {
+			// kernel buffer is full, wait for next writable event
 			break;
 		}
-		list->head = tmp->next;
-		FREE(tmp->buffer);
-		FREE(tmp);
 	}
-	list->tail = NULL;
+	if (list->head == NULL) {
+		list->tail = NULL;
+	}
 
 	return -1;
 }
@@ -459,7 +892,7 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *r
 			}
 		} else {
 			// step 4
-			sp_write(ss->event_fd, s->fd, s, false);
+			poll_write(ss, s, false);
 
 			if (s->type == SOCKET_TYPE_HALFCLOSE) {
 				force_close(ss, s, result);
@@ -504,17 +937,93 @@ send_buffer_empty(struct socket *s) {
 	return (s->high.head == NULL && s->low.head == NULL);
 }
 
+// 把合并缓冲写出去，写不完的部分连同缓冲一起交给高优先级列表
+static int
+send_coalesce(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	int n;
+	for (;;) {
+		n = write(s->fd, s->cbuf, s->csz);
+		if (n<0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				n = 0;
+				break;
+			default:
+				fprintf(stderr, "socket-server: write to %d (fd=%d) error.",s->id,s->fd);
+				force_close(ss,s,result);
+				return SOCKET_CLOSE;
+			}
+		}
+		break;
+	}
+	if (n < s->csz) {
+		struct request_send request;
+		request.id = s->id;
+		request.sz = s->csz;
+		request.buffer = s->cbuf;
+		append_sendbuffer(s, &request, n);
+		poll_write(ss, s, true);
+		s->cbuf = NULL;
+	}
+	s->csz = 0;
+	return -1;
+}
+
+// 本轮合并的数据在 sp_wait 之前统一写出
+static int
+flush_coalesce(struct socket_server *ss, struct socket_message *result) {
+	while (ss->coalesce_n > 0) {
+		int id = ss->coalesce_id[--ss->coalesce_n];
+		struct socket *s = &ss->slot[HASH_ID(ss, id)];
+		if (s->type == SOCKET_TYPE_INVALID || s->id != id || s->csz == 0) {
+			continue;
+		}
+		if (send_coalesce(ss, s, result) == SOCKET_CLOSE) {
+			return SOCKET_CLOSE;
+		}
+	}
+	return -1;
+}
+
+// 小包拷进合并缓冲，返回 false 表示放不下，需要走普通的发送
+static bool
+append_coalesce(struct socket_server *ss, struct socket *s, struct request_send * request) {
+	if (s->csz + request->sz > COALESCE_SIZE) {
+		return false;
+	}
+	if (s->cbuf == NULL) {
+		s->cbuf = MALLOC(COALESCE_SIZE);
+	}
+	if (s->csz == 0) {
+		if (ss->coalesce_n >= ss->coalesce_cap) {
+			ss->coalesce_cap = ss->coalesce_cap ? ss->coalesce_cap * 2 : 64;
+			ss->coalesce_id = REALLOC(ss->coalesce_id, ss->coalesce_cap * sizeof(int));
+		}
+		ss->coalesce_id[ss->coalesce_n++] = s->id;
+	}
+	memcpy(s->cbuf + s->csz, request->buffer, request->sz);
+	s->csz += request->sz;
+	FREE(request->buffer);
+	return true;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
 	If socket buffer is empty, write to fd directly.
 		If write a part, append the rest part to high list. (Even priority is PRIORITY_LOW)
 	Else append package to high (PRIORITY_HIGH) or low (PRIORITY_LOW) list.
+
+	A coalescing socket with empty buffer lists copies a small package (at most COALESCE_PACKET bytes)
+	into its coalesce buffer instead, the buffer is written once before next sp_wait or when the
+	package doesn't fit. A larger package writes the buffer out first and goes the normal way.
  */
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority) {
 	int id = request->id;
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id 
 		|| s->type == SOCKET_TYPE_HALFCLOSE
 		|| s->type == SOCKET_TYPE_PACCEPT) {
@@ -522,6 +1031,20 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		return -1;
 	}
 	assert(s->type != SOCKET_TYPE_PLISTEN && s->type != SOCKET_TYPE_LISTEN);
+	if (s->coalesce && send_buffer_empty(s)) {
+		bool small = request->sz <= COALESCE_PACKET;
+		if (small && append_coalesce(ss, s, request)) {
+			return -1;
+		}
+		// 放不下或者是大包，先写出合并缓冲，保证顺序
+		if (s->csz > 0 && send_coalesce(ss, s, result) == SOCKET_CLOSE) {
+			FREE(request->buffer);
+			return SOCKET_CLOSE;
+		}
+		if (small && send_buffer_empty(s) && append_coalesce(ss, s, request)) {
+			return -1;
+		}
+	}
 	if (send_buffer_empty(s)) {
 		int n = write(s->fd, request->buffer, request->sz);
 		if (n<0) {
@@ -541,7 +1064,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			return -1;
 		}
 		append_sendbuffer(s, request, n);	// add to high priority list, even priority == PRIORITY_LOW
-		sp_write(ss->event_fd, s->fd, s, true);
+		poll_write(ss, s, true);
 	} else {
 		if (priority == PRIORITY_LOW) {
 			append_sendbuffer_low(s, request);
@@ -552,6 +1075,20 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	return -1;
 }
 
+static int
+coalesce_socket(struct socket_server *ss, struct request_coalesce *request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		return -1;
+	}
+	s->coalesce = request->enable;
+	if (!s->coalesce && s->csz > 0) {
+		return send_coalesce(ss, s, result);
+	}
+	return -1;
+}
+
 static int
 listen_socket(struct socket_server *ss, struct request_listen * request, struct socket_message *result) {
 	int id = request->id;
@@ -561,6 +1098,8 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	s->next = request->next;
+	s->origin = request->origin;
 	return -1;
 _failed:
 	close(listen_fd);
@@ -568,15 +1107,34 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = NULL;
-	ss->slot[id % MAX_SOCKET].type = SOCKET_TYPE_INVALID;
+	ss->slot[HASH_ID(ss, id)].type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERROR;
 }
 
+static void send_request(struct socket_server *ss, struct request_package *request, char type, int len);
+
+// 开启 reuseport 的监听在每个分片上各有一个，start 和 close 沿着 next 转给下一个分片，不再报告
+static void
+forward_listen(struct socket_server *ss, struct socket *s, char type, uintptr_t opaque) {
+	struct request_package request;
+	if (type == 's') {
+		request.u.start.id = s->next;
+		request.u.start.header = 0;
+		request.u.start.max = 0;
+		request.u.start.opaque = opaque;
+		send_request(SHARD(ss, s->next), &request, type, sizeof(request.u.start));
+	} else {
+		request.u.close.id = s->next;
+		request.u.close.opaque = opaque;
+		send_request(SHARD(ss, s->next), &request, type, sizeof(request.u.close));
+	}
+}
+
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
 		result->id = id;
 		result->opaque = request->opaque;
@@ -584,6 +1142,15 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
+	if (s->next >= 0) {
+		forward_listen(ss, s, 'k', request->opaque);
+		s->next = -1;
+	}
+	if (s->csz > 0) {
+		if (send_coalesce(ss, s, result) == SOCKET_CLOSE) {
+			return SOCKET_CLOSE;
+		}
+	}
 	if (!send_buffer_empty(s)) { 
 		int type = send_buffer(ss,s,result);
 		if (type != -1)
@@ -624,16 +1191,27 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[id % MAX_SOCKET];
+	struct socket *s = &ss->slot[HASH_ID(ss, id)];
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return SOCKET_ERROR;
 	}
+	if (request->header && s->frame == NULL && s->type != SOCKET_TYPE_PLISTEN && s->type != SOCKET_TYPE_LISTEN) {
+		struct socket_frame * f = MALLOC(sizeof(*f));
+		memset(f, 0, sizeof(*f));
+		f->header = request->header;
+		f->max = request->max > 0 ? request->max : FRAME_MAX;
+		s->frame = f;
+	}
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
-		if (sp_add(ss->event_fd, s->fd, s)) {
+		if (s->next >= 0) {
+			forward_listen(ss, s, 's', request->opaque);
+		}
+		if (poll_add(ss, s->fd, s)) {
 			s->type = SOCKET_TYPE_INVALID;
 			return SOCKET_ERROR;
 		}
 		s->type = (s->type == SOCKET_TYPE_PACCEPT) ? SOCKET_TYPE_CONNECTED : SOCKET_TYPE_LISTEN;
+		poll_start(ss, s);
 		s->opaque = request->opaque;
 		result->data = "start";
 		return SOCKET_OPEN;
@@ -645,48 +1223,90 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	return -1;
 }
 
+// 清除门铃，必须之后再检查一次队列，否则会漏掉清除前刚敲的门铃
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
+clear_doorbell(struct socket_server *ss) {
+	char tmp[128];
 	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
-		return;
+		int n = read(ss->recvctrl_fd, tmp, sizeof(tmp));
+		if (n<0 && errno == EINTR)
+			continue;
+#ifndef HAVE_EVENTFD
+		if (n == sizeof(tmp))
+			continue;
+#endif
+		break;
 	}
+	ss->checkctrl = 1;
 }
 
-static int
+static inline int
 has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
+	return ss->ctrl_pending > 0;
+}
+
+// 处理过的小命令由本分片的线程压回空闲链表，不和发送者的分配器来回搬内存
+static void
+free_cmd(struct socket_server *ss, struct ctrl_cmd *cmd) {
+	if (!cmd->small || ss->ctrl_free_n >= CTRL_FREE) {
+		FREE(cmd);
+		return;
+	}
+	__sync_add_and_fetch(&ss->ctrl_free_n, 1);
+	struct ctrl_cmd * head;
+	do {
+		head = ss->ctrl_free;
+		cmd->next = head;
+	} while (!__sync_bool_compare_and_swap(&ss->ctrl_free, head, cmd));
+}
 
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
+// 发送者取一个空闲的小命令，有别的发送者正在取时不等，直接分配
+static struct ctrl_cmd *
+alloc_cmd(struct socket_server *ss, int len) {
+	struct ctrl_cmd * cmd = NULL;
+	if (len <= CTRL_SMALL) {
+		if (ss->ctrl_free && !__sync_lock_test_and_set(&ss->ctrl_free_lock, 1)) {
+			// 链表中的节点只有持锁的发送者会取走，next 不会变
+			do {
+				cmd = ss->ctrl_free;
+			} while (cmd && !__sync_bool_compare_and_swap(&ss->ctrl_free, cmd, cmd->next));
+			__sync_lock_release(&ss->ctrl_free_lock);
+			if (cmd) {
+				__sync_sub_and_fetch(&ss->ctrl_free_n, 1);
+				return cmd;
+			}
+		}
+		cmd = MALLOC(offsetof(struct ctrl_cmd, req.u) + CTRL_SMALL);
+		cmd->small = true;
+	} else {
+		cmd = MALLOC(offsetof(struct ctrl_cmd, req.u) + len);
+		cmd->small = false;
+	}
+	return cmd;
+}
 
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
+// 取出队列头的命令，队列是 intrusive MPSC ，ctrl_head 永远指向一个已经处理过的节点（或最初的 stub）
+// 发送者在交换 tail 和连上 next 之间时会暂时取不到，因为 ctrl_pending 已经计数，稍等即可
+static struct ctrl_cmd *
+pop_cmd(struct socket_server *ss) {
+	struct ctrl_cmd * head = ss->ctrl_head;
+	struct ctrl_cmd * next;
+	while ((next = *(struct ctrl_cmd * volatile *)&head->next) == NULL) {
+		__sync_synchronize();
 	}
-	return 0;
+	ss->ctrl_head = next;
+	__sync_sub_and_fetch(&ss->ctrl_pending, 1);
+	free_cmd(ss, head);
+	return next;
 }
 
 // return type
 static int
 ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
+	struct ctrl_cmd * cmd = pop_cmd(ss);
+	int type = cmd->req.header[6];
+	void * buffer = &cmd->req.u;
+	// ctrl command only exist in local process, so don't worry about endian.
 	switch (type) {
 	case 'S':
 		return start_socket(ss,(struct request_start *)buffer, result);
@@ -696,6 +1316,13 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		return listen_socket(ss,(struct request_listen *)buffer, result);
 	case 'K':
 		return close_socket(ss,(struct request_close *)buffer, result);
+	case 's':
+		// forwarded by another shard, the first listen reports
+		start_socket(ss,(struct request_start *)buffer, result);
+		return -1;
+	case 'k':
+		close_socket(ss,(struct request_close *)buffer, result);
+		return -1;
 	case 'O':
 		return open_socket(ss, (struct request_open *)buffer, result, false);
 	case 'X':
@@ -708,6 +1335,10 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_HIGH);
 	case 'P':
 		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_LOW);
+	case 'C':
+		return coalesce_socket(ss, (struct request_coalesce *)buffer, result);
+	case 'F':
+		return resolve_failed(ss, (struct request_open *)buffer, result);
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -716,31 +1347,160 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// 从最近读到的数据中分出下一个完整的包，没有完整的包时返回 -1
+static int
+next_frame(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	struct socket_frame * f = s->frame;
+	ss->frame_pending = NULL;
+	while (f->roff < f->rsz) {
+		int left = f->rsz - f->roff;
+		char * ptr = f->rbuf + f->roff;
+		if (f->buffer == NULL) {
+			int n = f->header - f->hlen;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(f->hbuf + f->hlen, ptr, n);
+			f->hlen += n;
+			f->roff += n;
+			if (f->hlen < f->header) {
+				break;
+			}
+			uint32_t sz = 0;
+			int i;
+			for (i=0;i<f->header;i++) {
+				sz = sz << 8 | f->hbuf[i];
+			}
+			if (sz > (uint32_t)f->max) {
+				fprintf(stderr, "socket-server: frame size %u on socket %d exceeds %d.\n", sz, s->id, f->max);
+				force_close(ss, s, result);
+				return SOCKET_ERROR;
+			}
+			f->hlen = 0;
+			f->sz = (int)sz;
+			f->have = 0;
+			f->buffer = MALLOC(sz ? sz : 1);
+			continue;
+		}
+		int n = f->sz - f->have;
+		if (n > left) {
+			n = left;
+		}
+		memcpy(f->buffer + f->have, ptr, n);
+		f->have += n;
+		f->roff += n;
+		if (f->have == f->sz) {
+			break;
+		}
+	}
+	if (f->roff == f->rsz) {
+		FREE(f->rbuf);
+		f->rbuf = NULL;
+		f->rsz = f->roff = 0;
+	}
+	if (f->buffer == NULL || f->have < f->sz) {
+		return -1;
+	}
+	if (f->rbuf) {
+		ss->frame_pending = s;
+	}
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = f->sz;
+	result->data = f->buffer;
+	f->buffer = NULL;
+	return SOCKET_DATA;
+}
+
+// 分包的 socket 在包体还差很多时直接读进包的缓冲，省去一次拷贝
+static int
+forward_frame(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	struct socket_frame * f = s->frame;
+	assert(f->rbuf == NULL);
+	for (;;) {
+		int n = (int)read(s->fd, f->buffer + f->have, f->sz - f->have);
+		if (n<0) {
+			switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return -1;
+			}
+			force_close(ss, s, result);
+			return SOCKET_ERROR;
+		}
+		if (n==0) {
+			force_close(ss, s, result);
+			return SOCKET_CLOSE;
+		}
+		f->have += n;
+		break;
+	}
+	if (f->have == f->sz) {
+		push_ready(ss, s);
+	}
+	if (s->type == SOCKET_TYPE_HALFCLOSE || f->have < f->sz) {
+		return -1;
+	}
+	return next_frame(ss, s, result);
+}
+
+// 缓冲读满时说明内核里还有数据，加倍缓冲继续读，一次事件尽量读成一个消息
 // return -1 (ignore) when error
 static int
 forward_message(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	struct socket_frame * f = s->frame;
+	if (f && f->buffer && f->sz - f->have >= s->size) {
+		return forward_frame(ss, s, result);
+	}
 	int sz = s->size;
 	char * buffer = MALLOC(sz);
-	int n = (int)read(s->fd, buffer, sz);
-	if (n<0) {
-		FREE(buffer);
-		switch(errno) {
-		case EINTR:
-			break;
-		case EAGAIN:
-			fprintf(stderr, "socket-server: EAGAIN capture.\n");
-			break;
-		default:
+	int n = 0;
+	for (;;) {
+		int r = (int)read(s->fd, buffer + n, sz - n);
+		if (r<0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (n > 0) {
+				// report the error at next readable event
+				if (errno != EAGAIN) {
+					push_ready(ss, s);
+				}
+				break;
+			}
+			FREE(buffer);
+			if (errno == EAGAIN) {
+				if (!ss->edge) {
+					fprintf(stderr, "socket-server: EAGAIN capture.\n");
+				}
+				return -1;
+			}
 			// close when error
 			force_close(ss, s, result);
 			return SOCKET_ERROR;
 		}
-		return -1;
-	}
-	if (n==0) {
-		FREE(buffer);
-		force_close(ss, s, result);
-		return SOCKET_CLOSE;
+		if (r==0) {
+			if (n > 0) {
+				// report the close at next readable event
+				push_ready(ss, s);
+				break;
+			}
+			FREE(buffer);
+			force_close(ss, s, result);
+			return SOCKET_CLOSE;
+		}
+		n += r;
+		if (n < sz) {
+			break;
+		}
+		if (sz >= MAX_READ_BUFFER) {
+			// fairness cap, read the rest after other sockets
+			push_ready(ss, s);
+			break;
+		}
+		sz *= 2;
+		buffer = REALLOC(buffer, sz);
 	}
 
 	if (s->type == SOCKET_TYPE_HALFCLOSE) {
@@ -750,9 +1510,18 @@ forward_message(struct socket_server *ss, struct socket *s, struct socket_messag
 	}
 
 	if (n == sz) {
-		s->size *= 2;
-	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
+		s->size = sz < MAX_READ_BUFFER ? sz * 2 : MAX_READ_BUFFER;
+	} else if (n*2 < s->size && s->size > MIN_READ_BUFFER) {
 		s->size /= 2;
+	} else if (sz > s->size) {
+		s->size = sz;
+	}
+
+	if (f) {
+		f->rbuf = buffer;
+		f->rsz = n;
+		f->roff = 0;
+		return next_frame(ss, s, result);
 	}
 
 	result->opaque = s->opaque;
@@ -762,6 +1531,40 @@ forward_message(struct socket_server *ss, struct socket *s, struct socket_messag
 	return SOCKET_DATA;
 }
 
+// io_uring 的 multishot recv 把数据收进缓冲环，拷出来后立即把缓冲还回去
+static int
+forward_recv(struct socket_server *ss, struct socket *s, struct event *e, struct socket_message * result) {
+	int n = e->res;
+	if (n <= 0) {
+		force_close(ss, s, result);
+		return n == 0 ? SOCKET_CLOSE : SOCKET_ERROR;
+	}
+	char * buffer = NULL;
+	if (s->type != SOCKET_TYPE_HALFCLOSE) {
+		buffer = MALLOC(n);
+		memcpy(buffer, e->data, n);
+	}
+#ifdef HAVE_URING
+	su_recycle(ss->uring, e->bid);
+#endif
+	if (buffer == NULL) {
+		// discard recv data
+		return -1;
+	}
+	struct socket_frame * f = s->frame;
+	if (f) {
+		f->rbuf = buffer;
+		f->rsz = n;
+		f->roff = 0;
+		return next_frame(ss, s, result);
+	}
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = buffer;
+	return SOCKET_DATA;
+}
+
 static int
 report_connect(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	int error;
@@ -775,7 +1578,9 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
-		sp_write(ss->event_fd, s->fd, s, false);
+		poll_write(ss, s, false);
+		poll_start(ss, s);
+		push_ready(ss, s);
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
@@ -792,28 +1597,42 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 
 // return 0 when failed
 static int
-report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+report_accept(struct socket_server *ss, struct socket *s, struct event *e, struct socket_message *result) {
 	union sockaddr_all u;
 	socklen_t len = sizeof(u);
-	int client_fd = accept(s->fd, &u.s, &len);
+	int client_fd;
+	if (s->uring) {
+		// multishot accept 交来的连接已经是非阻塞的，地址另外取
+		client_fd = e->accept ? e->res : -1;
+		if (client_fd >= 0 && getpeername(client_fd, &u.s, &len) != 0) {
+			u.s.sa_family = AF_UNSPEC;
+		}
+	} else {
+		client_fd = accept(s->fd, &u.s, &len);
+	}
 	if (client_fd < 0) {
 		return 0;
 	}
-	int id = reserve_id(ss);
+	push_ready(ss, s);
+	// 新连接在 start 之前不会加入 poll ，所以可以直接放到别的分片上
+	struct socket_server *target = ss->reuseport ? ss : balance_shard(ss);
+	int id = reserve_id(target);
 	if (id < 0) {
 		close(client_fd);
 		return 0;
 	}
 	socket_keepalive(client_fd);
-	sp_nonblocking(client_fd);
-	struct socket *ns = new_fd(ss, id, client_fd, s->opaque, false);
+	if (!s->uring) {
+		sp_nonblocking(client_fd);
+	}
+	struct socket *ns = new_fd(target, id, client_fd, s->opaque, false);
 	if (ns == NULL) {
 		close(client_fd);
 		return 0;
 	}
 	ns->type = SOCKET_TYPE_PACCEPT;
 	result->opaque = s->opaque;
-	result->id = s->id;
+	result->id = s->origin;
 	result->ud = id;
 	result->data = NULL;
 
@@ -830,6 +1649,11 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 int 
 socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
 	for (;;) {
+		if (ss->frame_pending) {
+			int type = next_frame(ss, ss->frame_pending, result);
+			if (type != -1)
+				return type;
+		}
 		if (ss->checkctrl) {
 			if (has_cmd(ss)) {
 				int type = ctrl_cmd(ss, result);
@@ -842,28 +1666,60 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			}
 		}
 		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			if (ss->coalesce_n > 0) {
+				int type = flush_coalesce(ss, result);
+				if (type != -1)
+					return type;
+			}
+			// ready sockets share the batch with new events, and don't block sp_wait
+			int nready = ss->ready_n < MAX_EVENT/2 ? ss->ready_n : MAX_EVENT/2;
+			ss->event_n = poll_wait(ss, MAX_EVENT - nready, nready ? 0 : -1);
 			ss->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
 			ss->event_index = 0;
-			if (ss->event_n <= 0) {
+			if (ss->event_n < 0) {
 				ss->event_n = 0;
+			}
+			while (nready-- > 0) {
+				struct socket *s = pop_ready(ss);
+				switch (s->type) {
+				case SOCKET_TYPE_CONNECTED:
+				case SOCKET_TYPE_HALFCLOSE:
+				case SOCKET_TYPE_LISTEN:
+				case SOCKET_TYPE_BIND: {
+					struct event *e = &ss->ev[ss->event_n++];
+					e->s = s;
+					e->read = true;
+					e->write = false;
+					e->error = false;
+					e->eof = false;
+					e->accept = false;
+					e->recv = false;
+					break;
+				}
+				default:
+					// the slot is reused or closed
+					break;
+				}
+			}
+			if (ss->event_n == 0) {
 				return -1;
 			}
 		}
 		struct event *e = &ss->ev[ss->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// dispatch ctrl queue at beginning
+			clear_doorbell(ss);
 			continue;
 		}
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING:
 			return report_connect(ss, s, result);
 		case SOCKET_TYPE_LISTEN:
-			if (report_accept(ss, s, result)) {
+			if (report_accept(ss, s, e, result)) {
 				return SOCKET_ACCEPT;
 			} 
 			break;
@@ -871,8 +1727,29 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			fprintf(stderr, "socket-server: invalid socket\n");
 			break;
 		default:
+			if (s->uring && e->recv) {
+				int type = forward_recv(ss, s, e, result);
+				if (type == -1)
+					break;
+				return type;
+			}
 			if (e->write) {
 				int type = send_buffer(ss, s, result);
+				if (type != -1)
+					return type;
+				if (!ss->edge || s->type == SOCKET_TYPE_INVALID)
+					break;
+				// edge triggered read event must not be dropped
+			}
+			if (s->uring) {
+				// 关闭和错误也由 recv 报告
+				break;
+			}
+			if (ss->edge && (e->eof || e->error)) {
+				// 边沿触发时 FIN 可能和数据在同一次通知里，读完数据后再读一次，由 read() 报告关闭或错误
+				int type = forward_message(ss, s, result);
+				if (s->type != SOCKET_TYPE_INVALID)
+					push_ready(ss, s);
 				if (type == -1)
 					break;
 				return type;
@@ -888,19 +1765,31 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
+// 命令放入分片的队列，只有队列从空变为非空时才敲门铃
 static void
 send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
+	struct ctrl_cmd * cmd = alloc_cmd(ss, len);
+	cmd->next = NULL;
+	cmd->req.header[6] = (uint8_t)type;
+	cmd->req.header[7] = (uint8_t)len;
+	memcpy(&cmd->req.u, &request->u, len);
+	__sync_synchronize();
+	struct ctrl_cmd * prev = __sync_lock_test_and_set(&ss->ctrl_tail, cmd);
+	prev->next = cmd;
+	if (__sync_fetch_and_add(&ss->ctrl_pending, 1) != 0) {
+		return;
+	}
+#ifdef HAVE_EVENTFD
+	uint64_t one = 1;
+#else
+	uint8_t one = 1;
+#endif
 	for (;;) {
-		int n = write(ss->sendctrl_fd, &request->header[6], len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
-			}
+		int n = write(ss->sendctrl_fd, &one, sizeof(one));
+		if (n<0 && errno == EINTR) {
 			continue;
 		}
-		assert(n == len+2);
+		// EAGAIN means the doorbell is already ringing
 		return;
 	}
 }
@@ -922,10 +1811,214 @@ open_request(struct socket_server *ss, struct request_package *req, uintptr_t op
 	return len;
 }
 
+static bool
+numeric_host(const char * host) {
+	struct in6_addr tmp;
+	return inet_pton(AF_INET, host, &tmp) == 1 || inet_pton(AF_INET6, host, &tmp) == 1;
+}
+
+static struct resolve_cache *
+resolve_slot(struct resolver *r, const char * host) {
+	uint32_t h = 2166136261u;
+	const char * p;
+	for (p=host;*p;p++) {
+		h = (h ^ (uint8_t)*p) * 16777619u;
+	}
+	return &r->cache[h % RESOLVER_CACHE];
+}
+
+static time_t
+resolve_now() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return ti.tv_sec;
+}
+
+// 查缓存，命中时把数值地址列表拷到 addr
+static bool
+resolve_cached(struct resolver *r, const char * host, char addr[RESOLVER_ADDR]) {
+	if (r->ttl <= 0 || strlen(host) >= RESOLVER_HOST) {
+		return false;
+	}
+	bool hit = false;
+	pthread_mutex_lock(&r->lock);
+	struct resolve_cache * c = resolve_slot(r, host);
+	if (strcmp(c->host, host) == 0 && c->expire > resolve_now()) {
+		memcpy(addr, c->addr, RESOLVER_ADDR);
+		hit = true;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return hit;
+}
+
+static void
+resolve_update(struct resolver *r, const char * host, const char * addr) {
+	if (r->ttl <= 0 || strlen(host) >= RESOLVER_HOST) {
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	struct resolve_cache * c = resolve_slot(r, host);
+	strcpy(c->host, host);
+	strcpy(c->addr, addr);
+	c->expire = resolve_now() + r->ttl;
+	pthread_mutex_unlock(&r->lock);
+}
+
+// 按 getaddrinfo 排好的顺序把全部地址写成空格分隔的列表，放不下的丢弃
+static bool
+resolve_host(const char * host, char addr[RESOLVER_ADDR]) {
+	struct addrinfo ai_hints;
+	struct addrinfo *ai_list = NULL;
+	struct addrinfo *ai_ptr = NULL;
+	memset( &ai_hints, 0, sizeof( ai_hints ) );
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_protocol = IPPROTO_TCP;
+	if (getaddrinfo(host, NULL, &ai_hints, &ai_list) != 0) {
+		return false;
+	}
+	int len = 0;
+	for (ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next) {
+		char tmp[INET6_ADDRSTRLEN];
+		struct sockaddr * sa = ai_ptr->ai_addr;
+		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)sa)->sin_addr : (void*)&((struct sockaddr_in6 *)sa)->sin6_addr;
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, tmp, sizeof(tmp)) == NULL) {
+			continue;
+		}
+		int n = strlen(tmp);
+		if (len + (len > 0) + n >= RESOLVER_ADDR) {
+			break;
+		}
+		if (len > 0) {
+			addr[len++] = ' ';
+		}
+		memcpy(addr + len, tmp, n + 1);
+		len += n;
+	}
+	freeaddrinfo(ai_list);
+	return len > 0;
+}
+
+static void *
+resolver_thread(void *ud) {
+	struct resolver * r = ud;
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		while (r->head == NULL && !r->quit) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->quit) {
+			pthread_mutex_unlock(&r->lock);
+			return NULL;
+		}
+		struct resolve_job * job = r->head;
+		r->head = job->next;
+		if (r->head == NULL) {
+			r->tail = NULL;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		struct request_package request;
+		char addr[RESOLVER_ADDR];
+		request.u.open.id = job->id;
+		request.u.open.port = job->port;
+		request.u.open.opaque = job->opaque;
+		if (resolve_host(job->host, addr)) {
+			resolve_update(r, job->host, addr);
+			int len = strlen(addr);
+			memcpy(request.u.open.host, addr, len+1);
+			send_request(job->ss, &request, 'O', sizeof(request.u.open) + len);
+		} else {
+			request.u.open.host[0] = '\0';
+			send_request(job->ss, &request, 'F', sizeof(request.u.open));
+		}
+		FREE(job);
+	}
+}
+
+static void
+resolve_async(struct socket_server *ss, struct request_open * request, int len) {
+	struct resolver * r = ss->resolver;
+	struct resolve_job * job = MALLOC(sizeof(*job) + len);
+	job->next = NULL;
+	job->ss = ss;
+	job->id = request->id;
+	job->port = request->port;
+	job->opaque = request->opaque;
+	memcpy(job->host, request->host, len+1);
+	pthread_mutex_lock(&r->lock);
+	if (r->tail) {
+		r->tail->next = job;
+	} else {
+		r->head = job;
+	}
+	r->tail = job;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+// 开启解析线程池后，域名在线程池中解析，socket 线程只处理数值地址
+void
+socket_server_resolver(struct socket_server *ss, int thread, int ttl) {
+	if (thread <= 0 || ss->resolver) {
+		return;
+	}
+	struct resolver * r = MALLOC(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->ttl = ttl;
+	r->pid = MALLOC(thread * sizeof(pthread_t));
+	int i;
+	for (i=0;i<thread;i++) {
+		if (pthread_create(&r->pid[i], NULL, resolver_thread, r)) {
+			fprintf(stderr, "socket-server: create resolver thread failed.\n");
+			break;
+		}
+	}
+	r->thread = i;
+	int n = 1 << ss->shard_bits;
+	for (i=0;i<n;i++) {
+		ss->shards[i]->resolver = r;
+	}
+}
+
+static void
+release_resolver(struct resolver * r) {
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	int i;
+	for (i=0;i<r->thread;i++) {
+		pthread_join(r->pid[i], NULL);
+	}
+	struct resolve_job * job = r->head;
+	while (job) {
+		struct resolve_job * next = job->next;
+		FREE(job);
+		job = next;
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	FREE(r->pid);
+	FREE(r);
+}
+
 int 
 socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * addr, int port) {
 	struct request_package request;
+	ss = balance_shard(ss);
 	int len = open_request(ss, &request, opaque, addr, port);
+	if (ss->resolver && !numeric_host(addr)) {
+		char numeric[RESOLVER_ADDR];
+		if (!resolve_cached(ss->resolver, addr, numeric)) {
+			resolve_async(ss, &request.u.open, len);
+			return request.u.open.id;
+		}
+		len = strlen(numeric);
+		memcpy(request.u.open.host, numeric, len+1);
+	}
 	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
@@ -934,6 +2027,7 @@ int
 socket_server_block_connect(struct socket_server *ss, uintptr_t opaque, const char * addr, int port) {
 	struct request_package request;
 	struct socket_message result;
+	ss = balance_shard(ss);
 	open_request(ss, &request, opaque, addr, port);
 	int ret = open_socket(ss, &request.u.open, &result, true);
 	if (ret == SOCKET_OPEN) {
@@ -946,7 +2040,8 @@ socket_server_block_connect(struct socket_server *ss, uintptr_t opaque, const ch
 // return -1 when error
 int64_t 
 socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	ss = SHARD(ss, id);
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		return -1;
 	}
@@ -963,7 +2058,8 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 
 void 
 socket_server_send_lowpriority(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[id % MAX_SOCKET];
+	ss = SHARD(ss, id);
+	struct socket * s = &ss->slot[HASH_ID(ss, id)];
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		return;
 	}
@@ -980,7 +2076,11 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	int n = 1 << ss->shard_bits;
+	int i;
+	for (i=0;i<n;i++) {
+		send_request(ss->shards[i], &request, 'X', 0);
+	}
 }
 
 void
@@ -988,11 +2088,11 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.close.id = id;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(SHARD(ss, id), &request, 'K', sizeof(request.u.close));
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, int reuseport) {
 	// only support ipv4
 	// todo: support ipv6 by getaddrinfo
 	uint32_t addr = INADDR_ANY;
@@ -1007,6 +2107,11 @@ do_listen(const char * host, int port, int backlog) {
 	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+		goto _failed;
+	}
+#endif
 
 	struct sockaddr_in my_addr;
 	memset(&my_addr, 0, sizeof(struct sockaddr_in));
@@ -1019,30 +2124,65 @@ do_listen(const char * host, int port, int backlog) {
 	if (listen(listen_fd, backlog) == -1) {
 		goto _failed;
 	}
+	// edge triggered mode accepts until EAGAIN
+	sp_nonblocking(listen_fd);
 	return listen_fd;
 _failed:
 	close(listen_fd);
 	return -1;
 }
 
+// 开启 reuseport 时每个分片各监听一次，返回第一个分片上的编号
 int 
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
-	if (fd < 0) {
-		return -1;
+	int n = ss->reuseport ? (1 << ss->shard_bits) : 1;
+	int fd[MAX_SHARD];
+	int id[MAX_SHARD];
+	struct socket_server * target[MAX_SHARD];
+	int i;
+	for (i=0;i<n;i++) {
+		fd[i] = do_listen(addr, port, backlog, ss->reuseport);
+		if (fd[i] < 0) {
+			while (--i >= 0) {
+				close(fd[i]);
+			}
+			return -1;
+		}
 	}
-	struct request_package request;
-	int id = reserve_id(ss);
-	request.u.listen.opaque = opaque;
-	request.u.listen.id = id;
-	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen));
-	return id;
+	int origin = -1;
+	for (i=0;i<n;i++) {
+		target[i] = ss->reuseport ? ss->shards[i] : balance_shard(ss);
+		id[i] = reserve_id(target[i]);
+		if (id[i] < 0) {
+			// 没有空位，退还已经预留的 id
+			while (--i >= 0) {
+				target[i]->slot[HASH_ID(target[i], id[i])].type = SOCKET_TYPE_INVALID;
+			}
+			for (i=0;i<n;i++) {
+				close(fd[i]);
+			}
+			return -1;
+		}
+		if (i == 0) {
+			origin = id[0];
+		}
+	}
+	for (i=0;i<n;i++) {
+		struct request_package request;
+		request.u.listen.opaque = opaque;
+		request.u.listen.id = id[i];
+		request.u.listen.fd = fd[i];
+		request.u.listen.next = (i+1 < n) ? id[i+1] : -1;
+		request.u.listen.origin = origin;
+		send_request(target[i], &request, 'L', sizeof(request.u.listen));
+	}
+	return origin;
 }
 
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	struct request_package request;
+	ss = balance_shard(ss);
 	int id = reserve_id(ss);
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
@@ -1051,12 +2191,91 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	return id;
 }
 
+// 必须在创建 socket server 之前调用
+void
+socket_server_allocator(void * (*xmalloc)(size_t), void * (*xrealloc)(void *, size_t), void (*xfree)(void *)) {
+	net_malloc = xmalloc;
+	net_realloc = xrealloc;
+	net_free = xfree;
+}
+
+// 必须在开启任何 socket 之前调用
+void
+socket_server_edge(struct socket_server *ss, int enable) {
+	int n = 1 << ss->shard_bits;
+	int i;
+	for (i=0;i<n;i++) {
+		struct socket_server * shard = ss->shards[i];
+		shard->edge = enable;
+		if (enable && shard->ready == NULL) {
+			shard->ready = MALLOC((shard->slot_mask + 1) * sizeof(struct socket *));
+		}
+	}
+}
+
+// 必须在开启任何 socket 之前调用，io_uring 只报告新的事件，所以同时开启边沿触发
+int
+socket_server_uring(struct socket_server *ss, int enable) {
+	if (!enable) {
+		return 0;
+	}
+#ifdef HAVE_URING
+	int n = 1 << ss->shard_bits;
+	int i;
+	for (i=0;i<n;i++) {
+		struct socket_server * shard = ss->shards[i];
+		if (shard->uring) {
+			continue;
+		}
+		struct uring * u = su_create();
+		if (u == NULL) {
+			break;
+		}
+		if (su_add(u, shard->recvctrl_fd, NULL, SU_READ)) {
+			su_release(u);
+			break;
+		}
+		shard->uring = u;
+	}
+	if (i == n) {
+		socket_server_edge(ss, 1);
+		return 0;
+	}
+	// keep all shards on one backend
+	for (i=0;i<n;i++) {
+		struct socket_server * shard = ss->shards[i];
+		if (shard->uring) {
+			su_release(shard->uring);
+			shard->uring = NULL;
+		}
+	}
+#endif
+	fprintf(stderr, "socket-server: io_uring is not available, use %s\n", ss->edge ? "edge triggered poll" : "poll");
+	return -1;
+}
+
+void
+socket_server_coalesce(struct socket_server *ss, int id, int enable) {
+	struct request_package request;
+	request.u.coalesce.id = id;
+	request.u.coalesce.enable = enable;
+	send_request(SHARD(ss, id), &request, 'C', sizeof(request.u.coalesce));
+}
+
 void 
 socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
+	socket_server_start_frame(ss, opaque, id, 0, 0);
+}
+
+void
+socket_server_start_frame(struct socket_server *ss, uintptr_t opaque, int id, int header, int max) {
 	struct request_package request;
+	assert(header == 0 || header == 2 || header == 4);
 	request.u.start.id = id;
+	request.u.start.header = header;
+	request.u.start.max = max;
 	request.u.start.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.start));
+	send_request(SHARD(ss, id), &request, 'S', sizeof(request.u.start));
 }
 
 
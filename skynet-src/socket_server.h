@@ -1,6 +1,7 @@
 #ifndef skynet_socket_server_h
 #define skynet_socket_server_h
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define SOCKET_DATA 0
@@ -19,13 +20,29 @@ struct socket_message {
 	char * data;
 };
 
-struct socket_server * socket_server_create();
+// allocator of the read buffers (freed by the user) and the send buffers (allocated by the user),
+// malloc/realloc/free by default, call it before socket_server_create
+void socket_server_allocator(void * (*xmalloc)(size_t), void * (*xrealloc)(void *, size_t), void (*xfree)(void *));
+// nshard rounds up to power of 2, each shard should be polled by its own thread
+struct socket_server * socket_server_create(int nshard, int reuseport);
+int socket_server_nshard(struct socket_server *);
+struct socket_server * socket_server_shard(struct socket_server *, int index);
 void socket_server_release(struct socket_server *);
+// edge triggered poll, reads until EAGAIN with one message per socket each turn, call it before opening any socket
+void socket_server_edge(struct socket_server *, int enable);
+// poll with io_uring (linux 6.0+) instead of epoll, multishot recv and accept on tcp sockets, implies edge triggered, call it before opening any socket. return -1 if not available
+int socket_server_uring(struct socket_server *, int enable);
+// resolve host names in a thread pool instead of the socket thread, cache results for ttl seconds (0 for no cache)
+void socket_server_resolver(struct socket_server *, int thread, int ttl);
 int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
 void socket_server_start(struct socket_server *, uintptr_t opaque, int id);
+// split the stream by 2 or 4 bytes big-endian length header, deliver one SOCKET_DATA per frame (at most max bytes, 0 for default)
+void socket_server_start_frame(struct socket_server *, uintptr_t opaque, int id, int header, int max);
+// small sends are packed and written once per poll cycle
+void socket_server_coalesce(struct socket_server *, int id, int enable);
 
 // return -1 when error
 int64_t socket_server_send(struct socket_server *, int id, const void * buffer, int sz);
@@ -0,0 +1,512 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+// io_uring backend, selected at runtime instead of epoll.
+// Connected sockets receive with multishot IORING_OP_RECV into a provided buffer ring and
+// listeners accept with multishot IORING_OP_ACCEPT, the completions carry the bytes and the
+// new fds, so no read() or accept() is called. Other fds and the writable side use multishot
+// IORING_OP_POLL_ADD. Requests are queued in the submission ring and submitted together with
+// the wait, so add/del/wait cost one io_uring_enter per poll turn. Needs linux 6.0+.
+// Multishot poll reports each wake up once, the caller must use edge triggered semantics.
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+
+#define HAVE_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+// <poll.h> only defines it with _GNU_SOURCE
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+#define URING_ENTRIES 256
+// the buffer ring holds URING_BUFFERS buffers, each event keeps one until su_recycle,
+// twice MAX_EVENT so a poll turn never runs out
+#define URING_BUFFERS 128
+#define URING_BUFFER_SIZE (16*1024)
+#define URING_BGID 0
+
+// how su_add watches an fd
+#define SU_READ 0	// poll POLLIN, the ctrl doorbell
+#define SU_POLL 1	// poll POLLIN and POLLOUT, the caller reads
+#define SU_RECV 2	// multishot recv into the buffer ring, poll POLLOUT
+#define SU_ACCEPT 3	// multishot accept
+
+// the low 2 bits of user_data tell which request completes
+#define SU_OP_CANCEL 0
+#define SU_OP_POLL 1
+#define SU_OP_RECV 2
+#define SU_OP_ACCEPT 3
+
+// registrations are indexed by fd, gen tells a live request from a removed one
+struct uring_reg {
+	void * ud;
+	unsigned gen;
+	unsigned events;
+	int mode;
+	int seq;
+	int index;
+	bool used;
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void * sq_ring;
+	size_t sq_sz;
+	void * cq_ring;
+	size_t cq_sz;
+	size_t sqe_sz;
+	unsigned tail; // local sq tail, published before io_uring_enter
+	struct io_uring_buf_ring * br;
+	size_t br_sz;
+	unsigned short br_tail; // local buffer ring tail
+	char * buffer;
+	int seq;
+	int reg_n;
+	struct uring_reg * reg;
+};
+
+static inline uint64_t
+su_data(int sock, unsigned gen, int op) {
+	return ((uint64_t)(unsigned)sock << 32) | (gen << 2) | op;
+}
+
+static void
+su_release(struct uring *u) {
+	if (u->sqes) {
+		munmap(u->sqes, u->sqe_sz);
+	}
+	if (u->cq_ring && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_sz);
+	}
+	if (u->sq_ring) {
+		munmap(u->sq_ring, u->sq_sz);
+	}
+	close(u->fd);
+	if (u->br) {
+		munmap(u->br, u->br_sz);
+	}
+	free(u->buffer);
+	free(u->reg);
+	free(u);
+}
+
+// give a buffer back to the kernel
+static void
+su_recycle(struct uring *u, int bid) {
+	// bufs[0] shares its resv with the ring tail, so only these fields are written
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_BUFFERS - 1)];
+	b->addr = (uint64_t)(uintptr_t)(u->buffer + (size_t)bid * URING_BUFFER_SIZE);
+	b->len = URING_BUFFER_SIZE;
+	b->bid = bid;
+	++u->br_tail;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static bool
+su_buffer_ring(struct uring *u) {
+	u->br_sz = URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return false;
+	}
+	u->buffer = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	if (u->buffer == NULL) {
+		return false;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		return false;
+	}
+	int i;
+	for (i=0;i<URING_BUFFERS;i++) {
+		su_recycle(u, i);
+	}
+	return true;
+}
+
+// publish queued sqes, wait for at least wait completions
+static int
+su_enter(struct uring *u, unsigned wait, int timeout) {
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	unsigned submit = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0) {
+		return 0;
+	}
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	void * argp = NULL;
+	size_t argsz = 0;
+	if (wait && timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		argp = &arg;
+		argsz = sizeof(arg);
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags, argp, argsz);
+}
+
+static struct io_uring_sqe *
+su_sqe(struct uring *u) {
+	if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		// submission ring is full, flush it without waiting
+		su_enter(u, 0, 0);
+	}
+	unsigned index = u->tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	++u->tail;
+	return sqe;
+}
+
+static void
+su_poll(struct uring *u, int sock, struct uring_reg *r) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sock;
+	sqe->poll32_events = r->events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = su_data(sock, r->gen, SU_OP_POLL);
+}
+
+static void
+su_recv(struct uring *u, int sock, struct uring_reg *r) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = su_data(sock, r->gen, SU_OP_RECV);
+}
+
+static void
+su_accept(struct uring *u, int sock, struct uring_reg *r) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = sock;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = su_data(sock, r->gen, SU_OP_ACCEPT);
+}
+
+static void
+su_cancel(struct uring *u, uint64_t data) {
+	struct io_uring_sqe *sqe = su_sqe(u);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = SU_OP_CANCEL;
+}
+
+static void
+su_remove(struct uring *u, int sock, struct uring_reg *r) {
+	if (r->mode != SU_ACCEPT)
+		su_cancel(u, su_data(sock, r->gen, SU_OP_POLL));
+	if (r->mode == SU_RECV)
+		su_cancel(u, su_data(sock, r->gen, SU_OP_RECV));
+	if (r->mode == SU_ACCEPT)
+		su_cancel(u, su_data(sock, r->gen, SU_OP_ACCEPT));
+	r->used = false;
+	// gen has 30 bits in user_data and is never 0
+	r->gen = (r->gen + 1) & 0x3fffffff;
+	if (r->gen == 0)
+		r->gen = 1;
+}
+
+// an fd registered before changes its mode, completions of the old mode are dropped
+static int
+su_add(struct uring *u, int sock, void *ud, int mode) {
+	if (sock < 0) {
+		return 1;
+	}
+	if (sock >= u->reg_n) {
+		int n = u->reg_n ? u->reg_n : 64;
+		while (n <= sock)
+			n *= 2;
+		struct uring_reg * reg = realloc(u->reg, n * sizeof(*reg));
+		if (reg == NULL) {
+			return 1;
+		}
+		memset(reg + u->reg_n, 0, (n - u->reg_n) * sizeof(*reg));
+		u->reg = reg;
+		u->reg_n = n;
+	}
+	struct uring_reg *r = &u->reg[sock];
+	if (r->used) {
+		su_remove(u, sock, r);
+	}
+	if (r->gen == 0)
+		r->gen = 1;
+	r->ud = ud;
+	r->mode = mode;
+	r->seq = 0;
+	r->used = true;
+	switch (mode) {
+	case SU_READ:
+		r->events = POLLIN;
+		break;
+	case SU_POLL:
+		r->events = POLLIN | POLLRDHUP | POLLOUT;
+		break;
+	default:
+		r->events = POLLOUT;
+		break;
+	}
+	if (mode != SU_ACCEPT)
+		su_poll(u, sock, r);
+	if (mode == SU_RECV)
+		su_recv(u, sock, r);
+	if (mode == SU_ACCEPT)
+		su_accept(u, sock, r);
+	return 0;
+}
+
+static void
+su_del(struct uring *u, int sock) {
+	if (sock >= 0 && sock < u->reg_n && u->reg[sock].used) {
+		su_remove(u, sock, &u->reg[sock]);
+	}
+}
+
+// multishot recv is the newest piece (6.0), an older kernel rejects it with EINVAL
+static bool
+su_probe(struct uring *u) {
+	int fd[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd)) {
+		return false;
+	}
+	struct uring_reg r;
+	memset(&r, 0, sizeof(r));
+	r.gen = 1;
+	su_recv(u, fd[0], &r);
+	su_cancel(u, su_data(fd[0], r.gen, SU_OP_RECV));
+	int ok = -1;
+	while (ok < 0 && su_enter(u, 1, -1) >= 0) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (;head != tail;head++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			if ((cqe->user_data & 3) == SU_OP_RECV) {
+				ok = cqe->res != -EINVAL;
+			}
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	close(fd[0]);
+	close(fd[1]);
+	return ok > 0;
+}
+
+static struct uring *
+su_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct uring *u = calloc(1, sizeof(*u));
+	u->fd = fd;
+	if (!(p.features & IORING_FEAT_RSRC_TAGS) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		// older than 5.13, no multishot poll
+		su_release(u);
+		return NULL;
+	}
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+	u->sq_ring = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		su_release(u);
+		return NULL;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			su_release(u);
+			return NULL;
+		}
+	}
+	u->sqe_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqe_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		su_release(u);
+		return NULL;
+	}
+	char * sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->tail = *u->sq_tail;
+	char * cq = u->cq_ring;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	if (!su_buffer_ring(u) || !su_probe(u)) {
+		su_release(u);
+		return NULL;
+	}
+	return u;
+}
+
+// a completion of a removed registration still owns a buffer or an accepted fd
+static void
+su_drop(struct uring *u, int op, struct io_uring_cqe *cqe) {
+	if (op == SU_OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		su_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	} else if (op == SU_OP_ACCEPT && cqe->res >= 0) {
+		close(cqe->res);
+	}
+}
+
+static struct event *
+su_event(struct event *e, int *n, void *ud) {
+	struct event *ev = &e[(*n)++];
+	ev->s = ud;
+	ev->read = false;
+	ev->write = false;
+	ev->error = false;
+	ev->eof = false;
+	ev->accept = false;
+	ev->recv = false;
+	return ev;
+}
+
+// several poll completions of one fd in a batch are merged into one event,
+// each recv or accept completion is an event of its own
+static int
+su_wait(struct uring *u, struct event *e, int max, int timeout) {
+	unsigned head = *u->cq_head;
+	bool empty = head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int ret = su_enter(u, (empty && timeout != 0) ? 1 : 0, timeout);
+	if (ret < 0 && errno != ETIME && errno != EINTR) {
+		return -1;
+	}
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+	if (++u->seq == 0)
+		u->seq = 1;
+	while (head != tail && n < max) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+		++head;
+		int sock = (int)(cqe->user_data >> 32);
+		unsigned gen = (unsigned)cqe->user_data >> 2;
+		int op = (int)(cqe->user_data & 3);
+		if (op == SU_OP_CANCEL) {
+			continue;
+		}
+		struct uring_reg *r = sock < u->reg_n ? &u->reg[sock] : NULL;
+		if (r == NULL || !r->used || r->gen != gen) {
+			// stale completion of a removed request
+			su_drop(u, op, cqe);
+			continue;
+		}
+		bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+		struct event *ev;
+		switch (op) {
+		case SU_OP_RECV:
+			if (!more && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+				// multishot recv terminated (no buffer or overflow), arm it again
+				su_recv(u, sock, r);
+			}
+			if (cqe->res == -ENOBUFS) {
+				break;
+			}
+			ev = su_event(e, &n, r->ud);
+			ev->recv = true;
+			ev->res = cqe->res;
+			ev->bid = -1;
+			ev->data = NULL;
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				ev->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				ev->data = u->buffer + (size_t)ev->bid * URING_BUFFER_SIZE;
+			}
+			break;
+		case SU_OP_ACCEPT:
+			if (!more) {
+				su_accept(u, sock, r);
+			}
+			if (cqe->res < 0) {
+				break;
+			}
+			ev = su_event(e, &n, r->ud);
+			ev->accept = true;
+			ev->res = cqe->res;
+			break;
+		default: {
+			if (!more) {
+				// multishot poll terminated (overflow or error), arm it again
+				su_poll(u, sock, r);
+			}
+			unsigned flag = cqe->res < 0 ? POLLERR : (unsigned)cqe->res;
+			if (r->seq == u->seq) {
+				ev = &e[r->index];
+			} else {
+				r->seq = u->seq;
+				r->index = n;
+				ev = su_event(e, &n, r->ud);
+			}
+			if (flag & POLLOUT)
+				ev->write = true;
+			if (flag & POLLIN)
+				ev->read = true;
+			if (flag & POLLERR)
+				ev->error = true;
+			if (flag & (POLLHUP | POLLRDHUP))
+				ev->eof = true;
+			break;
+		}
+		}
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+// 服务使用自己的 jemalloc arena ，退出后块还被别人持有时只 purge ，块都释放后 destroy
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <string.h>
+
+static void * kept = NULL;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	// 留下一块，像发给别的服务的消息一样在服务退出后才释放
+	kept = skynet_malloc(1000);
+	skynet_free(skynet_malloc(100));
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+static size_t
+_live(int arena) {
+	char name[64];
+	size_t epoch = 1;
+	mallctl_int64("epoch", &epoch);
+	sprintf(name, "stats.arenas.%d.small.allocated", arena);
+	return mallctl_int64(name, NULL);
+}
+
+int
+main() {
+	test_init();
+	test_module("arena", _init, NULL);
+	struct skynet_context * ctx = skynet_context_new("arena", NULL);
+	CHECK(ctx);
+	uint32_t handle = skynet_context_handle(ctx);
+	const char * r = skynet_command(ctx, "ARENA", "");
+#ifdef NOUSE_JEMALLOC
+	// 没有 jemalloc 时没有 arena ，这个路径由 make test-jemalloc 验证
+	CHECK(r == NULL);
+	skynet_handle_retire(handle);
+	test_dispatch();
+	printf("test_arena skipped (built without jemalloc, run make test-jemalloc)\n");
+	return 0;
+#endif
+	CHECK(r);
+	int arena = strtol(r, NULL, 10);
+	CHECK(arena > 0);
+	skynet_send(NULL, handle, handle, PTYPE_TEXT, 0, "go", 2);
+	test_dispatch();
+	CHECK(kept);
+	CHECK(_live(arena) >= 1000);
+	// 碎片统计用到的页数不少于存活的字节
+	char name[64];
+	sprintf(name, "stats.arenas.%d.pactive", arena);
+	CHECK(mallctl_int64(name, NULL) * mallctl_int64("arenas.page", NULL) >= _live(arena));
+	dump_arena_mem();
+
+	skynet_handle_retire(handle);
+	test_dispatch();
+	CHECK(_live(arena) >= 1000);	// 还有存活的块，没有 destroy
+
+	skynet_free(kept);
+	// 下一次建立 arena 时 destroy 旧的，jemalloc 重用它的编号
+	ctx = skynet_context_new("arena", NULL);
+	CHECK(ctx);
+	r = skynet_command(ctx, "ARENA", NULL);
+	CHECK(r && strtol(r, NULL, 10) == arena);
+	skynet_handle_retire(skynet_context_handle(ctx));
+	test_dispatch();
+
+	printf("test_arena ok\n");
+	return 0;
+}
@@ -0,0 +1,77 @@
+// 批量回调返回 n 、1 和 0 时消息的释放和重新投递
+
+#include "testutil.h"
+
+#include <string.h>
+
+#define COUNT 10
+
+static int mode = 0; // 回调返回的值，-1 表示返回 n
+static int calls = 0;
+static int delivered = 0;
+static int next_session = 1;
+
+static int
+_batch(struct skynet_context * context, void *ud, struct skynet_batch_item * msgs, int n) {
+	++calls;
+	int i;
+	for (i=0;i<n;i++) {
+		CHECK(msgs[i].type == PTYPE_TEXT);
+		CHECK(msgs[i].sz == 7 && memcmp(msgs[i].msg, "message", 7) == 0);
+	}
+	if (mode == 0) {
+		return 0;
+	}
+	// 没有消费的消息留在队列头，下次按顺序重新投递
+	CHECK(msgs[0].session == next_session);
+	int consumed = mode < 0 ? n : mode;
+	for (i=0;i<consumed;i++) {
+		CHECK(msgs[i].session == next_session);
+		++next_session;
+		++delivered;
+	}
+	return consumed;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback_batch(ctx, NULL, _batch);
+	return 0;
+}
+
+static void
+_run(int m) {
+	struct skynet_context * ctx = skynet_context_new("batch", NULL);
+	CHECK(ctx != NULL);
+	uint32_t handle = skynet_context_handle(ctx);
+	mode = m;
+	calls = delivered = 0;
+	next_session = 1;
+	int i;
+	for (i=1;i<=COUNT;i++) {
+		skynet_send(NULL, 0x42, handle, PTYPE_TEXT, i, "message", 7);
+	}
+	test_dispatch();
+	if (m == 0) {
+		// 违反约定：服务被杀掉，不再调度，消息在丢弃队列时释放一次
+		CHECK(calls == 1);
+		CHECK(delivered == 0);
+		CHECK(skynet_handle_grab(handle) == NULL);
+	} else {
+		CHECK(delivered == COUNT);
+		CHECK(calls == (m < 0 ? 1 : COUNT));
+		skynet_command(ctx, "EXIT", NULL);
+	}
+	CHECK(skynet_context_total() == 0);
+}
+
+int
+main() {
+	test_init();
+	test_module("batch", _init, NULL);
+	_run(-1);
+	_run(1);
+	_run(0);
+	printf("test_batch ok\n");
+	return 0;
+}
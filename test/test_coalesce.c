@@ -0,0 +1,159 @@
+// 合并发送，一轮内的小包合成一次 write ，大包单独 write ，大小包混合时顺序不变，关闭前写出合并缓冲中的数据
+
+#include "testutil.h"
+#include "socket_server.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define SMALL 1000
+#define STREAM (1024 * 1024)
+
+static struct socket_server * SS;
+
+// 在本线程中 poll 到 bind 完成，之后才能向它发送
+static int
+_bind(int fd) {
+	int id = socket_server_bind(SS, 0, fd);
+	struct socket_message r;
+	CHECK(socket_server_poll(SS, &r, NULL) == SOCKET_OPEN);
+	CHECK(r.id == id);
+	return id;
+}
+
+static void *
+_poll(void *ud) {
+	struct socket_message r;
+	for (;;) {
+		int type = socket_server_poll(SS, &r, NULL);
+		if (type == SOCKET_EXIT)
+			return NULL;
+		if (type == SOCKET_DATA)
+			skynet_free(r.data);
+	}
+}
+
+static void
+_send(int id, int from, int sz) {
+	unsigned char * buf = skynet_malloc(sz);
+	int i;
+	for (i=0;i<sz;i++) {
+		buf[i] = (unsigned char)(from + i);
+	}
+	CHECK(socket_server_send(SS, id, buf, sz) >= 0);
+}
+
+// SOCK_SEQPACKET 的每次 write 是一条记录，读到的记录数就是 write 的次数，record 中是每条记录的长度
+static int
+_records(int enable, const int * size, int count, int * record) {
+	int fd[2];
+	CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd) == 0);
+	SS = socket_server_create(1, 0);
+	int id = _bind(fd[0]);
+	socket_server_coalesce(SS, id, enable);
+	// poll 线程开始前排好所有请求，它们在同一轮里处理
+	int i;
+	int expect = 0;
+	for (i=0;i<count;i++) {
+		_send(id, expect, size[i]);
+		expect += size[i];
+	}
+	pthread_t pid;
+	CHECK(pthread_create(&pid, NULL, _poll, NULL) == 0);
+	int n = 0;
+	int total = 0;
+	unsigned char buf[65536];
+	while (total < expect) {
+		int sz = read(fd[1], buf, sizeof(buf));
+		CHECK(sz > 0);
+		for (i=0;i<sz;i++) {
+			CHECK(buf[i] == (unsigned char)(total + i));
+		}
+		total += sz;
+		if (record) {
+			record[n] = sz;
+		}
+		++n;
+	}
+	CHECK(total == expect);
+	socket_server_exit(SS);
+	pthread_join(pid, NULL);
+	socket_server_release(SS);
+	close(fd[0]);
+	close(fd[1]);
+	return n;
+}
+
+static int expect = 0;
+
+static void *
+_read(void *ud) {
+	int fd = (int)(intptr_t)ud;
+	unsigned char buf[8192];
+	int total = 0;
+	while (total < expect) {
+		int sz = read(fd, buf, sizeof(buf));
+		CHECK(sz > 0);
+		int i;
+		for (i=0;i<sz;i++) {
+			CHECK(buf[i] == (unsigned char)(total + i));
+		}
+		total += sz;
+	}
+	return NULL;
+}
+
+// 小包、放不下的包、超过合并缓冲的大包交替发送，最后立即关闭，合并缓冲中的数据也要写出
+// bind 的 fd 关闭时不会 close ，所以读够字节数为止
+static void
+test_order(void) {
+	int fd[2];
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+	SS = socket_server_create(1, 0);
+	int id = _bind(fd[0]);
+	socket_server_coalesce(SS, id, 1);
+	static const int size[] = { 1, 7, 100, 3000, 2000, 5000, 64, 4096, 13, 9000 };
+	int i = 0;
+	while (expect < STREAM) {
+		int sz = size[i++ % (sizeof(size) / sizeof(size[0]))];
+		_send(id, expect, sz);
+		expect += sz;
+	}
+	pthread_t pid, reader;
+	CHECK(pthread_create(&reader, NULL, _read, (void *)(intptr_t)fd[1]) == 0);
+	CHECK(pthread_create(&pid, NULL, _poll, NULL) == 0);
+	socket_server_close(SS, 0, id);
+	pthread_join(reader, NULL);
+	socket_server_exit(SS);
+	pthread_join(pid, NULL);
+	socket_server_release(SS);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+int
+main() {
+	test_init();
+	// 数据由这里用 skynet_free 释放，发送的缓冲用 skynet_malloc 分配
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	int small[SMALL];
+	int i;
+	for (i=0;i<SMALL;i++) {
+		small[i] = 8;
+	}
+	int coalesced = _records(1, small, SMALL, NULL);
+	int plain = _records(0, small, SMALL, NULL);
+	// 8000 字节放进 4096 字节的合并缓冲，最多写 3 次
+	CHECK(coalesced <= 3);
+	CHECK(plain > 100);
+	// 超过 512 字节的包不拷进合并缓冲，前面合并的数据先写出
+	static const int mixed[] = { 8, 8, 1000, 8 };
+	int record[4];
+	CHECK(_records(1, mixed, 4, record) == 3);
+	CHECK(record[0] == 16 && record[1] == 1000 && record[2] == 8);
+	test_order();
+	printf("test_coalesce ok\n");
+	return 0;
+}
@@ -0,0 +1,98 @@
+// skynet_command 的完美哈希表，每个命令都找到自己的处理函数，相近的名字找不到
+
+#include "testutil.h"
+
+#include <string.h>
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+static int
+_isnumber(const char * s) {
+	if (s == NULL || *s == '\0')
+		return 0;
+	for (;*s;s++) {
+		if (*s < '0' || *s > '9')
+			return 0;
+	}
+	return 1;
+}
+
+int
+main() {
+	test_init();
+	test_module("cmd", _init, NULL);
+	struct skynet_context * ctx = skynet_context_new("cmd", NULL);
+	CHECK(ctx != NULL);
+	uint32_t handle = skynet_context_handle(ctx);
+	char self[16];
+	sprintf(self, ":%x", handle);
+
+	// 不存在或相近的名字
+	const char * unknown[] = { "", "NOWX", "now", "NO", "TIMEOUTS", "XREG", "INLINE", "HEAPPRO", NULL };
+	int i;
+	for (i=0;unknown[i];i++) {
+		CHECK(skynet_command(ctx, unknown[i], "") == NULL);
+	}
+
+	CHECK(strcmp(skynet_command(ctx, "REG", NULL), self) == 0);
+	CHECK(strcmp(skynet_command(ctx, "REG", ".cmd"), "cmd") == 0);
+	CHECK(strcmp(skynet_command(ctx, "QUERY", ".cmd"), self) == 0);
+	CHECK(strcmp(skynet_command(ctx, "QUERY", ".nobody"), ":0") == 0);
+	CHECK(skynet_command_query(ctx, ".cmd") == handle);
+	char param[32];
+	sprintf(param, ".alias %s", self);
+	CHECK(strcmp(skynet_command(ctx, "NAME", param), "alias") == 0);
+	CHECK(skynet_command_query(ctx, ".alias") == handle);
+
+	CHECK(_isnumber(skynet_command(ctx, "NOW", NULL)));
+	CHECK(_isnumber(skynet_command(ctx, "STARTTIME", NULL)));
+	CHECK(strcmp(skynet_command(ctx, "TIMEOUT", "100"), "1") == 0);
+	CHECK(skynet_command_timeout(ctx, 100) == 2);
+	CHECK(strcmp(skynet_command(ctx, "MQLEN", NULL), "0") == 0);
+	CHECK(skynet_command_mqlen(ctx) == 0);
+	CHECK(strcmp(skynet_command(ctx, "PENDING", NULL), "0 0") == 0);
+	CHECK(_isnumber(skynet_command(ctx, "MEMLIMIT", "")));
+	CHECK(_isnumber(skynet_command(ctx, "MEMLIMIT", NULL)));
+
+	CHECK(skynet_command(ctx, "SETENV", "answer 42") == NULL);
+	CHECK(strcmp(skynet_command(ctx, "GETENV", "answer"), "42") == 0);
+
+	CHECK(skynet_command(ctx, "ENDLESS", NULL) == NULL);
+	skynet_context_endless(handle);
+	CHECK(strcmp(skynet_command(ctx, "ENDLESS", NULL), "1") == 0);
+	CHECK(skynet_command(ctx, "MONITOR", "") == NULL);
+	CHECK(skynet_command(ctx, "MONITOR", self) == NULL);
+	CHECK(strcmp(skynet_command(ctx, "MONITOR", ""), self) == 0);
+	CHECK(skynet_command(ctx, "MONITOR", ":0") == NULL);
+
+	CHECK(skynet_command(ctx, "LOCK", NULL) == NULL);
+	CHECK(skynet_command(ctx, "UNLOCK", NULL) == NULL);
+	CHECK(skynet_command(ctx, "SHARED", "1") == NULL);
+	CHECK(skynet_command(ctx, "TRACE", NULL) == NULL);
+	CHECK(skynet_command(ctx, "HEAPPROF", NULL) == NULL);
+	CHECK(skynet_command(ctx, "KILL", "nobody") == NULL);
+
+	const char * r = skynet_command(ctx, "LAUNCH", "cmd");
+	CHECK(r && r[0] == ':');
+	char other[16];
+	strcpy(other, r);
+	CHECK(skynet_command(ctx, "LAUNCH", "nomodule") == NULL);
+	CHECK(skynet_context_total() == 2);
+	CHECK(skynet_command(ctx, "KILL", other) == NULL);
+	CHECK(skynet_context_total() == 1);
+	CHECK(skynet_command(ctx, "EXIT", NULL) == NULL);
+	CHECK(skynet_context_total() == 0);
+	CHECK(skynet_command(NULL, "ABORT", NULL) == NULL);
+
+	printf("test_command ok\n");
+	return 0;
+}
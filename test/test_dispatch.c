@@ -0,0 +1,59 @@
+// 调度通过消息队列保存的 Context 找到服务，服务退出后队列中的消息被丢弃
+
+#include "testutil.h"
+
+#include <string.h>
+
+static int received = 0;
+static int last_session = 0;
+static uint32_t last_source = 0;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	CHECK(type == PTYPE_TEXT);
+	CHECK(sz == 5 && memcmp(msg, "hello", 5) == 0);
+	// 同一来源的消息按顺序到达
+	CHECK(session == last_session + 1);
+	last_session = session;
+	last_source = source;
+	++received;
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	test_init();
+	test_module("echo", _init, NULL);
+
+	struct skynet_context * ctx = skynet_context_new("echo", NULL);
+	CHECK(ctx != NULL);
+	uint32_t handle = skynet_context_handle(ctx);
+
+	int i;
+	for (i=1;i<=100;i++) {
+		CHECK(skynet_send(ctx, 0x42, handle, PTYPE_TEXT, i, "hello", 5) == i);
+	}
+	test_dispatch();
+	CHECK(received == 100);
+	CHECK(last_source == 0x42);
+
+	// 退出后句柄失效，还在队列中的消息由工作线程丢弃，不再调度到服务
+	for (i=101;i<=110;i++) {
+		skynet_send(ctx, 0x42, handle, PTYPE_TEXT, i, "hello", 5);
+	}
+	skynet_command(ctx, "EXIT", NULL);
+	CHECK(skynet_handle_grab(handle) == NULL);
+	CHECK(skynet_send(NULL, 0x42, handle, PTYPE_TEXT, 0, "hello", 5) == -1);
+	test_dispatch();
+	CHECK(received == 100);
+	CHECK(skynet_context_total() == 0);
+
+	printf("test_dispatch ok\n");
+	return 0;
+}
@@ -0,0 +1,155 @@
+// 分包模式的边界：长度为 0 的包、被拆开的包头、正好等于上限的包，
+// 超过上限的包头报告 SOCKET_ERROR 并关闭 socket ，不会按包头的长度分配内存
+
+#include "testutil.h"
+#include "socket_server.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define STREAM_MAX (128 * 1024)
+
+static struct socket_server * SS;
+
+struct stream {
+	int fd;
+	int sz;
+	unsigned char data[STREAM_MAX];
+};
+
+static void
+_frame(struct stream *st, int header, uint32_t sz) {
+	int i;
+	for (i=header-1;i>=0;i--) {
+		st->data[st->sz++] = (unsigned char)(sz >> (i * 8));
+	}
+	uint32_t j;
+	for (j=0;j<sz;j++) {
+		st->data[st->sz++] = (unsigned char)(j * 7 + sz);
+	}
+}
+
+// 一次写一个字节，包头和包体都会被拆到多次读中
+static void *
+_write(void *ud) {
+	struct stream * st = ud;
+	int i;
+	for (i=0;i<st->sz;i++) {
+		CHECK(write(st->fd, st->data + i, 1) == 1);
+	}
+	return NULL;
+}
+
+static int
+_open(int fd[2], int header, int max) {
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == 0);
+	int id = socket_server_bind(SS, 0, fd[0]);
+	socket_server_start_frame(SS, 0, id, header, max);
+	struct socket_message r;
+	CHECK(socket_server_poll(SS, &r, NULL) == SOCKET_OPEN);
+	CHECK(r.id == id);
+	return id;
+}
+
+static void
+_expect_data(int id, uint32_t sz) {
+	struct socket_message r;
+	int type = socket_server_poll(SS, &r, NULL);
+	CHECK(type == SOCKET_DATA);
+	CHECK(r.id == id);
+	CHECK(r.ud == (int)sz);
+	CHECK(r.data != NULL);
+	uint32_t i;
+	for (i=0;i<sz;i++) {
+		CHECK((unsigned char)r.data[i] == (unsigned char)(i * 7 + sz));
+	}
+	skynet_free(r.data);
+}
+
+static void
+_expect(int id, int type) {
+	struct socket_message r;
+	CHECK(socket_server_poll(SS, &r, NULL) == type);
+	CHECK(r.id == id);
+}
+
+static void
+test_zero(void) {
+	static struct stream st;
+	static const uint32_t size[] = { 0, 1, 0, 0, 300, 0, 65535, 0 };
+	int n = sizeof(size) / sizeof(size[0]);
+	int fd[2];
+	int id = _open(fd, 2, 0);
+	int i;
+	st.sz = 0;
+	for (i=0;i<n;i++) {
+		_frame(&st, 2, size[i]);
+	}
+	st.fd = fd[1];
+	pthread_t pid;
+	CHECK(pthread_create(&pid, NULL, _write, &st) == 0);
+	for (i=0;i<n;i++) {
+		_expect_data(id, size[i]);
+	}
+	pthread_join(pid, NULL);
+
+	// 最后一个包长度为 0 ，之后对端关闭，先收到包再收到关闭
+	st.sz = 0;
+	_frame(&st, 2, 0);
+	CHECK(write(fd[1], st.data, st.sz) == st.sz);
+	shutdown(fd[1], SHUT_WR);
+	_expect_data(id, 0);
+	_expect(id, SOCKET_CLOSE);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+static void
+test_oversize(int max, uint32_t sz) {
+	static struct stream st;
+	int fd[2];
+	int id = _open(fd, 4, max);
+	st.sz = 0;
+	_frame(&st, 4, 10);
+	if (max > 0) {
+		_frame(&st, 4, max);
+	}
+	// 只写包头，包体不会到来
+	int i;
+	for (i=3;i>=0;i--) {
+		st.data[st.sz++] = (unsigned char)(sz >> (i * 8));
+	}
+	st.fd = fd[1];
+	pthread_t pid;
+	CHECK(pthread_create(&pid, NULL, _write, &st) == 0);
+	_expect_data(id, 10);
+	if (max > 0) {
+		_expect_data(id, max);
+	}
+	_expect(id, SOCKET_ERROR);
+	pthread_join(pid, NULL);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+int
+main() {
+	test_init();
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	int edge;
+	// 边沿触发时数据和 FIN 常在同一次通知里，关闭也不能丢
+	for (edge=0;edge<=1;edge++) {
+		SS = socket_server_create(1, 0);
+		socket_server_edge(SS, edge);
+		test_zero();
+		test_oversize(1000, 1001);
+		// 默认上限是 16M ，4G 的包头不能去分配
+		test_oversize(0, 0xffffffff);
+		test_oversize(0, 16 * 1024 * 1024 + 1);
+		socket_server_release(SS);
+	}
+	printf("test_frame ok\n");
+	return 0;
+}
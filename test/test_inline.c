@@ -0,0 +1,74 @@
+// 小于 MESSAGE_INLINE_SIZE 的消息存放在队列的附加部分中，队列展开后内容和顺序不变，
+// 返回函数保留的内联消息不会被后面的消息覆盖
+
+#include "testutil.h"
+#include "skynet_mq.h"
+
+#include <string.h>
+
+#define COUNT 300 // 超过初始的队列大小，压入时会展开队列
+#define KEEP 7 // 每隔几条消息保留一条
+
+static int received = 0;
+static char * kept[COUNT+1];
+
+static void
+_fill(char * buf, int sz, int seq) {
+	int i;
+	for (i=0;i<sz;i++) {
+		buf[i] = (char)(seq + i);
+	}
+}
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	char tmp[64];
+	CHECK(session == received + 1);
+	CHECK(sz == (size_t)(session % 48));
+	_fill(tmp, sz, session);
+	CHECK(memcmp(msg, tmp, sz) == 0);
+	CHECK(((const char *)msg)[sz] == '\0');
+	++received;
+	if (session % KEEP == 0) {
+		kept[session] = (char *)msg;
+		return 1;
+	}
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	test_init();
+	test_module("inline", _init, NULL);
+	struct skynet_context * ctx = skynet_context_new("inline", NULL);
+	CHECK(ctx != NULL);
+	uint32_t handle = skynet_context_handle(ctx);
+	received = 0;
+	int i;
+	char tmp[64];
+	for (i=1;i<=COUNT;i++) {
+		// 长度 0 到 47 ，跨过内联的上限，混合内联和复制的消息
+		int sz = i % 48;
+		_fill(tmp, sz, i);
+		CHECK(skynet_send(NULL, 0x42, handle, PTYPE_TEXT, i, tmp, sz) == i);
+	}
+	CHECK(skynet_command_mqlen(ctx) == COUNT);
+	test_dispatch();
+	CHECK(received == COUNT);
+	for (i=KEEP;i<=COUNT;i+=KEEP) {
+		// 保留的消息由服务释放，内容没有被之后调度的消息改写
+		int sz = i % 48;
+		_fill(tmp, sz, i);
+		CHECK(memcmp(kept[i], tmp, sz) == 0 && kept[i][sz] == '\0');
+		skynet_free(kept[i]);
+	}
+	skynet_command(ctx, "EXIT", NULL);
+	printf("test_inline ok\n");
+	return 0;
+}
@@ -0,0 +1,117 @@
+// lua 的小对象池，跨大小类的 realloc 保留内容，按整块计入服务，删除池后全部还回去，硬上限时返回 NULL
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <string.h>
+
+#define OBJECTS 10000
+#define CHUNK (16 * 1024)
+
+static void * objs[OBJECTS];
+static size_t size[OBJECTS];
+
+static void
+_fill(void *p, size_t sz, int v) {
+	memset(p, v & 0xff, sz);
+}
+
+static int
+_check(const void *p, size_t sz, int v) {
+	const unsigned char * c = p;
+	size_t i;
+	for (i=0;i<sz;i++) {
+		if (c[i] != (v & 0xff))
+			return 0;
+	}
+	return 1;
+}
+
+int
+main() {
+	test_init();
+	struct memory_stat * stat = malloc_stat_open(1);
+	struct memory_stat * last = malloc_bind(stat);
+	size_t used = malloc_used_memory();
+
+	struct skynet_lpool * pool = skynet_lpool_new();
+	ssize_t base = stat->allocated;
+	int i;
+	// lua 分配新对象时 ptr 为空，osize 是对象的类型
+	for (i=0;i<OBJECTS;i++) {
+		size[i] = 1 + i % 128;
+		objs[i] = skynet_lalloc(pool, NULL, 5, size[i]);
+		CHECK(objs[i]);
+		_fill(objs[i], size[i], i);
+	}
+	// 按整块计入，而不是每个对象，对象没有块头
+	ssize_t charged = stat->allocated - base;
+	size_t total = 0;
+	for (i=0;i<OBJECTS;i++) {
+		total += (size[i] + 7) & ~7;
+	}
+	CHECK(charged >= (ssize_t)total);
+	CHECK(charged < (ssize_t)(total + total / 8 + CHUNK));
+
+	// 在池中换大小类、从池中长到池外、再缩回池中，内容都保留
+	for (i=0;i<OBJECTS;i++) {
+		size_t nsize = (i % 3 == 0) ? 64 + i % 200 : size[i] / 2 + 1;
+		objs[i] = skynet_lalloc(pool, objs[i], size[i], nsize);
+		CHECK(objs[i]);
+		CHECK(_check(objs[i], size[i] < nsize ? size[i] : nsize, i));
+		size[i] = nsize;
+		_fill(objs[i], size[i], i + 1);
+	}
+	for (i=0;i<OBJECTS;i++) {
+		objs[i] = skynet_lalloc(pool, objs[i], size[i], 8);
+		CHECK(_check(objs[i], size[i] < 8 ? size[i] : 8, i + 1));
+		size[i] = 8;
+	}
+
+	// 释放的块会被再次使用，池不再增长
+	for (i=0;i<OBJECTS;i++) {
+		CHECK(skynet_lalloc(pool, objs[i], size[i], 0) == NULL);
+	}
+	ssize_t before = stat->allocated;
+	for (i=0;i<OBJECTS;i++) {
+		objs[i] = skynet_lalloc(pool, NULL, 0, 8);
+	}
+	CHECK(stat->allocated == before);
+	for (i=0;i<OBJECTS;i++) {
+		skynet_lalloc(pool, objs[i], 8, 0);
+	}
+
+	// 超过硬上限时池也不再申请新块，让 lua 报内存不足
+	stat->hard = stat->allocated;
+	int limit = malloc_limit(1);
+	int refused = stat->refused;
+	void * p = NULL;
+	for (i=0;i<CHUNK;i++) {
+		p = skynet_lalloc(pool, NULL, 0, 128);
+		if (p == NULL)
+			break;
+	}
+	CHECK(p == NULL);
+	CHECK(stat->refused == refused + 1);
+	CHECK(skynet_lalloc(pool, NULL, 0, 1024) == NULL);
+	malloc_limit(limit);
+	stat->hard = 0;
+
+	// lua_close 之后删除池，一次全部还回去
+	skynet_lpool_delete(pool);
+	CHECK(stat->allocated == 0);
+	malloc_bind(last);
+	malloc_stat_close(stat);
+	CHECK(malloc_used_memory() == used);
+
+	// 不使用池时都转给 skynet_realloc
+	p = skynet_lalloc(NULL, NULL, 0, 16);
+	CHECK(p);
+	p = skynet_lalloc(NULL, p, 16, 4096);
+	CHECK(p);
+	skynet_lalloc(NULL, p, 4096, 0);
+	CHECK(malloc_used_memory() == used);
+
+	printf("test_lalloc ok\n");
+	return 0;
+}
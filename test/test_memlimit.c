@@ -0,0 +1,86 @@
+// 越过硬上限后服务自己的分配失败，框架内部的分配不受影响，调度后服务收到 MEMLIMIT
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <string.h>
+
+#define HARD (64 * 1024)
+
+static int refused = 0;
+static int sendfail = 0;
+static int timeout = 0;
+static char notice[64];
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	if (type == PTYPE_SYSTEM) {
+		CHECK(sz < sizeof(notice));
+		memcpy(notice, msg, sz);
+		notice[sz] = '\0';
+		return 0;
+	}
+	if (type != PTYPE_TEXT)
+		return 0;
+	void * small = skynet_malloc(1024);
+	CHECK(small);
+	if (skynet_malloc(HARD) == NULL)
+		++refused;
+	CHECK(skynet_realloc(small, HARD) == NULL);	// 失败时原来的块不变
+	static char big[HARD];
+	if (skynet_send(context, 0, skynet_context_handle(context), PTYPE_RESPONSE, 0, big, sizeof(big)) < 0)
+		++sendfail;
+	// 定时器等框架内部的分配不受限制
+	if (skynet_command(context, "TIMEOUT", "0"))
+		++timeout;
+	skynet_free(small);
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	test_init();
+	test_module("memlimit", _init, NULL);
+	struct skynet_context * ctx = skynet_context_new("memlimit", NULL);
+	CHECK(ctx);
+	char param[64];
+	sprintf(param, "0 %d", HARD);
+	skynet_command(ctx, "MEMLIMIT", param);
+	uint32_t handle = skynet_context_handle(ctx);
+
+	// 不在服务的回调中时不检查
+	struct memory_stat * last = malloc_bind(NULL);
+	void * p = skynet_malloc(HARD);
+	CHECK(p);
+	skynet_free(p);
+	malloc_bind(last);
+
+	skynet_send(NULL, handle, handle, PTYPE_TEXT, 0, "go", 2);
+	test_dispatch();
+	CHECK(refused == 1);
+	CHECK(sendfail == 1);
+	CHECK(timeout == 1);
+	ssize_t allocated, hard;
+	int n;
+	CHECK(sscanf(notice, "MEMLIMIT %zd %zd %d", &allocated, &hard, &n) == 3);
+	CHECK(hard == HARD);
+	CHECK(n == 3);
+
+	// 每秒最多通知一次
+	notice[0] = '\0';
+	skynet_send(NULL, handle, handle, PTYPE_TEXT, 0, "go", 2);
+	test_dispatch();
+	CHECK(refused == 2);
+	CHECK(notice[0] == '\0');
+
+	skynet_handle_retire(handle);
+	test_dispatch();
+	printf("test_memlimit ok\n");
+	return 0;
+}
@@ -0,0 +1,96 @@
+// 分片的内存计数在多线程分配、跨线程释放后能正确汇总；服务的计数放在 Context 中
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 80	// 多于分片数，最后一片被多个线程共用
+#define BLOCKS 1000
+
+static void * blocks[THREADS][BLOCKS];
+
+static void *
+_alloc(void *ud) {
+	void ** b = ud;
+	int i;
+	for (i=0;i<BLOCKS;i++) {
+		b[i] = skynet_malloc(16 + i % 64);
+		// 一半自己释放，另一半留给主线程
+		if (i & 1) {
+			skynet_free(b[i]);
+			b[i] = NULL;
+		}
+	}
+	return NULL;
+}
+
+static void * kept = NULL;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	kept = skynet_malloc(10000);
+	return 0;
+}
+
+static ssize_t
+_allocated(struct skynet_context *ctx) {
+	return strtoll(skynet_command(ctx, "MEMLIMIT", ""), NULL, 10);
+}
+
+int
+main() {
+	test_init();
+	test_module("memory", _init, NULL);
+
+	size_t used = malloc_used_memory();
+	size_t block = malloc_memory_block();
+	pthread_t pid[THREADS];
+	int i, j;
+	for (i=0;i<THREADS;i++) {
+		pthread_create(&pid[i], NULL, _alloc, blocks[i]);
+	}
+	for (i=0;i<THREADS;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	CHECK(malloc_memory_block() == block + THREADS * BLOCKS / 2);
+	CHECK(malloc_used_memory() >= used + THREADS * BLOCKS / 2 * 16);
+	for (i=0;i<THREADS;i++) {
+		for (j=0;j<BLOCKS;j++) {
+			skynet_free(blocks[i][j]);
+		}
+	}
+	CHECK(malloc_memory_block() == block);
+	CHECK(malloc_used_memory() == used);
+
+	// '_init' 中的分配算在服务上，在其它线程释放时从服务中扣除
+	struct skynet_context * ctx = skynet_context_new("memory", NULL);
+	CHECK(ctx);
+	ssize_t base = _allocated(ctx);
+	CHECK(base >= 10000);
+	skynet_free(kept);
+	CHECK(_allocated(ctx) <= base - 10000);
+
+	// 服务退出后释放它分配的内存，不再计入任何服务，总数仍然正确
+	kept = NULL;
+	uint32_t handle = skynet_context_handle(ctx);
+	struct skynet_context * ctx2 = skynet_context_new("memory", NULL);
+	CHECK(ctx2);
+	void * orphan = kept;
+	skynet_handle_retire(handle);
+	skynet_handle_retire(skynet_context_handle(ctx2));
+	test_dispatch();
+	size_t before = malloc_used_memory();
+	skynet_free(orphan);
+	CHECK(malloc_used_memory() < before);
+
+	printf("test_memory ok\n");
+	return 0;
+}
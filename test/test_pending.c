@@ -0,0 +1,66 @@
+// 等待回应的调用只由被调用的服务的回应完成，超时后收到被调用服务发来的 PTYPE_RESERVED_ERROR
+
+#include "testutil.h"
+#include "skynet_timer.h"
+
+#include <unistd.h>
+
+static int last_type = -1;
+static int last_session = 0;
+static uint32_t last_source = 0;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	last_type = type;
+	last_session = session;
+	last_source = source;
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	test_init();
+	test_module("pending", _init, NULL);
+	struct skynet_context * ctx = skynet_context_new("pending", NULL);
+	CHECK(ctx != NULL);
+	uint32_t self = skynet_context_handle(ctx);
+	uint32_t callee = 0x100;
+	uint32_t other = 0x200;
+
+	skynet_pending_add(ctx, callee, 5, 1000);
+	CHECK(skynet_pending_stat(ctx, NULL) == 1);
+
+	// 其他服务用同一个会话发来的回应不能完成调用
+	skynet_send(NULL, other, self, PTYPE_RESPONSE, 5, NULL, 0);
+	skynet_send(NULL, other, self, PTYPE_RESERVED_ERROR, 5, NULL, 0);
+	test_dispatch();
+	CHECK(last_session == 5 && last_source == other);
+	CHECK(skynet_pending_stat(ctx, NULL) == 1);
+
+	skynet_send(NULL, callee, self, PTYPE_RESPONSE, 5, NULL, 0);
+	test_dispatch();
+	CHECK(last_type == PTYPE_RESPONSE && last_source == callee);
+	CHECK(skynet_pending_stat(ctx, NULL) == 0);
+
+	// 没有回应的调用到期后收到以被调用服务为来源的错误
+	skynet_pending_add(ctx, callee, 6, 1);
+	last_type = -1;
+	int i;
+	for (i=0;i<50 && last_type == -1;i++) {
+		usleep(10000);
+		skynet_updatetime();
+		test_dispatch();
+	}
+	CHECK(last_type == PTYPE_RESERVED_ERROR);
+	CHECK(last_session == 6 && last_source == callee);
+	CHECK(skynet_pending_stat(ctx, NULL) == 0);
+
+	printf("test_pending ok\n");
+	return 0;
+}
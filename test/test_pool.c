@@ -0,0 +1,58 @@
+// 池后端的 calloc 检查溢出，chunk 中的块全部释放后还给系统
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define BLOCKS 100000
+
+// 测试用 AddressSanitizer 编译，用它统计向系统申请的内存
+size_t __sanitizer_get_current_allocated_bytes(void);
+
+static void * blocks[BLOCKS];
+
+int
+main() {
+	test_init();
+	CHECK(malloc_set_backend("pool") == 0);
+
+	CHECK(skynet_calloc(SIZE_MAX / 2, 4) == NULL);
+	CHECK(skynet_calloc(4, SIZE_MAX / 2) == NULL);
+	char * p = skynet_calloc(10, 10);
+	CHECK(p);
+	int i;
+	for (i=0;i<100;i++) {
+		CHECK(p[i] == 0);
+	}
+	skynet_free(p);
+
+	// 约 100 个 64K 的 chunk
+	size_t base = __sanitizer_get_current_allocated_bytes();
+	for (i=0;i<BLOCKS;i++) {
+		blocks[i] = skynet_malloc(40);
+		memset(blocks[i], 0xff, 40);
+	}
+	size_t peak = __sanitizer_get_current_allocated_bytes();
+	CHECK(peak - base >= BLOCKS * 64);
+	for (i=0;i<BLOCKS;i++) {
+		skynet_free(blocks[i]);
+	}
+	// 留下线程缓存中的块所在的 chunk 和一个备用的 chunk
+	size_t left = __sanitizer_get_current_allocated_bytes();
+	CHECK(left - base <= 4 * 64 * 1024);
+
+	// 还回去的 chunk 可以再次使用
+	for (i=0;i<BLOCKS;i++) {
+		blocks[i] = skynet_malloc(40);
+	}
+	for (i=0;i<BLOCKS;i++) {
+		skynet_free(blocks[i]);
+	}
+	CHECK(__sanitizer_get_current_allocated_bytes() - base <= 4 * 64 * 1024);
+
+	malloc_set_backend("system");
+	printf("test_pool ok\n");
+	return 0;
+}
@@ -0,0 +1,55 @@
+// 解析出的全部地址交给连接，前面的地址连不上时换下一个，解析线程和缓存都保留整个列表
+
+#include "testutil.h"
+#include "socket_server.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT 18921
+
+static struct socket_server * SS;
+
+static void
+_expect_open(int id) {
+	struct socket_message r;
+	CHECK(socket_server_poll(SS, &r, NULL) == SOCKET_OPEN);
+	CHECK(r.id == id);
+}
+
+int
+main() {
+	test_init();
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	// 只在 IPv4 上监听，::1 上的连接会被拒绝
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CHECK(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	CHECK(listen(listen_fd, 16) == 0);
+
+	SS = socket_server_create(1, 0);
+	// 第一个地址失败后回退到第二个
+	CHECK(socket_server_block_connect(SS, 0, "::1 127.0.0.1", PORT) >= 0);
+	CHECK(socket_server_block_connect(SS, 0, "::1", PORT) < 0);
+
+	// 解析线程交回地址列表，第二次连接命中缓存
+	socket_server_resolver(SS, 1, 60);
+	int id = socket_server_connect(SS, 0, "localhost", PORT);
+	_expect_open(id);
+	id = socket_server_connect(SS, 0, "localhost", PORT);
+	_expect_open(id);
+
+	socket_server_release(SS);
+	close(listen_fd);
+	printf("test_resolve ok\n");
+	return 0;
+}
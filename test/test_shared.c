@@ -0,0 +1,94 @@
+// 共享缓冲发给多个服务，只有设置了 SHARED 的服务收到缓冲本身，调度后引用全部释放
+
+#include "testutil.h"
+#include "malloc_hook.h"
+
+#include <string.h>
+
+#define PAYLOAD 4096
+#define FANOUT 8
+
+static const void * shared = NULL;
+static int same = 0;
+static int copied = 0;
+static int kept = 0;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	CHECK(type == PTYPE_TEXT);
+	CHECK(sz == PAYLOAD);
+	const char * data = msg;
+	CHECK(data[0] == 'x' && data[PAYLOAD-1] == 'x' && data[PAYLOAD] == '\0');
+	if (msg == shared) {
+		++same;
+	} else {
+		++copied;
+	}
+	if (ud) {
+		// 没有设置 SHARED 的服务按普通消息保留并自己释放
+		++kept;
+		skynet_free((void *)msg);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	int plain = parm && strcmp(parm, "plain") == 0;
+	int keep = parm && strcmp(parm, "keep") == 0;
+	if (!plain && !keep) {
+		skynet_command(ctx, "SHARED", NULL);
+	}
+	skynet_callback(ctx, keep ? (void *)ctx : NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	test_init();
+	test_module("shared", _init, NULL);
+
+	uint32_t handle[FANOUT];
+	int i;
+	for (i=0;i<FANOUT;i++) {
+		const char * parm = i == 0 ? "plain" : (i == 1 ? "keep" : NULL);
+		struct skynet_context * ctx = skynet_context_new("shared", parm);
+		CHECK(ctx != NULL);
+		handle[i] = skynet_context_handle(ctx);
+	}
+
+	// 第一轮让接收方的队列分配好附加部分，第二轮检查内存是否回到发送前
+	size_t before = 0;
+	int round;
+	for (round=0;round<2;round++) {
+		before = malloc_used_memory();
+		same = copied = kept = 0;
+		char * data = skynet_shared_new(PAYLOAD);
+		memset(data, 'x', PAYLOAD);
+		shared = data;
+		CHECK(malloc_used_memory() > before);
+		for (i=0;i<FANOUT;i++) {
+			// 每个接收方一个引用，最后一次发送转移创建时的引用
+			if (i < FANOUT-1) {
+				skynet_shared_grab(data);
+			}
+			CHECK(skynet_send(NULL, 0x42, handle[i], PTYPE_TEXT | PTYPE_TAG_SHARED, 0, data, PAYLOAD) == 0);
+		}
+		test_dispatch();
+
+		CHECK(same == FANOUT - 2);
+		CHECK(copied == 2);
+		CHECK(kept == 1);
+	}
+	// 引用计数归零，缓冲和复制的数据都已释放
+	CHECK(malloc_used_memory() == before);
+
+	// 发给不存在的服务时引用也会释放
+	char * data = skynet_shared_new(PAYLOAD);
+	CHECK(skynet_send(NULL, 0x42, 0xffffff, PTYPE_TEXT | PTYPE_TAG_SHARED, 0, data, PAYLOAD) == -1);
+	CHECK(malloc_used_memory() == before);
+
+	printf("test_shared ok\n");
+	return 0;
+}
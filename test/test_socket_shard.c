@@ -0,0 +1,253 @@
+// 分片的 socket server ，id 里带着所属的分片，消息只从所属分片的 poll 线程报告，
+// 多个线程向同一个连接发送时每个线程的数据保持顺序，reuseport 的监听在每个分片上各自 accept
+// 可以用 io_uring 时，用 multishot recv/accept 再测一遍
+
+#include "testutil.h"
+#include "socket_server.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT 18901
+#define NSHARD 4
+#define CONNECT 8
+#define SENDER 4
+#define RECORD 20000
+#define RAW 16
+
+#define OPAQUE_LISTEN 1
+#define OPAQUE_CONNECT 2
+
+static struct socket_server * SS;
+static int accepted = 0;
+static int opened = 0;
+static int connect_id[CONNECT];
+static int wrong_shard = 0;
+static long received = 0;
+static int disorder = 0;
+
+// 只有一个连接收数据，它只在一个 poll 线程上报告，不用加锁
+static unsigned char pending[8];
+static int pending_n = 0;
+static uint32_t next_seq[SENDER];
+
+static void
+_record(const unsigned char *p) {
+	uint32_t sender, seq;
+	memcpy(&sender, p, 4);
+	memcpy(&seq, p+4, 4);
+	if (sender >= SENDER || seq != next_seq[sender]) {
+		__sync_add_and_fetch(&disorder, 1);
+		return;
+	}
+	++next_seq[sender];
+}
+
+static void
+_data(const char *data, int sz) {
+	const unsigned char * p = (const unsigned char *)data;
+	while (sz > 0) {
+		int n = 8 - pending_n;
+		if (n > sz)
+			n = sz;
+		memcpy(pending + pending_n, p, n);
+		pending_n += n;
+		p += n;
+		sz -= n;
+		if (pending_n == 8) {
+			_record(pending);
+			pending_n = 0;
+		}
+	}
+}
+
+static void *
+_poll(void *ud) {
+	int index = (int)(intptr_t)ud;
+	struct socket_server * ss = socket_server_shard(SS, index);
+	struct socket_message r;
+	for (;;) {
+		int type = socket_server_poll(ss, &r, NULL);
+		switch (type) {
+		case SOCKET_EXIT:
+			return NULL;
+		case SOCKET_ACCEPT:
+			// 开启 reuseport 时新连接留在接受它的分片上
+			if (r.opaque == 0 && (r.ud & (NSHARD-1)) != index)
+				__sync_add_and_fetch(&wrong_shard, 1);
+			socket_server_start(SS, OPAQUE_LISTEN, r.ud);
+			__sync_add_and_fetch(&accepted, 1);
+			break;
+		case SOCKET_DATA:
+			if ((r.id & (NSHARD-1)) != index)
+				__sync_add_and_fetch(&wrong_shard, 1);
+			_data(r.data, r.ud);
+			__sync_add_and_fetch(&received, r.ud);
+			skynet_free(r.data);
+			break;
+		case SOCKET_OPEN:
+			if ((r.id & (NSHARD-1)) != index)
+				__sync_add_and_fetch(&wrong_shard, 1);
+			__sync_add_and_fetch(&opened, 1);
+			break;
+		}
+	}
+}
+
+static void *
+_send(void *ud) {
+	uint32_t sender = (uint32_t)(intptr_t)ud;
+	uint32_t seq;
+	for (seq=0;seq<RECORD;seq++) {
+		char * buf = skynet_malloc(8);
+		memcpy(buf, &sender, 4);
+		memcpy(buf+4, &seq, 4);
+		CHECK(socket_server_send(SS, connect_id[0], buf, 8) >= 0);
+	}
+	return NULL;
+}
+
+static void
+_wait(int *value, int expect) {
+	int i;
+	for (i=0;i<1000 && __sync_add_and_fetch(value, 0) < expect;i++) {
+		usleep(5000);
+	}
+	CHECK(*value == expect);
+}
+
+static void
+_start(pthread_t *pid) {
+	int i;
+	for (i=0;i<NSHARD;i++) {
+		CHECK(pthread_create(&pid[i], NULL, _poll, (void *)(intptr_t)i) == 0);
+	}
+}
+
+// io_uring 不可用时返回 0
+static int
+_create(int nshard, int reuseport, int uring) {
+	SS = socket_server_create(nshard, reuseport);
+	CHECK(SS);
+	if (uring && socket_server_uring(SS, 1)) {
+		socket_server_release(SS);
+		return 0;
+	}
+	accepted = 0;
+	opened = 0;
+	wrong_shard = 0;
+	received = 0;
+	disorder = 0;
+	pending_n = 0;
+	memset(next_seq, 0, sizeof(next_seq));
+	return 1;
+}
+
+static void
+_stop(pthread_t *pid) {
+	socket_server_exit(SS);
+	int i;
+	for (i=0;i<NSHARD;i++) {
+		pthread_join(pid[i], NULL);
+	}
+	socket_server_release(SS);
+}
+
+static void
+test_balance(int uring) {
+	if (!_create(NSHARD - 1, 0, uring))
+		return;
+	CHECK(socket_server_nshard(SS) == NSHARD);
+	pthread_t pid[NSHARD];
+	_start(pid);
+
+	int listen_id = socket_server_listen(SS, OPAQUE_LISTEN, "127.0.0.1", PORT, 32);
+	CHECK(listen_id >= 0);
+	socket_server_start(SS, OPAQUE_LISTEN, listen_id);
+	_wait(&opened, 1);
+
+	// 新建的连接轮流放在各个分片上
+	int count[NSHARD] = { 0 };
+	int i;
+	for (i=0;i<CONNECT;i++) {
+		connect_id[i] = socket_server_connect(SS, OPAQUE_CONNECT, "127.0.0.1", PORT);
+		CHECK(connect_id[i] >= 0);
+		++count[connect_id[i] & (NSHARD-1)];
+	}
+	for (i=0;i<NSHARD;i++) {
+		CHECK(count[i] == CONNECT / NSHARD);
+	}
+	_wait(&accepted, CONNECT);
+	_wait(&opened, 1 + CONNECT * 2);
+
+	// 发送转给所属的分片，每个发送线程的数据保持顺序
+	pthread_t sender[SENDER];
+	for (i=0;i<SENDER;i++) {
+		CHECK(pthread_create(&sender[i], NULL, _send, (void *)(intptr_t)i) == 0);
+	}
+	for (i=0;i<SENDER;i++) {
+		pthread_join(sender[i], NULL);
+	}
+	for (i=0;i<1000 && __sync_add_and_fetch(&received, 0) < SENDER * RECORD * 8L;i++) {
+		usleep(5000);
+	}
+	CHECK(received == SENDER * RECORD * 8L);
+	CHECK(disorder == 0);
+	for (i=0;i<SENDER;i++) {
+		CHECK(next_seq[i] == RECORD);
+	}
+	CHECK(wrong_shard == 0);
+	_stop(pid);
+}
+
+static void
+test_reuseport(int uring) {
+	if (!_create(NSHARD, 1, uring))
+		return;
+	pthread_t pid[NSHARD];
+	_start(pid);
+
+	// 每个分片上各有一个监听，只报告一次 id ，start 转给其它分片
+	int listen_id = socket_server_listen(SS, 0, "127.0.0.1", PORT + 1, 32);
+	CHECK(listen_id >= 0);
+	socket_server_start(SS, 0, listen_id);
+	_wait(&opened, 1);
+
+	int fd[RAW];
+	int i;
+	for (i=0;i<RAW;i++) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(PORT + 1);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd[i] = socket(AF_INET, SOCK_STREAM, 0);
+		CHECK(fd[i] >= 0);
+		CHECK(connect(fd[i], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	}
+	_wait(&accepted, RAW);
+	_wait(&opened, 1 + RAW);
+	CHECK(wrong_shard == 0);
+	for (i=0;i<RAW;i++) {
+		close(fd[i]);
+	}
+	_stop(pid);
+}
+
+int
+main() {
+	test_init();
+	// 数据由这里用 skynet_free 释放，发送的缓冲用 skynet_malloc 分配
+	socket_server_allocator(skynet_malloc, skynet_realloc, skynet_free);
+	int uring;
+	for (uring=0;uring<=1;uring++) {
+		test_balance(uring);
+		test_reuseport(uring);
+	}
+	printf("test_socket_shard ok\n");
+	return 0;
+}
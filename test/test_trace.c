@@ -0,0 +1,83 @@
+// 跟踪信息在消息的附加部分中，被跟踪的消息发出的消息继承跟踪，不跟踪的消息大小不变
+
+#include "testutil.h"
+#include "skynet_mq.h"
+#include "skynet_trace.h"
+
+#include <string.h>
+#include <unistd.h>
+
+static uint32_t next_hop = 0;
+static int received = 0;
+
+static int
+_cb(struct skynet_context * context, void *ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	++received;
+	if (ud) {
+		skynet_send(context, 0, *(uint32_t *)ud, PTYPE_TEXT, 0, "hop", 3);
+	}
+	return 0;
+}
+
+static int
+_init(void * inst, struct skynet_context *ctx, const char * parm) {
+	skynet_callback(ctx, parm ? &next_hop : NULL, _cb);
+	return 0;
+}
+
+int
+main() {
+	// 消息本身只有来源、会话、数据和长度
+	CHECK(sizeof(struct skynet_message) == sizeof(void *) + sizeof(size_t) + 8);
+
+	test_init();
+	skynet_trace_init(1);
+	test_module("trace", _init, NULL);
+	struct skynet_context * a = skynet_context_new("trace", "forward");
+	struct skynet_context * b = skynet_context_new("trace", NULL);
+	CHECK(a && b);
+	next_hop = skynet_context_handle(b);
+
+	// 不跟踪的消息不记录 span
+	skynet_send(NULL, 0x42, skynet_context_handle(a), PTYPE_TEXT, 0, "x", 1);
+	test_dispatch();
+	CHECK(received == 2);
+	char filename[] = "/tmp/skynet_trace_XXXXXX";
+	int fd = mkstemp(filename);
+	CHECK(fd >= 0);
+	close(fd);
+	CHECK(skynet_trace_dump(filename) == 0);
+
+	// 入口消息被采样后，a 发给 b 的消息继承同一个跟踪，父 span 是 a 的 span
+	struct skynet_message msg;
+	struct skynet_message_ext ext;
+	msg.source = 0;
+	msg.session = 0;
+	msg.data = NULL;
+	msg.sz = (size_t)PTYPE_TEXT << HANDLE_REMOTE_SHIFT;
+	ext.flag = 0;
+	skynet_trace_sample(&ext);
+	CHECK(ext.flag == MESSAGE_FLAG_TRACE && ext.trace != 0);
+	CHECK(skynet_context_push_ext(skynet_context_handle(a), &msg, &ext) == 0);
+	test_dispatch();
+	CHECK(received == 4);
+	CHECK(skynet_trace_dump(filename) == 2);
+
+	FILE * f = fopen(filename, "r");
+	CHECK(f != NULL);
+	unsigned trace[2], span[2], parent[2], handle[2];
+	int i;
+	for (i=0;i<2;i++) {
+		int type;
+		unsigned wait, cost;
+		CHECK(fscanf(f, "%x %u %u :%x %d %u %u", &trace[i], &span[i], &parent[i], &handle[i], &type, &wait, &cost) == 7);
+	}
+	fclose(f);
+	unlink(filename);
+	CHECK(trace[0] == ext.trace && trace[1] == ext.trace);
+	CHECK(handle[0] == skynet_context_handle(a) && parent[0] == 0);
+	CHECK(handle[1] == skynet_context_handle(b) && parent[1] == span[0]);
+
+	printf("test_trace ok\n");
+	return 0;
+}
@@ -0,0 +1,71 @@
+#include "testutil.h"
+
+#include "skynet_harbor.h"
+#include "skynet_mq.h"
+#include "skynet_timer.h"
+#include "skynet_monitor.h"
+#include "skynet_env.h"
+
+#include <string.h>
+
+// skynet_env.c 依赖 lua ，测试中用一张小表代替
+
+#define ENV_MAX 32
+
+static struct {
+	char * key;
+	char * value;
+} ENV[ENV_MAX];
+
+const char *
+skynet_getenv(const char *key) {
+	int i;
+	for (i=0;i<ENV_MAX && ENV[i].key;i++) {
+		if (strcmp(ENV[i].key, key) == 0)
+			return ENV[i].value;
+	}
+	return NULL;
+}
+
+void
+skynet_setenv(const char *key, const char *value) {
+	int i;
+	for (i=0;i<ENV_MAX && ENV[i].key;i++) {
+		if (strcmp(ENV[i].key, key) == 0)
+			return;
+	}
+	CHECK(i < ENV_MAX);
+	ENV[i].key = strdup(key);
+	ENV[i].value = strdup(value);
+}
+
+static struct skynet_monitor * SM = NULL;
+
+void
+test_init(void) {
+	skynet_harbor_init(0);
+	skynet_handle_init(0);
+	skynet_mq_init();
+	skynet_module_init("./?.so");
+	skynet_timer_init();
+	SM = skynet_monitor_new();
+}
+
+void
+test_module(const char *name, skynet_dl_init init, skynet_dl_release release) {
+	struct skynet_module mod;
+	memset(&mod, 0, sizeof(mod));
+	mod.name = name;
+	mod.init = init;
+	mod.release = release;
+	skynet_module_insert(&mod);
+}
+
+int
+test_dispatch(void) {
+	int n = 0;
+	while (skynet_context_message_dispatch(SM) == 0) {
+		++n;
+	}
+	return n;
+}
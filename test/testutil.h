@@ -0,0 +1,19 @@
+#ifndef SKYNET_TESTUTIL_H
+#define SKYNET_TESTUTIL_H
+
+#include "skynet.h"
+#include "skynet_module.h"
+#include "skynet_server.h"
+#include "skynet_handle.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// 测试失败时打印位置并退出，不受 NDEBUG 影响
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); exit(1); } } while(0)
+
+void test_init(void); // 初始化测试需要的核心模块（句柄、消息队列、模块、定时器）
+void test_module(const char *name, skynet_dl_init init, skynet_dl_release release); // 注册测试中定义的模块
+int test_dispatch(void); // 在本线程中调度消息直到全局队列为空，返回调度的次数
+
+#endif